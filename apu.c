@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #include "apu.h"
+#include "scheduler.h"
 #include "common.h"
+#include <sys/param.h>
 
 uint8_t duty_waves[4][8] = {
 	{ 0, 0, 0, 0, 0, 0, 0, 1, },
@@ -19,6 +21,12 @@ void apu_init(struct gameboy *gb)
 	gb->wave.length.clocks_max = 256;
 	gb->noise.length.clocks_max = 64;
 
+	// Periods for a frequency/divisor of 0 until the registers are written
+	gb->sq1.super.period = 4 * 2048;
+	gb->sq2.super.period = 4 * 2048;
+	gb->wave.super.period = 2 * 2048;
+	gb->noise.super.period = 8;
+
 	gb->apu_enabled = true;
 	apu_disable(gb);
 	apu_enable(gb);
@@ -113,25 +121,25 @@ void apu_sync(struct gameboy *gb)
 		}
 	}
 
-	if (gb->cycles >= gb->sq1.super.next_tick_in) {
+	if (gb->sq1.super.enabled && gb->cycles >= gb->sq1.super.next_tick_in) {
 		gb->sq1.super.next_tick_in += gb->sq1.super.period;
 
 		gb->sq1.duty_index = (gb->sq1.duty_index + 1) & BITS(0, 2);
 	}
 
-	if (gb->cycles >= gb->sq2.super.next_tick_in) {
+	if (gb->sq2.super.enabled && gb->cycles >= gb->sq2.super.next_tick_in) {
 		gb->sq2.super.next_tick_in += gb->sq2.super.period;
 
 		gb->sq2.duty_index = (gb->sq2.duty_index + 1) & BITS(0, 2);
 	}
 
-	if (gb->cycles >= gb->wave.super.next_tick_in) {
+	if (gb->wave.super.enabled && gb->cycles >= gb->wave.super.next_tick_in) {
 		gb->wave.super.next_tick_in += gb->wave.super.period;
 
 		gb->wave.index = ((gb->wave.index + 1) & 0x1F);
 	}
 
-	if (gb->cycles >= gb->noise.super.next_tick_in) {
+	if (gb->noise.super.enabled && gb->cycles >= gb->noise.super.next_tick_in) {
 		gb->noise.super.next_tick_in += gb->noise.super.period;
 
 		uint8_t lo = gb->noise.lfsr & BITS(0, 1);
@@ -188,6 +196,27 @@ void apu_sync(struct gameboy *gb)
 	}
 }
 
+long apu_next_event(struct gameboy *gb)
+{
+	long next = gb->next_apu_sample;
+	if (next < gb->next_apu_sample)
+		++next;
+
+	next = MIN(next, gb->next_apu_frame_in);
+
+	// Disabled channels are silent, and their timers restart on trigger
+	if (gb->sq1.super.enabled)
+		next = MIN(next, gb->sq1.super.next_tick_in);
+	if (gb->sq2.super.enabled)
+		next = MIN(next, gb->sq2.super.next_tick_in);
+	if (gb->wave.super.enabled)
+		next = MIN(next, gb->wave.super.next_tick_in);
+	if (gb->noise.super.enabled)
+		next = MIN(next, gb->noise.super.next_tick_in);
+
+	return next;
+}
+
 static void trigger_envelope(struct apu_envelope_module *env)
 {
 	env->volume = env->volume_max;
@@ -209,10 +238,13 @@ static void trigger_sweep(struct apu_sweep_module *sweep, struct apu_channel *su
 void apu_trigger_square(struct gameboy *gb, struct apu_square_channel *square)
 {
 	square->super.enabled = square->super.dac;
+	square->super.next_tick_in = gb->cycles + square->super.period;
 
 	trigger_envelope(&square->envelope);
 	trigger_length(&square->length);
 	trigger_sweep(&square->sweep, &square->super);
+
+	sched_update(gb, GAMEBOY_EVENT_APU);
 }
 
 void apu_trigger_wave(struct gameboy *gb, struct apu_wave_channel *wave)
@@ -220,8 +252,11 @@ void apu_trigger_wave(struct gameboy *gb, struct apu_wave_channel *wave)
 	wave->index = 0;
 
 	wave->super.enabled = wave->super.dac;
+	wave->super.next_tick_in = gb->cycles + wave->super.period;
 
 	trigger_length(&wave->length);
+
+	sched_update(gb, GAMEBOY_EVENT_APU);
 }
 
 void apu_trigger_noise(struct gameboy *gb, struct apu_noise_channel *noise)
@@ -229,7 +264,10 @@ void apu_trigger_noise(struct gameboy *gb, struct apu_noise_channel *noise)
 	gb->noise.lfsr = BITS(0, 14);
 
 	noise->super.enabled = noise->super.dac;
+	noise->super.next_tick_in = gb->cycles + noise->super.period;
 
 	trigger_envelope(&noise->envelope);
 	trigger_length(&noise->length);
+
+	sched_update(gb, GAMEBOY_EVENT_APU);
 }
@@ -6,6 +6,7 @@
 
 void apu_init(struct gameboy *gb);
 void apu_sync(struct gameboy *gb);
+long apu_next_event(struct gameboy *gb);
 
 void apu_enable(struct gameboy *gb);
 void apu_disable(struct gameboy *gb);
@@ -0,0 +1,415 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+#include "common.h"
+#include <glob.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BATCH_CLOCK_HZ 4194304.0
+#define BATCH_DEFAULT_FRAMES 3600L
+#define BATCH_MAX_SERIAL 4096
+
+enum batch_status {
+	BATCH_OK,
+	BATCH_LOAD_FAILED,
+	BATCH_CRASHED,
+	BATCH_UNIMPLEMENTED_MBC,
+};
+
+static const char *const status_names[] = {
+	[BATCH_OK]                = "ok",
+	[BATCH_LOAD_FAILED]       = "load_failed",
+	[BATCH_CRASHED]           = "crashed",
+	[BATCH_UNIMPLEMENTED_MBC] = "unimplemented_mbc",
+};
+
+struct batch_job {
+	char *path;
+
+	enum batch_status status;
+	uint16_t crash_pc;
+	long cycles;
+	double wall;
+	uint64_t frame_hash;
+
+	// Bytes the ROM shifted out over the (disconnected) link cable, which
+	// is how test ROMs report results
+	char serial[BATCH_MAX_SERIAL];
+	size_t serial_len;
+};
+
+struct batch {
+	struct batch_job *jobs;
+	size_t count;
+	_Atomic size_t next;
+
+	enum gameboy_system system;
+	char *boot;
+	bool jit;
+	long cycles;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long env_long(char *name, long fallback)
+{
+	char *val = getenv(name);
+	if (!val || !*val)
+		return fallback;
+
+	char *end = NULL;
+	long n = strtol(val, &end, 0);
+	if (*end || n <= 0) {
+		GBLOG("Ignoring invalid %s=%s", name, val);
+		return fallback;
+	}
+
+	return n;
+}
+
+// Records the outgoing byte, then completes the transfer the way a
+// disconnected cable would
+static void capture_serial(struct gameboy *gb, void *context)
+{
+	struct batch_job *job = context;
+
+	if (job->serial_len < sizeof(job->serial))
+		job->serial[job->serial_len++] = gb->sb;
+
+	gameboy_start_serial(gb, 0xFF);
+}
+
+// FNV-1a over the final frame
+static uint64_t hash_screen(int (*screen)[144][160])
+{
+	const uint8_t *p = (const uint8_t *)screen;
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	for (size_t i = 0; i < sizeof(*screen); ++i) {
+		hash ^= p[i];
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+static void run_job(struct batch *batch, struct batch_job *job)
+{
+	int (*screen)[144][160] = calloc(1, sizeof(*screen));
+	struct gameboy *gb = gameboy_alloc(batch->system);
+
+	job->status = BATCH_LOAD_FAILED;
+	if (!gb || !screen)
+		goto out;
+	if (batch->boot && gameboy_insert_boot_rom(gb, batch->boot))
+		goto out;
+	if (gameboy_insert_cartridge(gb, job->path))
+		goto out;
+	if (batch->jit && gameboy_enable_jit(gb))
+		goto out;
+
+	gb->screen = screen;
+	gb->on_serial_start.callback = capture_serial;
+	gb->on_serial_start.context = job;
+	gameboy_restart(gb);
+
+	double start = now();
+	while (gb->cycles < batch->cycles && gb->cpu_status != GAMEBOY_CPU_CRASHED)
+		gameboy_run_until(gb, batch->cycles);
+	job->wall = now() - start;
+
+	job->cycles = gb->cycles;
+	job->frame_hash = hash_screen(screen);
+
+	if (gb->cpu_status != GAMEBOY_CPU_CRASHED) {
+		job->status = BATCH_OK;
+	} else {
+		job->crash_pc = gb->pc;
+		switch (gb->mbc) {
+		case GAMEBOY_MBC_NONE:
+		case GAMEBOY_MBC_MBC1:
+		case GAMEBOY_MBC_MBC3:
+			job->status = BATCH_CRASHED;
+			break;
+		default:
+			job->status = BATCH_UNIMPLEMENTED_MBC;
+			break;
+		}
+	}
+
+out:
+	if (gb)
+		gameboy_free(gb);
+	free(screen);
+}
+
+// Each worker owns one emulator at a time and pulls ROMs until none are left
+static void *worker_main(void *arg)
+{
+	struct batch *batch = arg;
+
+	for (;;) {
+		size_t i = atomic_fetch_add(&batch->next, 1);
+		if (i >= batch->count)
+			break;
+
+		run_job(batch, &batch->jobs[i]);
+	}
+
+	return NULL;
+}
+
+static int add_job(struct batch *batch, const char *path)
+{
+	struct batch_job *jobs = realloc(batch->jobs, (batch->count + 1) * sizeof(*jobs));
+	if (!jobs) {
+		GBLOG("Failed to allocate job: %m");
+		return ENOMEM;
+	}
+	batch->jobs = jobs;
+
+	jobs[batch->count] = (struct batch_job){ .path = strdup(path) };
+	if (!jobs[batch->count].path) {
+		GBLOG("Failed to allocate job: %m");
+		return ENOMEM;
+	}
+	++batch->count;
+
+	return 0;
+}
+
+// Every .gb and .gbc file in a directory
+static int load_dir(struct batch *batch, char *dir)
+{
+	char pattern[PATH_MAX];
+	glob_t g = { 0 };
+
+	snprintf(pattern, sizeof(pattern), "%s/*.gb", dir);
+	glob(pattern, 0, NULL, &g);
+	snprintf(pattern, sizeof(pattern), "%s/*.gbc", dir);
+	glob(pattern, GLOB_APPEND, NULL, &g);
+
+	int rc = 0;
+	for (size_t i = 0; !rc && i < g.gl_pathc; ++i)
+		rc = add_job(batch, g.gl_pathv[i]);
+
+	globfree(&g);
+
+	return rc;
+}
+
+// One ROM path per line, relative to the manifest; '#' starts a comment
+static int load_manifest(struct batch *batch, char *path)
+{
+	FILE *in = fopen(path, "r");
+	if (!in) {
+		GBLOG("Failed to open manifest: %m");
+		return errno;
+	}
+
+	char *copy = strdup(path);
+	char *dir = copy ? dirname(copy) : ".";
+
+	char line[PATH_MAX];
+	char rom[PATH_MAX * 2];
+	int rc = 0;
+	while (!rc && fgets(line, sizeof(line), in)) {
+		line[strcspn(line, "#\r\n")] = '\0';
+		if (!*line)
+			continue;
+
+		if (*line == '/')
+			rc = add_job(batch, line);
+		else if (snprintf(rom, sizeof(rom), "%s/%s", dir, line) < (int)sizeof(rom))
+			rc = add_job(batch, rom);
+	}
+
+	free(copy);
+	fclose(in);
+
+	return rc;
+}
+
+static void fwrite_json_string(FILE *out, const char *s, size_t len)
+{
+	fputc('"', out);
+	for (size_t i = 0; i < len; ++i) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20 || c >= 0x7F)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+static void fwrite_csv_string(FILE *out, const char *s, size_t len)
+{
+	fputc('"', out);
+	for (size_t i = 0; i < len; ++i) {
+		if (s[i] == '"')
+			fputc('"', out);
+		fputc(s[i], out);
+	}
+	fputc('"', out);
+}
+
+static double job_speed(const struct batch_job *job)
+{
+	return job->wall > 0 ? job->cycles / BATCH_CLOCK_HZ / job->wall : 0;
+}
+
+static void fwrite_json(FILE *out, struct batch *batch)
+{
+	fprintf(out, "[\n");
+	for (size_t i = 0; i < batch->count; ++i) {
+		const struct batch_job *job = &batch->jobs[i];
+
+		fprintf(out, "\t{\"rom\": ");
+		fwrite_json_string(out, job->path, strlen(job->path));
+		fprintf(out, ", \"status\": \"%s\"", status_names[job->status]);
+		if (job->status == BATCH_CRASHED || job->status == BATCH_UNIMPLEMENTED_MBC)
+			fprintf(out, ", \"crash_pc\": \"%04X\"", job->crash_pc);
+		fprintf(out, ", \"cycles\": %ld, \"frames\": %.1f, \"wall\": %.3f, \"speed\": %.2f",
+		        job->cycles, (double)job->cycles / GAMEBOY_FRAME_CYCLES,
+		        job->wall, job_speed(job));
+		fprintf(out, ", \"frame_hash\": \"%016lx\", \"serial\": ",
+		        (unsigned long)job->frame_hash);
+		fwrite_json_string(out, job->serial, job->serial_len);
+		fprintf(out, "}%s\n", i + 1 < batch->count ? "," : "");
+	}
+	fprintf(out, "]\n");
+}
+
+static void fwrite_csv(FILE *out, struct batch *batch)
+{
+	fprintf(out, "rom,status,crash_pc,cycles,frames,wall,speed,frame_hash,serial\n");
+	for (size_t i = 0; i < batch->count; ++i) {
+		const struct batch_job *job = &batch->jobs[i];
+
+		fwrite_csv_string(out, job->path, strlen(job->path));
+		fprintf(out, ",%s,", status_names[job->status]);
+		if (job->status == BATCH_CRASHED || job->status == BATCH_UNIMPLEMENTED_MBC)
+			fprintf(out, "%04X", job->crash_pc);
+		fprintf(out, ",%ld,%.1f,%.3f,%.2f,%016lx,",
+		        job->cycles, (double)job->cycles / GAMEBOY_FRAME_CYCLES,
+		        job->wall, job_speed(job), (unsigned long)job->frame_hash);
+		fwrite_csv_string(out, job->serial, job->serial_len);
+		fputc('\n', out);
+	}
+}
+
+// JSON if the report is named *.json, CSV otherwise
+static int save_report(struct batch *batch, char *path)
+{
+	FILE *out = fopen(path, "w");
+	if (!out) {
+		GBLOG("Failed to open report for writing: %m");
+		return errno;
+	}
+
+	size_t len = strlen(path);
+	if (len >= 5 && strcmp(path + len - 5, ".json") == 0)
+		fwrite_json(out, batch);
+	else
+		fwrite_csv(out, batch);
+
+	int rc = 0;
+	if (ferror(out)) {
+		GBLOG("Failed to write report: %m");
+		rc = EIO;
+	}
+	fclose(out);
+
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		fprintf(stderr, "Usage: [GBC=1] [BOOT=$boot] [CPU=jit] [FRAMES=n | CYCLES=n] [JOBS=n] "
+		                "%s $dir|$manifest $report.{csv,json}\n", argv[0]);
+		return 1;
+	}
+
+	struct batch batch = {
+		.system = getenv("GBC") ? GAMEBOY_SYSTEM_GBC : GAMEBOY_SYSTEM_DMG,
+		.boot = getenv("BOOT"),
+	};
+
+	char *cpu = getenv("CPU");
+	batch.jit = cpu && strcmp(cpu, "jit") == 0;
+
+	long frames = env_long("FRAMES", BATCH_DEFAULT_FRAMES);
+	batch.cycles = env_long("CYCLES", frames * GAMEBOY_FRAME_CYCLES);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	long jobs = env_long("JOBS", cpus > 0 ? cpus : 1);
+
+	struct stat st;
+	if (stat(argv[1], &st)) {
+		GBLOG("Failed to stat %s: %m", argv[1]);
+		return 1;
+	}
+	if (S_ISDIR(st.st_mode) ? load_dir(&batch, argv[1]) : load_manifest(&batch, argv[1]))
+		return 1;
+	if (!batch.count) {
+		GBLOG("No ROMs found in %s", argv[1]);
+		return 1;
+	}
+
+	if ((size_t)jobs > batch.count)
+		jobs = batch.count;
+
+	pthread_t *workers = calloc(jobs, sizeof(*workers));
+	if (!workers) {
+		GBLOG("Failed to allocate workers: %m");
+		return 1;
+	}
+
+	double start = now();
+	long started = 0;
+	for (; started < jobs; ++started) {
+		errno = pthread_create(&workers[started], NULL, worker_main, &batch);
+		if (errno) {
+			GBLOG("Failed to start worker: %m");
+			break;
+		}
+	}
+	if (!started)
+		return 1;
+	for (long i = 0; i < started; ++i)
+		pthread_join(workers[i], NULL);
+	double elapsed = now() - start;
+
+	size_t counts[sizeof(status_names) / sizeof(status_names[0])] = { 0 };
+	for (size_t i = 0; i < batch.count; ++i)
+		++counts[batch.jobs[i].status];
+
+	printf("roms:     %zu (%ld workers, %.3f s)\n", batch.count, started, elapsed);
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); ++i)
+		printf("%s: %zu\n", status_names[i], counts[i]);
+
+	int rc = save_report(&batch, argv[2]);
+
+	for (size_t i = 0; i < batch.count; ++i)
+		free(batch.jobs[i].path);
+	free(batch.jobs);
+	free(workers);
+
+	return rc || counts[BATCH_OK] != batch.count;
+}
@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+#include "common.h"
+#include "perf.h"
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_CLOCK_HZ 4194304.0
+#define BENCH_DEFAULT_FRAMES 3600L
+
+static int screen[144][160];
+static uint8_t screen_indexed[144][160];
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long env_long(char *name, long fallback)
+{
+	char *val = getenv(name);
+	if (!val || !*val)
+		return fallback;
+
+	char *end = NULL;
+	long n = strtol(val, &end, 0);
+	if (*end || n <= 0) {
+		GBLOG("Ignoring invalid %s=%s", name, val);
+		return fallback;
+	}
+
+	return n;
+}
+
+// Idle loops are loaded next to the ROM when present
+static int load_idle_loops(struct gameboy *gb, char *cart)
+{
+	char idle[PATH_MAX];
+	if (snprintf(idle, sizeof(idle), "%s.idle", cart) < (int)sizeof(idle) &&
+	    access(idle, R_OK) == 0)
+		return gameboy_load_idle_loops(gb, idle);
+
+	return 0;
+}
+
+// INSTANCES=n runs n copies of the cartridge a frame each in turn and reports
+// their combined throughput
+static int bench_instances(enum gameboy_system system, char *cart, char *boot,
+                           long cycles, size_t instances)
+{
+	struct gameboy_batch *batch = gameboy_batch_alloc(system, instances);
+	if (!batch)
+		return 1;
+
+	for (size_t i = 0; i < batch->count; ++i)
+		if (boot && gameboy_insert_boot_rom(batch->gbs[i], boot))
+			return 1;
+	if (gameboy_batch_insert_cartridge(batch, cart))
+		return 1;
+	gameboy_inspect_cartridge(batch->gbs[0]);
+
+	char *cpu = getenv("CPU");
+	for (size_t i = 0; i < batch->count; ++i) {
+		if (load_idle_loops(batch->gbs[i], cart))
+			return 1;
+		if (cpu && strcmp(cpu, "jit") == 0 && gameboy_enable_jit(batch->gbs[i]))
+			return 1;
+	}
+
+	gameboy_batch_restart(batch);
+	for (size_t i = 0; i < batch->count; ++i)
+		batch->gbs[i]->screen = (void *)screen;
+
+	double start = now();
+	unsigned int exits = 0;
+	while (batch->gbs[0]->cycles < cycles && !(exits & GAMEBOY_RUN_CRASHED))
+		exits = gameboy_batch_run_frame(batch);
+	double elapsed = now() - start;
+
+	long total = 0;
+	for (size_t i = 0; i < batch->count; ++i) {
+		struct gameboy *gb = batch->gbs[i];
+		if (gb->cpu_status == GAMEBOY_CPU_CRASHED)
+			GBLOG("Instance %lu crashed at PC=%04X after %ld cycles",
+			      (unsigned long)i, gb->pc, gb->cycles);
+		total += gb->cycles;
+	}
+
+	printf("cart:      %s (%s)\n", cart, system == GAMEBOY_SYSTEM_GBC ? "GBC" : "DMG");
+	printf("instances: %lu\n", (unsigned long)batch->count);
+	printf("cycles:    %ld\n", total);
+	printf("frames:    %.1f\n", (double)total / GAMEBOY_FRAME_CYCLES);
+	printf("wall:      %.3f s\n", elapsed);
+	printf("cycles/s:  %.0f\n", total / elapsed);
+	printf("fps:       %.1f\n", total / elapsed / GAMEBOY_FRAME_CYCLES);
+	printf("speed:     %.2fx\n", total / BENCH_CLOCK_HZ / elapsed);
+	PERF_REPORT();
+
+	gameboy_batch_free(batch);
+
+	return !!(exits & GAMEBOY_RUN_CRASHED);
+}
+
+int main(int argc, char **argv)
+{
+	enum gameboy_system system = GAMEBOY_SYSTEM_DMG;
+	if (getenv("GBC"))
+		system = GAMEBOY_SYSTEM_GBC;
+
+	char *cart = getenv("CART");
+	char *boot = getenv("BOOT");
+
+	if (!cart && argc >= 2)
+		cart = argv[1];
+	if (!boot && argc >= 3)
+		boot = argv[2];
+
+	if (!cart) {
+		fprintf(stderr, "Usage: [GBC=1] [FRAMES=n | CYCLES=n] [INSTANCES=n] [FRAMESKIP=n] [INDEXED=1] %s $cart [$boot]\n", argv[0]);
+		return 1;
+	}
+
+	long frames = env_long("FRAMES", BENCH_DEFAULT_FRAMES);
+	long cycles = env_long("CYCLES", frames * GAMEBOY_FRAME_CYCLES);
+
+	long instances = env_long("INSTANCES", 1);
+	if (instances > 1)
+		return bench_instances(system, cart, boot, cycles, instances);
+
+	struct gameboy *gb = gameboy_alloc(system);
+	if (!gb)
+		return 1;
+
+	if (boot && gameboy_insert_boot_rom(gb, boot))
+		return 1;
+	if (gameboy_insert_cartridge(gb, cart))
+		return 1;
+	gameboy_inspect_cartridge(gb);
+
+	if (load_idle_loops(gb, cart))
+		return 1;
+
+	char *cpu = getenv("CPU");
+	if (cpu && strcmp(cpu, "jit") == 0 && gameboy_enable_jit(gb))
+		return 1;
+
+	char *profile = getenv("PROFILE");
+	bool profiling = profile && strcmp(profile, "1") == 0;
+	if (profiling && gameboy_enable_profile(gb))
+		return 1;
+
+	char *trace = getenv("TRACE");
+	bool tracing = trace && strcmp(trace, "1") == 0;
+	bool streaming = trace && strcmp(trace, "stream") == 0;
+	char trace_path[PATH_MAX];
+	if ((tracing || streaming) &&
+	    (snprintf(trace_path, sizeof(trace_path), "%s.trace", cart) >= (int)sizeof(trace_path) ||
+	     gameboy_enable_trace(gb, 0, streaming ? trace_path : NULL)))
+		return 1;
+
+	gameboy_restart(gb);
+	if (getenv("INDEXED")) {
+		gb->screen = NULL;
+		gb->screen_indexed = (void *)screen_indexed;
+	} else {
+		gb->screen = (void *)screen;
+	}
+	gb->frameskip = env_long("FRAMESKIP", 0);
+
+	double start = now();
+	while (gb->cycles < cycles && gb->cpu_status != GAMEBOY_CPU_CRASHED)
+		gameboy_run_until(gb, cycles);
+	double elapsed = now() - start;
+
+	bool crashed = gb->cpu_status == GAMEBOY_CPU_CRASHED;
+	if (crashed)
+		GBLOG("CPU crashed at PC=%04X after %ld cycles", gb->pc, gb->cycles);
+
+	double emulated = gb->cycles / BENCH_CLOCK_HZ;
+
+	printf("cart:     %s (%s)\n", cart, system == GAMEBOY_SYSTEM_GBC ? "GBC" : "DMG");
+	printf("cycles:   %ld\n", gb->cycles);
+	printf("frames:   %.1f\n", (double)gb->cycles / GAMEBOY_FRAME_CYCLES);
+	printf("wall:     %.3f s\n", elapsed);
+	printf("cycles/s: %.0f\n", gb->cycles / elapsed);
+	printf("fps:      %.1f\n", gb->cycles / elapsed / GAMEBOY_FRAME_CYCLES);
+	printf("speed:    %.2fx\n", emulated / elapsed);
+	PERF_REPORT();
+
+	char profile_path[PATH_MAX];
+	if (profiling) {
+		gameboy_report_profile(gb, 20);
+		if (snprintf(profile_path, sizeof(profile_path), "%s.profile", cart) < (int)sizeof(profile_path))
+			gameboy_save_profile(gb, profile_path);
+	}
+
+	if (tracing)
+		gameboy_save_trace(gb, trace_path);
+
+	gameboy_free(gb);
+
+	return crashed;
+}
@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "block.h"
+#include "jit.h"
+#include "common.h"
+#include <string.h>
+
+// Instruction lengths in bytes; 0 marks opcodes that can't be predecoded
+static const uint8_t lengths[0x100] = {
+	1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1, // 0x
+	1, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 1x
+	2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 2x
+	2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 3x
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 4x
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 5x
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 6x
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 7x
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 8x
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 9x
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // Ax
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // Bx
+	1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1, // Cx
+	1, 1, 3, 0, 3, 1, 2, 1, 1, 1, 3, 0, 3, 0, 2, 1, // Dx
+	2, 1, 1, 0, 0, 1, 2, 1, 2, 1, 3, 0, 0, 0, 2, 1, // Ex
+	2, 1, 1, 1, 0, 1, 2, 1, 2, 1, 3, 1, 0, 0, 2, 1, // Fx
+};
+
+// Anything that can leave PC somewhere other than the next instruction
+static bool ends_block(uint8_t opcode)
+{
+	switch (opcode) {
+	case 0x10: case 0x76:
+	case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+	case 0xC0: case 0xC2: case 0xC3: case 0xC4: case 0xC7:
+	case 0xC8: case 0xC9: case 0xCA: case 0xCC: case 0xCD: case 0xCF:
+	case 0xD0: case 0xD2: case 0xD4: case 0xD7:
+	case 0xD8: case 0xD9: case 0xDA: case 0xDC: case 0xDF:
+	case 0xE7: case 0xE9: case 0xEF:
+	case 0xF7: case 0xFF:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Finds the host memory backing PC, along with the range of addresses it
+// covers; returns NULL for anything that isn't safe to predecode (boot ROM,
+// VRAM, cartridge RAM, I/O).
+static const uint8_t *map_region(struct gameboy *gb, uint16_t pc,
+                                 enum gameboy_block_region *region,
+                                 int *start, int *end)
+{
+	switch (pc) {
+	case 0x0000 ... 0x00FF:
+	case 0x0200 ... 0x08FF:
+		if (gb->boot_enabled && (pc < 0x0100 || gb->gbc))
+			return NULL;
+		; // fallthrough
+	case 0x0100 ... 0x01FF:
+	case 0x0900 ... 0x3FFF:
+		if (!gb->rom)
+			return NULL;
+		*region = GAMEBOY_BLOCK_ROM0;
+		*start = 0x0000;
+		*end = (gb->boot_enabled && gb->gbc && pc < 0x0200) ? 0x0200 : 0x4000;
+		return gb->rom[0];
+
+	case 0x4000 ... 0x7FFF:
+		if (!gb->rom)
+			return NULL;
+		*region = GAMEBOY_BLOCK_ROMX;
+		*start = 0x4000;
+		*end = 0x8000;
+		return gb->romx;
+
+	case 0xC000 ... 0xCFFF:
+		*region = GAMEBOY_BLOCK_WRAM0;
+		*start = 0xC000;
+		*end = 0xD000;
+		return gb->wram[0];
+
+	case 0xD000 ... 0xDFFF:
+		*region = GAMEBOY_BLOCK_WRAMX;
+		*start = 0xD000;
+		*end = 0xE000;
+		return gb->wramx;
+
+	case 0xFF80 ... 0xFFFE:
+		*region = GAMEBOY_BLOCK_HRAM;
+		*start = 0xFF80;
+		*end = 0xFFFF;
+		return gb->hram;
+
+	default:
+		return NULL;
+	}
+}
+
+static size_t hash(const uint8_t *mem, uint16_t pc)
+{
+	uint32_t bank = (uintptr_t)mem >> 12;
+
+	return (pc ^ ((bank * 0x9E3779B1u) >> 20)) % BLOCK_CACHE_SIZE;
+}
+
+static bool decode(struct gameboy *gb, struct gameboy_block *block,
+                   const uint8_t *mem, enum gameboy_block_region region,
+                   uint16_t pc, int start, int end)
+{
+	block->mem = mem;
+	block->generation = gb->blocks->generation;
+	block->pc = pc;
+	block->region = region;
+	block->count = 0;
+	block->native = NULL;
+	block->hits = 0;
+	block->native_failed = false;
+	block->idle = GAMEBOY_BLOCK_IDLE_UNKNOWN;
+	block->idle_deadline = 0;
+
+	int addr = pc;
+	while (block->count < BLOCK_MAX_INSNS) {
+		uint8_t opcode = mem[addr - start];
+		int length = lengths[opcode];
+		if (!length || addr + length > end)
+			break;
+
+		struct gameboy_insn *insn = &block->insns[block->count++];
+		insn->opcode = opcode;
+		insn->length = length;
+		insn->imm = 0;
+		if (length >= 2)
+			insn->imm |= mem[addr + 1 - start];
+		if (length >= 3)
+			insn->imm |= mem[addr + 2 - start] << 8;
+
+		addr += length;
+		if (ends_block(opcode))
+			break;
+	}
+
+	if (!block->count) {
+		block->mem = NULL;
+		return false;
+	}
+
+	if (region >= GAMEBOY_BLOCK_WRAM0)
+		for (int page = pc >> 8; page <= (addr - 1) >> 8; ++page)
+			gb->blocks->code_pages[page] = true;
+
+	return true;
+}
+
+struct gameboy_block *block_lookup(struct gameboy *gb, uint16_t pc)
+{
+	enum gameboy_block_region region;
+	int start, end;
+
+	const uint8_t *mem = map_region(gb, pc, &region, &start, &end);
+	if (!mem)
+		return NULL;
+
+	struct gameboy_block *block = &gb->blocks->blocks[hash(mem, pc)];
+	if (block->mem == mem && block->pc == pc && block_mapped(gb, block))
+		return block;
+
+	return decode(gb, block, mem, region, pc, start, end) ? block : NULL;
+}
+
+void block_invalidate_ram(struct gameboy *gb)
+{
+	++gb->blocks->generation;
+	memset(gb->blocks->code_pages, 0, sizeof(gb->blocks->code_pages));
+}
+
+void gameboy_flush_blocks(struct gameboy *gb)
+{
+	memset(gb->blocks, 0, sizeof(*gb->blocks));
+	jit_reset(gb);
+}
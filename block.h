@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef EGBE_BLOCK_H
+#define EGBE_BLOCK_H
+
+#include "gameboy.h"
+
+#define BLOCK_MAX_INSNS 16
+#define BLOCK_CACHE_SIZE 4096
+
+enum gameboy_block_region {
+	GAMEBOY_BLOCK_ROM0,
+	GAMEBOY_BLOCK_ROMX,
+	GAMEBOY_BLOCK_WRAM0,
+	GAMEBOY_BLOCK_WRAMX,
+	GAMEBOY_BLOCK_HRAM,
+};
+
+enum gameboy_block_idle {
+	GAMEBOY_BLOCK_IDLE_UNKNOWN,
+	GAMEBOY_BLOCK_IDLE_NO,
+	GAMEBOY_BLOCK_IDLE_YES,
+};
+
+// A predecoded instruction; the opcode byte is fetched (and ticked) as usual,
+// but operand bytes come from imm instead of the bus
+struct gameboy_insn {
+	uint8_t opcode;
+	uint8_t length;
+	uint16_t imm;
+};
+
+// A straight-line run of instructions ending at the first branch, keyed by
+// the host memory it was decoded from (which identifies the bank) and PC
+struct gameboy_block {
+	const uint8_t *mem;
+	uint32_t generation;
+	uint16_t pc;
+	uint8_t region;
+	uint8_t count;
+	struct gameboy_insn insns[BLOCK_MAX_INSNS];
+
+	// Native translation of (a prefix of) insns; see jit.c
+	void (*native)(struct gameboy *gb);
+	long native_cycles;
+	uint16_t hits;
+	bool native_double_speed;
+	bool native_failed;
+
+	// Busy-wait loop detection; see cpu.c
+	uint8_t idle;
+	uint8_t idle_cycles;
+	uint8_t idle_ime;
+	uint16_t idle_regs[5];
+	long idle_entry;
+	long idle_deadline;
+};
+
+struct gameboy_block_cache {
+	// Bumped whenever RAM containing decoded code is written; RAM blocks
+	// from older generations are stale.  ROM blocks never go stale.
+	uint32_t generation;
+	bool code_pages[0x100];
+
+	struct gameboy_block blocks[BLOCK_CACHE_SIZE];
+};
+
+struct gameboy_block *block_lookup(struct gameboy *gb, uint16_t pc);
+void block_invalidate_ram(struct gameboy *gb);
+
+// A block may stop matching memory part-way through if it switches its own
+// bank or overwrites itself
+static inline bool block_mapped(struct gameboy *gb, const struct gameboy_block *block)
+{
+	switch (block->region) {
+	case GAMEBOY_BLOCK_ROM0:
+		return true;
+	case GAMEBOY_BLOCK_ROMX:
+		return block->mem == gb->romx;
+	case GAMEBOY_BLOCK_WRAMX:
+		if (block->mem != gb->wramx)
+			return false;
+		; // fallthrough
+	default:
+		return block->generation == gb->blocks->generation;
+	}
+}
+
+static inline void block_notify_write(struct gameboy *gb, uint16_t addr)
+{
+	if (gb->blocks->code_pages[addr >> 8])
+		block_invalidate_ram(gb);
+}
+
+#endif
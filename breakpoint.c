@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "breakpoint.h"
+#include "mmu.h"
+#include "common.h"
+
+static void stop(struct gameboy *gb, enum gameboy_breakpoint_type type,
+                 uint16_t addr, uint8_t val)
+{
+	struct gameboy_breakpoints *bp = gb->breakpoints;
+
+	bp->hit = (struct gameboy_breakpoint_hit){
+		.type = type,
+		.addr = addr,
+		.pc = bp->pc,
+		.val = val,
+		.outside_insn = bp->outside_insn,
+	};
+	bp->hit_valid = true;
+
+	gb->run_exits |= GAMEBOY_RUN_BREAKPOINT;
+}
+
+// Called before each instruction is fetched; true stops before running it
+bool breakpoint_exec(struct gameboy *gb)
+{
+	struct gameboy_breakpoints *bp = gb->breakpoints;
+
+	bp->pc = gb->pc;
+	bp->outside_insn = false;
+
+	if (bp->resuming) {
+		bp->resuming = false;
+		if (gb->pc == bp->resume_pc)
+			return false;
+	}
+
+	if (!breakpoint_test(bp->exec, gb->pc))
+		return false;
+
+	stop(gb, GAMEBOY_BREAK_EXEC, gb->pc, 0);
+	bp->resuming = true;
+	bp->resume_pc = gb->pc;
+
+	return true;
+}
+
+// Watchpoints let the access (and the rest of its instruction) complete
+// and stop at the next instruction boundary
+void breakpoint_read(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	if (breakpoint_test(gb->breakpoints->read, addr))
+		stop(gb, GAMEBOY_BREAK_READ, addr, val);
+}
+
+void breakpoint_write(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	if (breakpoint_test(gb->breakpoints->write, addr))
+		stop(gb, GAMEBOY_BREAK_WRITE, addr, val);
+}
+
+static void set_bit(uint8_t *bits, uint16_t addr, bool on, size_t *count, uint16_t *pages)
+{
+	if (breakpoint_test(bits, addr) == on)
+		return;
+
+	bits[addr >> 3] ^= 1 << (addr & 7);
+
+	if (on)
+		++*count;
+	else
+		--*count;
+
+	if (pages && on)
+		++pages[addr >> 8];
+	else if (pages)
+		--pages[addr >> 8];
+}
+
+int gameboy_set_breakpoint(struct gameboy *gb, uint16_t addr, unsigned int types)
+{
+	struct gameboy_breakpoints *bp = gb->breakpoints;
+	if (!bp) {
+		bp = calloc(1, sizeof(*bp));
+		if (!bp) {
+			GBLOG("Failed to allocate breakpoints: %m");
+			return ENOMEM;
+		}
+		gb->breakpoints = bp;
+	}
+
+	if (types & GAMEBOY_BREAK_EXEC)
+		set_bit(bp->exec, addr, true, &bp->count, NULL);
+	if (types & GAMEBOY_BREAK_READ)
+		set_bit(bp->read, addr, true, &bp->count, bp->read_pages);
+	if (types & GAMEBOY_BREAK_WRITE)
+		set_bit(bp->write, addr, true, &bp->count, bp->write_pages);
+
+	// Rebuild the page tables and I/O handlers around the watched set
+	if (types & (GAMEBOY_BREAK_READ | GAMEBOY_BREAK_WRITE))
+		mmu_init(gb);
+
+	return 0;
+}
+
+void gameboy_clear_breakpoint(struct gameboy *gb, uint16_t addr, unsigned int types)
+{
+	struct gameboy_breakpoints *bp = gb->breakpoints;
+	if (!bp)
+		return;
+
+	if (types & GAMEBOY_BREAK_EXEC)
+		set_bit(bp->exec, addr, false, &bp->count, NULL);
+	if (types & GAMEBOY_BREAK_READ)
+		set_bit(bp->read, addr, false, &bp->count, bp->read_pages);
+	if (types & GAMEBOY_BREAK_WRITE)
+		set_bit(bp->write, addr, false, &bp->count, bp->write_pages);
+
+	if (!bp->count)
+		gameboy_clear_breakpoints(gb);
+	else if (types & (GAMEBOY_BREAK_READ | GAMEBOY_BREAK_WRITE))
+		mmu_init(gb);
+}
+
+void gameboy_clear_breakpoints(struct gameboy *gb)
+{
+	if (!gb->breakpoints)
+		return;
+
+	breakpoint_free(gb);
+	mmu_init(gb);
+}
+
+bool gameboy_last_breakpoint(struct gameboy *gb, struct gameboy_breakpoint_hit *hit)
+{
+	if (!gb->breakpoints || !gb->breakpoints->hit_valid)
+		return false;
+
+	*hit = gb->breakpoints->hit;
+	return true;
+}
+
+void breakpoint_free(struct gameboy *gb)
+{
+	if (!gb->breakpoints)
+		return;
+
+	free(gb->breakpoints);
+	gb->breakpoints = NULL;
+}
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef EGBE_BREAKPOINT_H
+#define EGBE_BREAKPOINT_H
+
+#include "gameboy.h"
+
+// Only allocated while something is armed, so the CPU's per-instruction
+// test is a NULL check the rest of the time.  Watched memory is kept out of
+// the page tables and watched I/O registers get diverting handlers (see
+// mmu.c), which leaves the fast paths untouched.
+struct gameboy_breakpoints {
+	uint8_t exec[0x10000 / 8];
+	uint8_t read[0x10000 / 8];
+	uint8_t write[0x10000 / 8];
+	size_t count;
+
+	// Armed watchpoints per page
+	uint16_t read_pages[0x100];
+	uint16_t write_pages[0x100];
+
+	// The handlers displaced from watched I/O registers
+	uint8_t (*io_reads[0x100])(struct gameboy *gb, uint16_t addr);
+	void (*io_writes[0x100])(struct gameboy *gb, uint16_t addr, uint8_t val);
+
+	// Start of the current instruction, for watchpoint hits, or the PC at
+	// the time when no instruction is running
+	uint16_t pc;
+	bool outside_insn;
+
+	// The instruction stopped at runs without stopping again on resume
+	bool resuming;
+	uint16_t resume_pc;
+
+	bool hit_valid;
+	struct gameboy_breakpoint_hit hit;
+};
+
+static inline bool breakpoint_test(const uint8_t *bits, uint16_t addr)
+{
+	return bits[addr >> 3] & (1 << (addr & 7));
+}
+
+// Interrupt dispatch and HDMA access memory between instructions
+static inline void breakpoint_outside_insn(struct gameboy *gb)
+{
+	if (gb->breakpoints) {
+		gb->breakpoints->pc = gb->pc;
+		gb->breakpoints->outside_insn = true;
+	}
+}
+
+bool breakpoint_exec(struct gameboy *gb);
+void breakpoint_read(struct gameboy *gb, uint16_t addr, uint8_t val);
+void breakpoint_write(struct gameboy *gb, uint16_t addr, uint8_t val);
+void breakpoint_free(struct gameboy *gb);
+
+#endif
@@ -1,11 +1,16 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
-#include "apu.h"
+#include "block.h"
+#include "breakpoint.h"
 #include "cpu.h"
-#include "lcd.h"
+#include "jit.h"
 #include "mmu.h"
-#include "serial.h"
-#include "timer.h"
+#include "perf.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "trace.h"
 #include "common.h"
+#include <limits.h>
+#include <string.h>
 
 enum {
 	FLAG_CARRY     = 0x10,
@@ -25,10 +30,8 @@ static void tick(struct gameboy *gb)
 		gb->cycles += 4;
 	}
 
-	apu_sync(gb);
-	lcd_sync(gb);
-	serial_sync(gb);
-	timer_sync(gb);
+	if (gb->cycles >= gb->next_event_in)
+		sched_sync(gb);
 }
 
 static uint8_t timed_read(struct gameboy *gb, uint16_t addr)
@@ -58,269 +61,328 @@ static uint16_t iv16(struct gameboy *gb)
 	return (hi << 8) | lo;
 }
 
-static inline void set_flags(struct gameboy *gb, bool c, bool h, bool n, bool z)
+// Operand fetches from a predecoded instruction still take their bus cycles,
+// with PC advanced first just as iv() does
+static uint8_t imm8(struct gameboy *gb, const struct gameboy_insn *insn)
 {
-	gb->f = (c ? FLAG_CARRY     : 0)
-	      | (h ? FLAG_HALFCARRY : 0)
-	      | (n ? FLAG_SUBTRACT  : 0)
-	      | (z ? FLAG_ZERO      : 0);
-}
+	++gb->pc;
+	tick(gb);
 
-static inline void set_flags_chn(struct gameboy *gb, bool c, bool h, bool n)
-{
-	gb->f = (gb->f & ~(FLAG_CARRY | FLAG_HALFCARRY | FLAG_SUBTRACT))
-	      | (c ? FLAG_CARRY     : 0)
-	      | (h ? FLAG_HALFCARRY : 0)
-	      | (n ? FLAG_SUBTRACT  : 0);
+	return insn->imm;
 }
 
-static inline void set_flags_hnz(struct gameboy *gb, bool h, bool n, bool z)
+static uint16_t imm16(struct gameboy *gb, const struct gameboy_insn *insn)
 {
-	gb->f = (gb->f & ~(FLAG_HALFCARRY | FLAG_SUBTRACT | FLAG_ZERO))
-	      | (h ? FLAG_HALFCARRY : 0)
-	      | (n ? FLAG_SUBTRACT  : 0)
-	      | (z ? FLAG_ZERO      : 0);
-}
-
-static inline bool check_overflow(int mask, int lhs, int rhs, bool carry)
-{
-	return (lhs & mask) + (rhs & mask) + carry > mask;
-}
+	++gb->pc;
+	tick(gb);
+	++gb->pc;
+	tick(gb);
 
-static inline bool check_underflow(int mask, int lhs, int rhs, bool carry)
-{
-	return (lhs & mask) < (rhs & mask) + carry;
-}
+	return insn->imm;
+}
+
+// Flags are evaluated lazily: instructions record just enough of their
+// operands and result for each flag to be recovered on demand, and F is only
+// assembled for PUSH AF or when something outside of the CPU needs it.
+//   Z: set iff flag_z == 0 (usually the result itself)
+//   N: flag_n
+//   H: bit 4 of flag_h (lhs ^ rhs ^ result for 8-bit arithmetic)
+//   C: bit 8 of flag_c (the untruncated 8-bit result)
+#define ZERO      (gb->flag_z == 0)
+#define SUBTRACT  (gb->flag_n)
+#define HALFCARRY ((gb->flag_h >> 4) & 1)
+#define CARRY     ((gb->flag_c >> 8) & 1)
+
+#define FLAGS(z, n, h, c) \
+	do { \
+		gb->flag_z = (z); \
+		gb->flag_n = (n); \
+		gb->flag_h = (h); \
+		gb->flag_c = (c); \
+	} while (0)
+
+#define FLAG_H_SET 0x0010
+#define FLAG_C_SET 0x0100
+
+void gameboy_pack_flags(struct gameboy *gb)
+{
+	gb->f = (CARRY     ? FLAG_CARRY     : 0)
+	      | (HALFCARRY ? FLAG_HALFCARRY : 0)
+	      | (SUBTRACT  ? FLAG_SUBTRACT  : 0)
+	      | (ZERO      ? FLAG_ZERO      : 0);
+}
+
+void gameboy_unpack_flags(struct gameboy *gb)
+{
+	FLAGS(!(gb->f & FLAG_ZERO),
+	      !!(gb->f & FLAG_SUBTRACT),
+	      (gb->f & FLAG_HALFCARRY) ? FLAG_H_SET : 0,
+	      (gb->f & FLAG_CARRY) ? FLAG_C_SET : 0);
+}
+
+// Register operations are macros over lvalues rather than functions taking
+// uint8_t pointers, so every opcode handler gets its own expansion with the
+// operand fixed at compile time.  Value operands are evaluated exactly once.
+#define LD(r, v) ((r) = (v))
+
+#define INC(r) \
+	do { \
+		uint8_t old_ = (r)++; \
+		gb->flag_z = (r); \
+		gb->flag_n = false; \
+		gb->flag_h = old_ ^ (r) ^ 1; \
+	} while (0)
+
+#define DEC(r) \
+	do { \
+		uint8_t old_ = (r)--; \
+		gb->flag_z = (r); \
+		gb->flag_n = true; \
+		gb->flag_h = old_ ^ (r) ^ 1; \
+	} while (0)
+
+#define ADD(v) \
+	do { \
+		uint8_t v_ = (v); \
+		unsigned res_ = gb->a + v_; \
+		FLAGS(res_ & 0xFF, false, gb->a ^ v_ ^ res_, res_); \
+		gb->a = res_; \
+	} while (0)
+
+#define ADC(v) \
+	do { \
+		uint8_t v_ = (v); \
+		unsigned res_ = gb->a + v_ + CARRY; \
+		FLAGS(res_ & 0xFF, false, gb->a ^ v_ ^ res_, res_); \
+		gb->a = res_; \
+	} while (0)
+
+// A borrow wraps the result negative, which sets bit 8 just like a carry
+#define SUB(v) \
+	do { \
+		uint8_t v_ = (v); \
+		unsigned res_ = gb->a - v_; \
+		FLAGS(res_ & 0xFF, true, gb->a ^ v_ ^ res_, res_); \
+		gb->a = res_; \
+	} while (0)
+
+#define SBC(v) \
+	do { \
+		uint8_t v_ = (v); \
+		unsigned res_ = gb->a - v_ - CARRY; \
+		FLAGS(res_ & 0xFF, true, gb->a ^ v_ ^ res_, res_); \
+		gb->a = res_; \
+	} while (0)
+
+#define AND(v) \
+	do { \
+		gb->a &= (v); \
+		FLAGS(gb->a, false, FLAG_H_SET, 0); \
+	} while (0)
+
+#define XOR(v) \
+	do { \
+		gb->a ^= (v); \
+		FLAGS(gb->a, false, 0, 0); \
+	} while (0)
+
+#define OR(v) \
+	do { \
+		gb->a |= (v); \
+		FLAGS(gb->a, false, 0, 0); \
+	} while (0)
 
-#define _overflow(m, x, y, c, ...) check_overflow(m, x, y, c)
-#define overflow4(x, y, ...)  _overflow(0x000F, x, y, ##__VA_ARGS__, false)
-#define overflow8(x, y, ...)  _overflow(0x00FF, x, y, ##__VA_ARGS__, false)
-#define overflow12(x, y, ...) _overflow(0x0FFF, x, y, ##__VA_ARGS__, false)
-#define overflow16(x, y, ...) _overflow(0xFFFF, x, y, ##__VA_ARGS__, false)
-
-#define _underflow(m, x, y, c, ...) check_underflow(m, x, y, c)
-#define underflow4(x, y, ...)  _underflow(0x000F, x, y, ##__VA_ARGS__, false)
-#define underflow8(x, y, ...)  _underflow(0x00FF, x, y, ##__VA_ARGS__, false)
-#define underflow12(x, y, ...) _underflow(0x0FFF, x, y, ##__VA_ARGS__, false)
-#define underflow16(x, y, ...) _underflow(0xFFFF, x, y, ##__VA_ARGS__, false)
-
-static inline void instr_adc_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa);
-static inline void instr_adc_r_v(struct gameboy *gb, uint8_t *r, uint8_t v);
-static inline void instr_add_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa);
-static inline void instr_add_r_v(struct gameboy *gb, uint8_t *r, uint8_t v);
-static inline void instr_add_rr_vv(struct gameboy *gb, uint16_t *rr, uint16_t vv);
-static inline void instr_and_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa);
-static inline void instr_and_r_v(struct gameboy *gb, uint8_t *r, uint8_t v);
-static inline void instr_bit_n_aa(struct gameboy *gb, int n, uint16_t aa);
-static inline void instr_bit_n_v(struct gameboy *gb, int n, uint8_t v);
-static inline void instr_call(struct gameboy *gb, bool condition);
+// CP is equivalent to a SUB with the results discarded
+#define CP(v) \
+	do { \
+		uint8_t v_ = (v); \
+		unsigned res_ = gb->a - v_; \
+		FLAGS(res_ & 0xFF, true, gb->a ^ v_ ^ res_, res_); \
+	} while (0)
+
+// Rotates and shifts leave the bit shifted out in bit 8 of flag_c
+#define RLC(r) \
+	do { \
+		(r) = ((r) << 1) | ((r) >> 7); \
+		FLAGS(r, false, 0, (r) << 8); \
+	} while (0)
+
+#define RRC(r) \
+	do { \
+		(r) = ((r) >> 1) | ((r) << 7); \
+		FLAGS(r, false, 0, (r) << 1); \
+	} while (0)
+
+#define RL(r) \
+	do { \
+		unsigned tmp_ = ((r) << 1) | CARRY; \
+		(r) = tmp_; \
+		FLAGS(r, false, 0, tmp_); \
+	} while (0)
+
+#define RR(r) \
+	do { \
+		unsigned c_ = (r) << 8; \
+		(r) = ((r) >> 1) | (CARRY << 7); \
+		FLAGS(r, false, 0, c_); \
+	} while (0)
+
+#define SLA(r) \
+	do { \
+		unsigned c_ = (r) << 1; \
+		(r) = c_; \
+		FLAGS(r, false, 0, c_); \
+	} while (0)
+
+#define SRA(r) \
+	do { \
+		unsigned c_ = (r) << 8; \
+		(r) = ((r) & 0x80) | ((r) >> 1); \
+		FLAGS(r, false, 0, c_); \
+	} while (0)
+
+#define SWAP(r) \
+	do { \
+		(r) = ((r) << 4) | ((r) >> 4); \
+		FLAGS(r, false, 0, 0); \
+	} while (0)
+
+#define SRL(r) \
+	do { \
+		unsigned c_ = (r) << 8; \
+		(r) = (r) >> 1; \
+		FLAGS(r, false, 0, c_); \
+	} while (0)
+
+#define TEST(n, v) \
+	do { \
+		gb->flag_z = BIT(n) & (v); \
+		gb->flag_n = false; \
+		gb->flag_h = FLAG_H_SET; \
+	} while (0)
+
+#define RES(n, r) ((r) &= ~BIT(n))
+#define SET(n, r) ((r) |= BIT(n))
+
+// Read-modify-write of (HL) through any of the single-operand macros above
+#define RMW_HL(OP, ...) \
+	do { \
+		uint8_t hl_ = timed_read(gb, gb->hl); \
+		OP(__VA_ARGS__ hl_); \
+		timed_write(gb, gb->hl, hl_); \
+	} while (0)
+
+#define INC16(rr) \
+	do { \
+		tick(gb); \
+		++(rr); \
+	} while (0)
+
+#define DEC16(rr) \
+	do { \
+		tick(gb); \
+		--(rr); \
+	} while (0)
+
+// Same as the 8-bit arithmetic, but with every flag shifted down a byte
+#define ADD_HL(vv) \
+	do { \
+		uint16_t vv_ = (vv); \
+		tick(gb); \
+		unsigned res_ = gb->hl + vv_; \
+		gb->flag_n = false; \
+		gb->flag_h = (gb->hl ^ vv_ ^ res_) >> 8; \
+		gb->flag_c = res_ >> 8; \
+		gb->hl = res_; \
+	} while (0)
+
+// The flags come from an unsigned add to the low byte of SP
+// TODO: Verify the flags on this one
+#define LD_SP_JR(rr, e) \
+	do { \
+		uint8_t diff_ = (e); \
+		unsigned lo_ = (gb->sp & 0xFF) + diff_; \
+		FLAGS(1, false, gb->sp ^ diff_ ^ lo_, lo_); \
+		(rr) = gb->sp + (int8_t)diff_; \
+	} while (0)
+
+#define POP(rr) \
+	do { \
+		uint8_t lo_ = timed_read(gb, gb->sp++); \
+		uint8_t hi_ = timed_read(gb, gb->sp++); \
+		(rr) = (hi_ << 8) | lo_; \
+	} while (0)
+
+static inline void instr_call(struct gameboy *gb, bool condition, uint16_t aa);
 static inline void instr_ccf(struct gameboy *gb);
-static inline void instr_cp_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa);
-static inline void instr_cp_r_v(struct gameboy *gb, uint8_t *r, uint8_t v);
-static inline void instr_cpl_r(struct gameboy *gb, uint8_t *r);
-static inline void instr_daa_r(struct gameboy *gb, uint8_t *r);
-static inline void instr_dec_aa(struct gameboy *gb, uint16_t aa);
-static inline void instr_dec_r(struct gameboy *gb, uint8_t *r);
-static inline void instr_dec_rr(struct gameboy *gb, uint16_t *rr);
+static inline void instr_cpl(struct gameboy *gb);
+static inline void instr_daa(struct gameboy *gb);
 static inline void instr_di(struct gameboy *gb);
 static inline void instr_ei(struct gameboy *gb);
 static inline void instr_halt(struct gameboy *gb);
-static inline void instr_inc_aa(struct gameboy *gb, uint16_t aa);
-static inline void instr_inc_r(struct gameboy *gb, uint8_t *r);
-static inline void instr_inc_rr(struct gameboy *gb, uint16_t *rr);
-static inline void instr_jp(struct gameboy *gb, bool condition);
-static inline void instr_jr(struct gameboy *gb, bool condition);
+static inline void instr_jp(struct gameboy *gb, bool condition, uint16_t aa);
+static inline void instr_jr(struct gameboy *gb, bool condition, int8_t diff);
 static inline void instr_ld_aa_v(struct gameboy *gb, uint16_t aa, uint8_t v);
 static inline void instr_ld_aa_vv(struct gameboy *gb, uint16_t aa, uint16_t vv);
-static inline void instr_ld_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa);
-static inline void instr_ld_r_v(struct gameboy *gb, uint8_t *r, uint8_t v);
-static inline void instr_ld_rr_vv(struct gameboy *gb, uint16_t *rr, uint16_t vv);
-static inline void instr_ld_rr_vv_jr(struct gameboy *gb, uint16_t *rr, uint16_t vv);
 static inline void instr_nop(struct gameboy *gb);
-static inline void instr_or_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa);
-static inline void instr_or_r_v(struct gameboy *gb, uint8_t *r, uint8_t v);
-static inline void instr_pop(struct gameboy *gb, uint16_t *rr);
 static inline void instr_push(struct gameboy *gb, uint16_t vv);
-static inline void instr_res_n_aa(struct gameboy *gb, int n, uint16_t aa);
-static inline void instr_res_n_r(struct gameboy *gb, int n, uint8_t *r);
 static inline void instr_ret(struct gameboy *gb, bool condition);
 static inline void instr_reti(struct gameboy *gb);
-static inline void instr_rl_aa(struct gameboy *gb, uint16_t aa);
-static inline void instr_rl_r(struct gameboy *gb, uint8_t *r);
 static inline void instr_rla(struct gameboy *gb);
-static inline void instr_rlc_aa(struct gameboy *gb, uint16_t aa);
-static inline void instr_rlc_r(struct gameboy *gb, uint8_t *r);
 static inline void instr_rlca(struct gameboy *gb);
-static inline void instr_rr_aa(struct gameboy *gb, uint16_t aa);
-static inline void instr_rr_r(struct gameboy *gb, uint8_t *r);
 static inline void instr_rra(struct gameboy *gb);
-static inline void instr_rrc_aa(struct gameboy *gb, uint16_t aa);
-static inline void instr_rrc_r(struct gameboy *gb, uint8_t *r);
 static inline void instr_rrca(struct gameboy *gb);
 static inline void instr_rst(struct gameboy *gb, uint16_t aa);
-static inline void instr_sbc_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa);
-static inline void instr_sbc_r_v(struct gameboy *gb, uint8_t *r, uint8_t v);
 static inline void instr_scf(struct gameboy *gb);
-static inline void instr_set_n_aa(struct gameboy *gb, int n, uint16_t aa);
-static inline void instr_set_n_r(struct gameboy *gb, int n, uint8_t *r);
-static inline void instr_sla_aa(struct gameboy *gb, uint16_t aa);
-static inline void instr_sla_r(struct gameboy *gb, uint8_t *r);
-static inline void instr_sra_aa(struct gameboy *gb, uint16_t aa);
-static inline void instr_sra_r(struct gameboy *gb, uint8_t *r);
-static inline void instr_srl_aa(struct gameboy *gb, uint16_t aa);
-static inline void instr_srl_r(struct gameboy *gb, uint8_t *r);
 static inline void instr_stop(struct gameboy *gb);
-static inline void instr_sub_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa);
-static inline void instr_sub_r_v(struct gameboy *gb, uint8_t *r, uint8_t v);
-static inline void instr_swap_aa(struct gameboy *gb, uint16_t aa);
-static inline void instr_swap_r(struct gameboy *gb, uint8_t *r);
 static inline void instr_undefined(struct gameboy *gb, uint8_t opcode);
-static inline void instr_xor_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa);
-static inline void instr_xor_r_v(struct gameboy *gb, uint8_t *r, uint8_t v);
-
-void instr_adc_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa)
-{
-	instr_adc_r_v(gb, r, timed_read(gb, aa));
-}
-
-void instr_adc_r_v(struct gameboy *gb, uint8_t *r, uint8_t v)
-{
-	bool c = overflow8(*r, v, gb->carry);
-	bool h = overflow4(*r, v, gb->carry);
-
-	*r = *r + v + gb->carry;
-
-	set_flags(gb, c, h, false, *r == 0);
-}
-
-void instr_add_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa)
-{
-	instr_add_r_v(gb, r, timed_read(gb, aa));
-}
-
-void instr_add_r_v(struct gameboy *gb, uint8_t *r, uint8_t v)
-{
-	bool c = overflow8(*r, v);
-	bool h = overflow4(*r, v);
-
-	*r = *r + v;
-
-	set_flags(gb, c, h, false, *r == 0);
-}
-
-void instr_add_rr_vv(struct gameboy *gb, uint16_t *rr, uint16_t vv)
-{
-	tick(gb);
-
-	bool c = overflow16(*rr, vv);
-	bool h = overflow12(*rr, vv);
-
-	*rr = *rr + vv;
-
-	set_flags_chn(gb, c, h, false);
-}
-
-void instr_and_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa)
-{
-	instr_and_r_v(gb, r, timed_read(gb, aa));
-}
-
-void instr_and_r_v(struct gameboy *gb, uint8_t *r, uint8_t v)
-{
-	*r = *r & v;
-
-	set_flags(gb, false, true, false, *r == 0);
-}
-
-void instr_bit_n_aa(struct gameboy *gb, int n, uint16_t aa)
-{
-	instr_bit_n_v(gb, n, timed_read(gb, aa));
-}
 
-void instr_bit_n_v(struct gameboy *gb, int n, uint8_t v)
+void instr_call(struct gameboy *gb, bool condition, uint16_t aa)
 {
-	set_flags_hnz(gb, true, false, ((1 << n) & v) == 0);
-}
-
-void instr_call(struct gameboy *gb, bool condition)
-{
-	uint16_t next = iv16(gb);
-
 	if (condition)
-		instr_rst(gb, next);
+		instr_rst(gb, aa);
 }
 
 void instr_ccf(struct gameboy *gb)
 {
-	set_flags_chn(gb, !gb->carry, false, false);
-}
-
-void instr_cp_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa)
-{
-	instr_cp_r_v(gb, r, timed_read(gb, aa));
-}
-
-// CP is equivalent to a SUB with the results discarded
-void instr_cp_r_v(struct gameboy *gb, uint8_t *r, uint8_t v)
-{
-	uint8_t tmp = *r;
-
-	instr_sub_r_v(gb, &tmp, v);
+	gb->flag_n = false;
+	gb->flag_h = 0;
+	gb->flag_c ^= FLAG_C_SET;
 }
 
-void instr_cpl_r(struct gameboy *gb, uint8_t *r)
+void instr_cpl(struct gameboy *gb)
 {
-	*r = ~*r;
+	gb->a = ~gb->a;
 
-	gb->f = gb->f | FLAG_HALFCARRY | FLAG_SUBTRACT;
+	gb->flag_n = true;
+	gb->flag_h = FLAG_H_SET;
 }
 
-void instr_daa_r(struct gameboy *gb, uint8_t *r)
+void instr_daa(struct gameboy *gb)
 {
-	int tmp = *r;
+	int tmp = gb->a;
+	bool carry = CARRY;
 
-	if (gb->subtract) {
-		if (gb->halfcarry)
+	if (SUBTRACT) {
+		if (HALFCARRY)
 			tmp -= 0x06;
 
-		if (gb->carry)
+		if (carry)
 			tmp -= 0x60;
 	} else {
-		if (gb->halfcarry || (tmp & 0x0F) > 0x09)
+		if (HALFCARRY || (tmp & 0x0F) > 0x09)
 			tmp += 0x06;
 
-		if (gb->carry || tmp > 0x9F)
+		if (carry || tmp > 0x9F)
 			tmp += 0x60;
 
 		if (tmp > 0xFF)
-			gb->carry = true;
+			carry = true;
 	}
 
-	*r = tmp;
-
-	set_flags(gb, gb->carry, false, gb->subtract, *r == 0);
-}
-
-void instr_dec_aa(struct gameboy *gb, uint16_t aa)
-{
-	uint8_t tmp = timed_read(gb, aa);
-	instr_dec_r(gb, &tmp);
-	timed_write(gb, aa, tmp);
-}
-
-void instr_dec_r(struct gameboy *gb, uint8_t *r)
-{
-	bool h = underflow4(*r, 1);
-	--(*r);
+	gb->a = tmp;
 
-	set_flags_hnz(gb, h, true, *r == 0);
-}
-
-void instr_dec_rr(struct gameboy *gb, uint16_t *rr)
-{
-	tick(gb);
-
-	--(*rr);
+	FLAGS(gb->a, SUBTRACT, 0, carry ? FLAG_C_SET : 0);
 }
 
 void instr_di(struct gameboy *gb)
@@ -340,42 +402,16 @@ void instr_halt(struct gameboy *gb)
 	; // TODO: Check for HALT bug
 }
 
-void instr_inc_aa(struct gameboy *gb, uint16_t aa)
-{
-	uint8_t tmp = timed_read(gb, aa);
-	instr_inc_r(gb, &tmp);
-	timed_write(gb, aa, tmp);
-}
-
-void instr_inc_r(struct gameboy *gb, uint8_t *r)
+void instr_jp(struct gameboy *gb, bool condition, uint16_t aa)
 {
-	bool h = overflow4(*r, 1);
-	++(*r);
-
-	set_flags_hnz(gb, h, false, *r == 0);
-}
-
-void instr_inc_rr(struct gameboy *gb, uint16_t *rr)
-{
-	tick(gb);
-
-	++(*rr);
-}
-
-void instr_jp(struct gameboy *gb, bool condition)
-{
-	uint16_t next = iv16(gb);
-
 	if (condition) {
 		tick(gb);
-		gb->pc = next;
+		gb->pc = aa;
 	}
 }
 
-void instr_jr(struct gameboy *gb, bool condition)
+void instr_jr(struct gameboy *gb, bool condition, int8_t diff)
 {
-	int8_t diff = (int8_t)iv(gb);
-
 	if (condition) {
 		tick(gb);
 		gb->pc += diff;
@@ -393,59 +429,11 @@ void instr_ld_aa_vv(struct gameboy *gb, uint16_t aa, uint16_t vv)
 	timed_write(gb, aa + 1, vv >> 8);
 }
 
-void instr_ld_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa)
-{
-	*r = timed_read(gb, aa);
-}
-
-void instr_ld_r_v(struct gameboy *gb, uint8_t *r, uint8_t v)
-{
-	*r = v;
-}
-
-void instr_ld_rr_vv(struct gameboy *gb, uint16_t *rr, uint16_t vv)
-{
-	*rr = vv;
-}
-
-void instr_ld_rr_vv_jr(struct gameboy *gb, uint16_t *rr, uint16_t vv)
-{
-	int8_t diff = (int8_t)iv(gb);
-
-	bool c = overflow8(vv, diff);
-	bool h = overflow4(vv, diff);
-
-	*rr = vv + diff;
-
-	// TODO: Verify the flags on this one
-	set_flags(gb, c, h, false, false);
-}
-
 void instr_nop(struct gameboy *gb)
 {
 	;
 }
 
-void instr_or_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa)
-{
-	instr_or_r_v(gb, r, timed_read(gb, aa));
-}
-
-void instr_or_r_v(struct gameboy *gb, uint8_t *r, uint8_t v)
-{
-	*r = *r | v;
-
-	gb->f = (*r == 0) ? FLAG_ZERO : 0;
-}
-
-void instr_pop(struct gameboy *gb, uint16_t *rr)
-{
-	uint8_t lo = timed_read(gb, gb->sp++);
-	uint8_t hi = timed_read(gb, gb->sp++);
-
-	*rr = (hi << 8) | lo;
-}
-
 void instr_push(struct gameboy *gb, uint16_t vv)
 {
 	tick(gb);
@@ -453,23 +441,11 @@ void instr_push(struct gameboy *gb, uint16_t vv)
 	timed_write(gb, --gb->sp, vv & 0xFF);
 }
 
-void instr_res_n_aa(struct gameboy *gb, int n, uint16_t aa)
-{
-	uint8_t tmp = timed_read(gb, aa);
-	instr_res_n_r(gb, n, &tmp);
-	timed_write(gb, aa, tmp);
-}
-
-void instr_res_n_r(struct gameboy *gb, int n, uint8_t *r)
-{
-	*r = *r & ~(1 << n);
-}
-
 void instr_ret(struct gameboy *gb, bool condition)
 {
 	if (condition) {
 		tick(gb);
-		instr_pop(gb, &gb->pc);
+		POP(gb->pc);
 	}
 }
 
@@ -480,91 +456,32 @@ void instr_reti(struct gameboy *gb)
 	gb->ime_status = GAMEBOY_IME_ENABLED;
 }
 
-void instr_rl_aa(struct gameboy *gb, uint16_t aa)
-{
-	uint8_t tmp = timed_read(gb, aa);
-	instr_rl_r(gb, &tmp);
-	timed_write(gb, aa, tmp);
-}
-
-void instr_rl_r(struct gameboy *gb, uint8_t *r)
-{
-	int tmp = (*r << 1) | gb->carry;
-	*r = tmp;
-
-	set_flags(gb, tmp > 0xFF, false, false, *r == 0);
-}
-
 void instr_rla(struct gameboy *gb)
 {
-	instr_rl_r(gb, &gb->a);
-
-	gb->zero = false;
-}
-
-void instr_rlc_aa(struct gameboy *gb, uint16_t aa)
-{
-	uint8_t tmp = timed_read(gb, aa);
-	instr_rlc_r(gb, &tmp);
-	timed_write(gb, aa, tmp);
-}
-
-void instr_rlc_r(struct gameboy *gb, uint8_t *r)
-{
-	*r = (*r << 1) | (*r >> 7);
+	RL(gb->a);
 
-	set_flags(gb, *r & 0x01, false, false, *r == 0);
+	gb->flag_z = 1;
 }
 
 void instr_rlca(struct gameboy *gb)
 {
-	instr_rlc_r(gb, &gb->a);
-
-	gb->zero = false;
-}
-
-void instr_rr_aa(struct gameboy *gb, uint16_t aa)
-{
-	uint8_t tmp = timed_read(gb, aa);
-	instr_rr_r(gb, &tmp);
-	timed_write(gb, aa, tmp);
-}
-
-void instr_rr_r(struct gameboy *gb, uint8_t *r)
-{
-	bool c = *r & 0x01;
-
-	*r = (*r >> 1) | (gb->carry << 7);
+	RLC(gb->a);
 
-	set_flags(gb, c, false, false, *r == 0);
+	gb->flag_z = 1;
 }
 
 void instr_rra(struct gameboy *gb)
 {
-	instr_rr_r(gb, &gb->a);
-
-	gb->zero = false;
-}
-
-void instr_rrc_aa(struct gameboy *gb, uint16_t aa)
-{
-	uint8_t tmp = timed_read(gb, aa);
-	instr_rrc_r(gb, &tmp);
-	timed_write(gb, aa, tmp);
-}
-
-void instr_rrc_r(struct gameboy *gb, uint8_t *r)
-{
-	*r = (*r >> 1) | (*r << 7);
+	RR(gb->a);
 
-	set_flags(gb, *r & 0x80, false, false, *r == 0);
+	gb->flag_z = 1;
 }
 
 void instr_rrca(struct gameboy *gb)
 {
-	instr_rrc_r(gb, &gb->a);
+	RRC(gb->a);
 
-	gb->zero = false;
+	gb->flag_z = 1;
 }
 
 void instr_rst(struct gameboy *gb, uint16_t aa)
@@ -574,83 +491,11 @@ void instr_rst(struct gameboy *gb, uint16_t aa)
 	gb->pc = aa;
 }
 
-void instr_sbc_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa)
-{
-	instr_sbc_r_v(gb, r, timed_read(gb, aa));
-}
-
-void instr_sbc_r_v(struct gameboy *gb, uint8_t *r, uint8_t v)
-{
-	bool c = underflow8(*r, v, gb->carry);
-	bool h = underflow4(*r, v, gb->carry);
-
-	*r = *r - v - gb->carry;
-
-	set_flags(gb, c, h, true, *r == 0);
-}
-
 void instr_scf(struct gameboy *gb)
 {
-	set_flags_chn(gb, true, false, false);
-}
-
-void instr_set_n_aa(struct gameboy *gb, int n, uint16_t aa)
-{
-	uint8_t tmp = timed_read(gb, aa);
-	instr_set_n_r(gb, n, &tmp);
-	timed_write(gb, aa, tmp);
-}
-
-void instr_set_n_r(struct gameboy *gb, int n, uint8_t *r)
-{
-	*r = *r | (1 << n);
-}
-
-void instr_sla_aa(struct gameboy *gb, uint16_t aa)
-{
-	uint8_t tmp = timed_read(gb, aa);
-	instr_sla_r(gb, &tmp);
-	timed_write(gb, aa, tmp);
-}
-
-void instr_sla_r(struct gameboy *gb, uint8_t *r)
-{
-	int tmp = *r;
-	*r = *r << 1;
-
-	set_flags(gb, tmp & 0x80, false, false, *r == 0);
-}
-
-void instr_sra_aa(struct gameboy *gb, uint16_t aa)
-{
-	uint8_t tmp = timed_read(gb, aa);
-	instr_sra_r(gb, &tmp);
-	timed_write(gb, aa, tmp);
-}
-
-void instr_sra_r(struct gameboy *gb, uint8_t *r)
-{
-	bool c = *r & 0x01;
-
-	*r = (*r & 0x80) | (*r >> 1);
-
-	set_flags(gb, c, false, false, *r == 0);
-}
-
-void instr_srl_aa(struct gameboy *gb, uint16_t aa)
-{
-	uint8_t tmp = timed_read(gb, aa);
-	instr_srl_r(gb, &tmp);
-	timed_write(gb, aa, tmp);
-}
-
-void instr_srl_r(struct gameboy *gb, uint8_t *r)
-{
-	bool c = *r & 0x01;
-
-	*r = *r >> 1;
-
-	set_flags(gb, c, false, false, *r == 0);
+	gb->flag_n = false;
+	gb->flag_h = 0;
+	gb->flag_c = FLAG_C_SET;
 }
 
 void instr_stop(struct gameboy *gb)
@@ -666,567 +511,739 @@ void instr_stop(struct gameboy *gb)
 	}
 }
 
-void instr_sub_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa)
-{
-	instr_sub_r_v(gb, r, timed_read(gb, aa));
-}
-
-void instr_sub_r_v(struct gameboy *gb, uint8_t *r, uint8_t v)
+void instr_undefined(struct gameboy *gb, uint8_t opcode)
 {
-	bool c = underflow8(*r, v);
-	bool h = underflow4(*r, v);
-
-	*r = *r - v;
+	GBLOG("Undefined opcode: %02X", opcode);
 
-	set_flags(gb, c, h, true, *r == 0);
+	gb->cpu_status = GAMEBOY_CPU_CRASHED;
 }
 
-void instr_swap_aa(struct gameboy *gb, uint16_t aa)
-{
-	uint8_t tmp = timed_read(gb, aa);
-	instr_swap_r(gb, &tmp);
-	timed_write(gb, aa, tmp);
-}
+// Expands OP once per operand encoding (B, C, D, E, H, L, (HL), A), with any
+// leading arguments (the bit number for RES/SET) passed through
+#define CB_OPERANDS(OP, ...) \
+	switch (opcode & 0x07) { \
+	case 0: OP(__VA_ARGS__ gb->b); break; \
+	case 1: OP(__VA_ARGS__ gb->c); break; \
+	case 2: OP(__VA_ARGS__ gb->d); break; \
+	case 3: OP(__VA_ARGS__ gb->e); break; \
+	case 4: OP(__VA_ARGS__ gb->h); break; \
+	case 5: OP(__VA_ARGS__ gb->l); break; \
+	case 6: RMW_HL(OP, __VA_ARGS__); break; \
+	case 7: OP(__VA_ARGS__ gb->a); break; \
+	}
 
-void instr_swap_r(struct gameboy *gb, uint8_t *r)
+static void process_cb_opcode(struct gameboy *gb, uint8_t opcode)
 {
-	*r = (*r << 4) | (*r >> 4);
+	int n = (opcode >> 3) & 0x07;
+
+	switch (opcode >> 3) {
+	case 0x00: CB_OPERANDS(RLC); break;
+	case 0x01: CB_OPERANDS(RRC); break;
+	case 0x02: CB_OPERANDS(RL); break;
+	case 0x03: CB_OPERANDS(RR); break;
+	case 0x04: CB_OPERANDS(SLA); break;
+	case 0x05: CB_OPERANDS(SRA); break;
+	case 0x06: CB_OPERANDS(SWAP); break;
+	case 0x07: CB_OPERANDS(SRL); break;
+
+	case 0x08 ... 0x0F:
+		// BIT never writes back, so (HL) is a plain read
+		switch (opcode & 0x07) {
+		case 0: TEST(n, gb->b); break;
+		case 1: TEST(n, gb->c); break;
+		case 2: TEST(n, gb->d); break;
+		case 3: TEST(n, gb->e); break;
+		case 4: TEST(n, gb->h); break;
+		case 5: TEST(n, gb->l); break;
+		case 6: TEST(n, timed_read(gb, gb->hl)); break;
+		case 7: TEST(n, gb->a); break;
+		}
+		break;
 
-	gb->f = (*r == 0) ? FLAG_ZERO : 0;
+	case 0x10 ... 0x17: CB_OPERANDS(RES, n,); break;
+	case 0x18 ... 0x1F: CB_OPERANDS(SET, n,); break;
+	}
 }
 
-void instr_undefined(struct gameboy *gb, uint8_t opcode)
-{
-	GBLOG("Undefined opcode: %02X", opcode);
-
-	gb->cpu_status = GAMEBOY_CPU_CRASHED;
-}
+#undef CB_OPERANDS
 
-void instr_xor_r_aa(struct gameboy *gb, uint8_t *r, uint16_t aa)
-{
-	instr_xor_r_v(gb, r, timed_read(gb, aa));
-}
+// Busy-wait loops (e.g. "LDH A,(LY); CP n; JR NZ") are detected per block: a
+// block that branches back to its own start, writes nothing but registers,
+// and only reads memory that can't change until a peripheral syncs.  If the
+// CPU comes back around to such a loop with the same registers and no sync
+// in between, every iteration from there on will do exactly the same thing
+// until the next scheduled event, so those iterations are skipped.
+enum {
+	IDLE_A = BIT(0),
+	IDLE_B = BIT(1),
+	IDLE_C = BIT(2),
+	IDLE_D = BIT(3),
+	IDLE_E = BIT(4),
+	IDLE_H = BIT(5),
+	IDLE_L = BIT(6),
+	IDLE_BC = IDLE_B | IDLE_C,
+	IDLE_DE = IDLE_D | IDLE_E,
+	IDLE_HL = IDLE_H | IDLE_L,
+};
 
-void instr_xor_r_v(struct gameboy *gb, uint8_t *r, uint8_t v)
-{
-	*r = *r ^ v;
+// Indexed by the 3-bit operand field; (HL) is handled separately
+static const uint8_t idle_operands[8] = {
+	IDLE_B, IDLE_C, IDLE_D, IDLE_E, IDLE_H, IDLE_L, 0, IDLE_A,
+};
 
-	gb->f = (*r == 0) ? FLAG_ZERO : 0;
-}
+static const uint8_t idle_pairs[4] = { IDLE_BC, IDLE_DE, IDLE_HL, 0 };
 
-static void process_cb_opcode(struct gameboy *gb, uint8_t opcode)
+// Registers written and registers used as an address by a loop body
+// instruction; returns its length in M-cycles, or 0 for anything with other
+// side effects
+static int idle_insn(const struct gameboy_insn *insn, uint8_t *writes, uint8_t *addr)
 {
-	switch (opcode) {
-	case 0x00: instr_rlc_r(gb, &gb->b); break;
-	case 0x01: instr_rlc_r(gb, &gb->c); break;
-	case 0x02: instr_rlc_r(gb, &gb->d); break;
-	case 0x03: instr_rlc_r(gb, &gb->e); break;
-	case 0x04: instr_rlc_r(gb, &gb->h); break;
-	case 0x05: instr_rlc_r(gb, &gb->l); break;
-	case 0x07: instr_rlc_r(gb, &gb->a); break;
-
-	case 0x08: instr_rrc_r(gb, &gb->b); break;
-	case 0x09: instr_rrc_r(gb, &gb->c); break;
-	case 0x0A: instr_rrc_r(gb, &gb->d); break;
-	case 0x0B: instr_rrc_r(gb, &gb->e); break;
-	case 0x0C: instr_rrc_r(gb, &gb->h); break;
-	case 0x0D: instr_rrc_r(gb, &gb->l); break;
-	case 0x0F: instr_rrc_r(gb, &gb->a); break;
-
-	case 0x10: instr_rl_r(gb, &gb->b); break;
-	case 0x11: instr_rl_r(gb, &gb->c); break;
-	case 0x12: instr_rl_r(gb, &gb->d); break;
-	case 0x13: instr_rl_r(gb, &gb->e); break;
-	case 0x14: instr_rl_r(gb, &gb->h); break;
-	case 0x15: instr_rl_r(gb, &gb->l); break;
-	case 0x17: instr_rl_r(gb, &gb->a); break;
-
-	case 0x18: instr_rr_r(gb, &gb->b); break;
-	case 0x19: instr_rr_r(gb, &gb->c); break;
-	case 0x1A: instr_rr_r(gb, &gb->d); break;
-	case 0x1B: instr_rr_r(gb, &gb->e); break;
-	case 0x1C: instr_rr_r(gb, &gb->h); break;
-	case 0x1D: instr_rr_r(gb, &gb->l); break;
-	case 0x1F: instr_rr_r(gb, &gb->a); break;
-
-	case 0x20: instr_sla_r(gb, &gb->b); break;
-	case 0x21: instr_sla_r(gb, &gb->c); break;
-	case 0x22: instr_sla_r(gb, &gb->d); break;
-	case 0x23: instr_sla_r(gb, &gb->e); break;
-	case 0x24: instr_sla_r(gb, &gb->h); break;
-	case 0x25: instr_sla_r(gb, &gb->l); break;
-	case 0x27: instr_sla_r(gb, &gb->a); break;
-
-	case 0x28: instr_sra_r(gb, &gb->b); break;
-	case 0x29: instr_sra_r(gb, &gb->c); break;
-	case 0x2A: instr_sra_r(gb, &gb->d); break;
-	case 0x2B: instr_sra_r(gb, &gb->e); break;
-	case 0x2C: instr_sra_r(gb, &gb->h); break;
-	case 0x2D: instr_sra_r(gb, &gb->l); break;
-	case 0x2F: instr_sra_r(gb, &gb->a); break;
-
-	case 0x30: instr_swap_r(gb, &gb->b); break;
-	case 0x31: instr_swap_r(gb, &gb->c); break;
-	case 0x32: instr_swap_r(gb, &gb->d); break;
-	case 0x33: instr_swap_r(gb, &gb->e); break;
-	case 0x34: instr_swap_r(gb, &gb->h); break;
-	case 0x35: instr_swap_r(gb, &gb->l); break;
-	case 0x37: instr_swap_r(gb, &gb->a); break;
-
-	case 0x38: instr_srl_r(gb, &gb->b); break;
-	case 0x39: instr_srl_r(gb, &gb->c); break;
-	case 0x3A: instr_srl_r(gb, &gb->d); break;
-	case 0x3B: instr_srl_r(gb, &gb->e); break;
-	case 0x3C: instr_srl_r(gb, &gb->h); break;
-	case 0x3D: instr_srl_r(gb, &gb->l); break;
-	case 0x3F: instr_srl_r(gb, &gb->a); break;
-
-	case 0x06: instr_rlc_aa(gb, gb->hl); break;
-	case 0x0E: instr_rrc_aa(gb, gb->hl); break;
-	case 0x16: instr_rl_aa(gb, gb->hl); break;
-	case 0x1E: instr_rr_aa(gb, gb->hl); break;
-	case 0x26: instr_sla_aa(gb, gb->hl); break;
-	case 0x2E: instr_sra_aa(gb, gb->hl); break;
-	case 0x36: instr_swap_aa(gb, gb->hl); break;
-	case 0x3E: instr_srl_aa(gb, gb->hl); break;
-
-	case 0x40: case 0x50: case 0x60: case 0x70:
-	case 0x48: case 0x58: case 0x68: case 0x78:
-		instr_bit_n_v(gb, (opcode / 8 % 8), gb->b);
-		break;
+	uint8_t op = insn->opcode;
+	int dst = (op >> 3) & 0x07;
+	int src = op & 0x07;
 
-	case 0x41: case 0x51: case 0x61: case 0x71:
-	case 0x49: case 0x59: case 0x69: case 0x79:
-		instr_bit_n_v(gb, (opcode / 8 % 8), gb->c);
-		break;
+	*writes = 0;
+	*addr = 0;
 
-	case 0x42: case 0x52: case 0x62: case 0x72:
-	case 0x4A: case 0x5A: case 0x6A: case 0x7A:
-		instr_bit_n_v(gb, (opcode / 8 % 8), gb->d);
-		break;
+	switch (op) {
+	case 0x00: case 0x37: case 0x3F:
+		return 1;
+	case 0xFE:
+		return 2;
 
-	case 0x43: case 0x53: case 0x63: case 0x73:
-	case 0x4B: case 0x5B: case 0x6B: case 0x7B:
-		instr_bit_n_v(gb, (opcode / 8 % 8), gb->e);
-		break;
+	case 0x01: case 0x11: case 0x21:
+		*writes = idle_pairs[op >> 4];
+		return 3;
 
-	case 0x44: case 0x54: case 0x64: case 0x74:
-	case 0x4C: case 0x5C: case 0x6C: case 0x7C:
-		instr_bit_n_v(gb, (opcode / 8 % 8), gb->h);
-		break;
+	case 0x03: case 0x13: case 0x23:
+	case 0x0B: case 0x1B: case 0x2B:
+		*writes = idle_pairs[op >> 4];
+		return 2;
 
-	case 0x45: case 0x55: case 0x65: case 0x75:
-	case 0x4D: case 0x5D: case 0x6D: case 0x7D:
-		instr_bit_n_v(gb, (opcode / 8 % 8), gb->l);
-		break;
+	case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x3C:
+	case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x3D:
+		*writes = idle_operands[dst];
+		return 1;
 
-	case 0x46: case 0x56: case 0x66: case 0x76:
-	case 0x4E: case 0x5E: case 0x6E: case 0x7E:
-		instr_bit_n_aa(gb, (opcode / 8 % 8), gb->hl);
-		break;
+	case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x3E:
+		*writes = idle_operands[dst];
+		return 2;
 
-	case 0x47: case 0x57: case 0x67: case 0x77:
-	case 0x4F: case 0x5F: case 0x6F: case 0x7F:
-		instr_bit_n_v(gb, (opcode / 8 % 8), gb->a);
-		break;
+	case 0x07: case 0x0F: case 0x17: case 0x1F: case 0x27: case 0x2F:
+		*writes = IDLE_A;
+		return 1;
 
-	case 0x80: case 0x90: case 0xA0: case 0xB0:
-	case 0x88: case 0x98: case 0xA8: case 0xB8:
-		instr_res_n_r(gb, (opcode / 8 % 8), &gb->b);
-		break;
+	case 0xC6: case 0xCE: case 0xD6: case 0xDE:
+	case 0xE6: case 0xEE: case 0xF6:
+		*writes = IDLE_A;
+		return 2;
 
-	case 0x81: case 0x91: case 0xA1: case 0xB1:
-	case 0x89: case 0x99: case 0xA9: case 0xB9:
-		instr_res_n_r(gb, (opcode / 8 % 8), &gb->c);
-		break;
+	case 0xF0:
+		*writes = IDLE_A;
+		return 3;
 
-	case 0x82: case 0x92: case 0xA2: case 0xB2:
-	case 0x8A: case 0x9A: case 0xAA: case 0xBA:
-		instr_res_n_r(gb, (opcode / 8 % 8), &gb->d);
-		break;
+	case 0xFA:
+		*writes = IDLE_A;
+		return 4;
 
-	case 0x83: case 0x93: case 0xA3: case 0xB3:
-	case 0x8B: case 0x9B: case 0xAB: case 0xBB:
-		instr_res_n_r(gb, (opcode / 8 % 8), &gb->e);
-		break;
+	case 0x09: case 0x19: case 0x29: case 0x39:
+		*writes = IDLE_HL;
+		return 2;
 
-	case 0x84: case 0x94: case 0xA4: case 0xB4:
-	case 0x8C: case 0x9C: case 0xAC: case 0xBC:
-		instr_res_n_r(gb, (opcode / 8 % 8), &gb->h);
-		break;
+	case 0xF8:
+		*writes = IDLE_HL;
+		return 3;
+
+	case 0x0A: case 0x1A:
+		*writes = IDLE_A;
+		*addr = idle_pairs[op >> 4];
+		return 2;
+
+	case 0xF2:
+		*writes = IDLE_A;
+		*addr = IDLE_C;
+		return 2;
+
+	case 0x40 ... 0x6F:
+	case 0x78 ... 0xBF:
+		if (op < 0x80)
+			*writes = idle_operands[dst];
+		else if (op < 0xB8)
+			*writes = IDLE_A;
+		if (src != 6)
+			return 1;
+		*addr = IDLE_HL;
+		return 2;
+
+	case 0xCB:
+		if ((insn->imm & 0xC0) != 0x40)
+			*writes = idle_operands[insn->imm & 0x07];
+		if ((insn->imm & 0x07) != 6)
+			return 2;
+		// Only BIT can leave (HL) alone
+		*addr = IDLE_HL;
+		return (insn->imm & 0xC0) == 0x40 ? 3 : 0;
 
-	case 0x85: case 0x95: case 0xA5: case 0xB5:
-	case 0x8D: case 0x9D: case 0xAD: case 0xBD:
-		instr_res_n_r(gb, (opcode / 8 % 8), &gb->l);
-		break;
+	default:
+		return 0;
+	}
+}
 
-	case 0x86: case 0x96: case 0xA6: case 0xB6:
-	case 0x8E: case 0x9E: case 0xAE: case 0xBE:
-		instr_res_n_aa(gb, (opcode / 8 % 8), gb->hl);
-		break;
+static bool idle_override(struct gameboy *gb, const struct gameboy_block *block)
+{
+	long bank = -1;
+	if (block->region == GAMEBOY_BLOCK_ROMX)
+		bank = (block->mem - gb->rom[0]) / sizeof(gb->rom[0]);
 
-	case 0x87: case 0x97: case 0xA7: case 0xB7:
-	case 0x8F: case 0x9F: case 0xAF: case 0xBF:
-		instr_res_n_r(gb, (opcode / 8 % 8), &gb->a);
-		break;
+	for (size_t i = 0; i < gb->idle_loop_count; ++i) {
+		const struct gameboy_idle_loop *loop = &gb->idle_loops[i];
+		if (loop->addr == block->pc && (loop->bank < 0 || loop->bank == bank))
+			return true;
+	}
 
-	case 0xC0: case 0xD0: case 0xE0: case 0xF0:
-	case 0xC8: case 0xD8: case 0xE8: case 0xF8:
-		instr_set_n_r(gb, (opcode / 8 % 8), &gb->b);
-		break;
+	return false;
+}
+
+// Returns the length of one iteration in M-cycles (0 if unknown), or -1 if
+// the block isn't a busy-wait loop.  Listed loops skip the analysis and
+// may contain instructions whose cost isn't known here.
+static int idle_loop_cycles(struct gameboy *gb, const struct gameboy_block *block)
+{
+	const struct gameboy_insn *last = &block->insns[block->count - 1];
+	uint16_t end = block->pc;
+	uint8_t writes = 0;
+	uint8_t addr = 0;
+	int cycles = 0;
+	bool forced = idle_override(gb, block);
+	bool known = true;
+
+	for (const struct gameboy_insn *insn = block->insns; insn < last; ++insn) {
+		uint8_t insn_writes, insn_addr;
+		int insn_cycles = idle_insn(insn, &insn_writes, &insn_addr);
+		if (!insn_cycles && !forced)
+			return -1;
+
+		known = known && insn_cycles;
+		writes |= insn_writes;
+		addr |= insn_addr;
+		cycles += insn_cycles;
+		end += insn->length;
+	}
 
-	case 0xC1: case 0xD1: case 0xE1: case 0xF1:
-	case 0xC9: case 0xD9: case 0xE9: case 0xF9:
-		instr_set_n_r(gb, (opcode / 8 % 8), &gb->c);
-		break;
+	// Addresses have to stay put for the memory read to be the same
+	if ((writes & addr) && !forced)
+		return -1;
 
-	case 0xC2: case 0xD2: case 0xE2: case 0xF2:
-	case 0xCA: case 0xDA: case 0xEA: case 0xFA:
-		instr_set_n_r(gb, (opcode / 8 % 8), &gb->d);
+	end += last->length;
+	switch (last->opcode) {
+	case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+		if ((uint16_t)(end + (int8_t)last->imm) != block->pc)
+			return -1;
+		cycles += 3;
 		break;
-
-	case 0xC3: case 0xD3: case 0xE3: case 0xF3:
-	case 0xCB: case 0xDB: case 0xEB: case 0xFB:
-		instr_set_n_r(gb, (opcode / 8 % 8), &gb->e);
+	case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA:
+		if (last->imm != block->pc)
+			return -1;
+		cycles += 4;
 		break;
+	default:
+		return -1;
+	}
 
-	case 0xC4: case 0xD4: case 0xE4: case 0xF4:
-	case 0xCC: case 0xDC: case 0xEC: case 0xFC:
-		instr_set_n_r(gb, (opcode / 8 % 8), &gb->h);
-		break;
+	return known ? cycles : 0;
+}
 
-	case 0xC5: case 0xD5: case 0xE5: case 0xF5:
-	case 0xCD: case 0xDD: case 0xED: case 0xFD:
-		instr_set_n_r(gb, (opcode / 8 % 8), &gb->l);
-		break;
+// DIV counts on its own between syncs, and cartridge RAM may be an RTC
+static bool idle_read_safe(uint16_t addr)
+{
+	switch (addr) {
+	case 0x0000 ... 0x9FFF:
+	case 0xC000 ... 0xDFFF:
+	case 0xFE00 ... 0xFFFF:
+		return addr != GAMEBOY_ADDR_DIV;
+	default:
+		return false;
+	}
+}
 
-	case 0xC6: case 0xD6: case 0xE6: case 0xF6:
-	case 0xCE: case 0xDE: case 0xEE: case 0xFE:
-		instr_set_n_aa(gb, (opcode / 8 % 8), gb->hl);
-		break;
+static bool idle_reads_safe(struct gameboy *gb, const struct gameboy_block *block)
+{
+	for (int i = 0; i < block->count; ++i) {
+		const struct gameboy_insn *insn = &block->insns[i];
+		uint16_t addr;
 
-	case 0xC7: case 0xD7: case 0xE7: case 0xF7:
-	case 0xCF: case 0xDF: case 0xEF: case 0xFF:
-		instr_set_n_r(gb, (opcode / 8 % 8), &gb->a);
-		break;
+		switch (insn->opcode) {
+		case 0x0A: addr = gb->bc; break;
+		case 0x1A: addr = gb->de; break;
+		case 0xF0: addr = 0xFF00 | (insn->imm & 0xFF); break;
+		case 0xF2: addr = 0xFF00 | gb->c; break;
+		case 0xFA: addr = insn->imm; break;
+		case 0xCB:
+			if ((insn->imm & 0x07) != 6)
+				continue;
+			addr = gb->hl;
+			break;
+		case 0x40 ... 0xBF:
+			if ((insn->opcode & 0x07) != 6)
+				continue;
+			addr = gb->hl;
+			break;
+		default:
+			continue;
+		}
+
+		if (!idle_read_safe(addr))
+			return false;
 	}
+
+	return true;
 }
 
-static void process_opcode(struct gameboy *gb, uint8_t opcode)
+static void skip_idle_loop(struct gameboy *gb, struct gameboy_block *block)
 {
-	switch (opcode) {
-	case 0x00: instr_nop(gb); break;
-	case 0x10: instr_stop(gb); break;
-	case 0x76: instr_halt(gb); break;
-	case 0xCB: process_cb_opcode(gb, iv(gb)); break;
-	case 0xF3: instr_di(gb); break;
-	case 0xFB: instr_ei(gb); break;
-
-	case 0x01: instr_ld_rr_vv(gb, &gb->bc, iv16(gb)); break;
-	case 0x11: instr_ld_rr_vv(gb, &gb->de, iv16(gb)); break;
-	case 0x21: instr_ld_rr_vv(gb, &gb->hl, iv16(gb)); break;
-	case 0x31: instr_ld_rr_vv(gb, &gb->sp, iv16(gb)); break;
-
-	case 0x02: instr_ld_aa_v(gb, gb->bc, gb->a); break;
-	case 0x12: instr_ld_aa_v(gb, gb->de, gb->a); break;
-	case 0x22: instr_ld_aa_v(gb, gb->hl++, gb->a); break;
-	case 0x32: instr_ld_aa_v(gb, gb->hl--, gb->a); break;
-
-	case 0x03: instr_inc_rr(gb, &gb->bc); break;
-	case 0x13: instr_inc_rr(gb, &gb->de); break;
-	case 0x23: instr_inc_rr(gb, &gb->hl); break;
-	case 0x33: instr_inc_rr(gb, &gb->sp); break;
-
-	case 0x04: instr_inc_r(gb, &gb->b); break;
-	case 0x14: instr_inc_r(gb, &gb->d); break;
-	case 0x24: instr_inc_r(gb, &gb->h); break;
-	case 0x34: instr_inc_aa(gb, gb->hl); break;
-
-	case 0x05: instr_dec_r(gb, &gb->b); break;
-	case 0x15: instr_dec_r(gb, &gb->d); break;
-	case 0x25: instr_dec_r(gb, &gb->h); break;
-	case 0x35: instr_dec_aa(gb, gb->hl); break;
-
-	case 0x06: instr_ld_r_v(gb, &gb->b, iv(gb)); break;
-	case 0x16: instr_ld_r_v(gb, &gb->d, iv(gb)); break;
-	case 0x26: instr_ld_r_v(gb, &gb->h, iv(gb)); break;
-	case 0x36: instr_ld_aa_v(gb, gb->hl, iv(gb)); break;
-
-	case 0x07: instr_rlca(gb); break;
-	case 0x0F: instr_rrca(gb); break;
-	case 0x17: instr_rla(gb); break;
-	case 0x1F: instr_rra(gb); break;
-	case 0x27: instr_daa_r(gb, &gb->a); break;
-	case 0x2F: instr_cpl_r(gb, &gb->a); break;
-	case 0x37: instr_scf(gb); break;
-	case 0x3F: instr_ccf(gb); break;
-
-	case 0x08: instr_ld_aa_vv(gb, iv16(gb), gb->sp); break;
-
-	case 0x18: instr_jr(gb, true); break;
-	case 0x20: instr_jr(gb, !gb->zero); break;
-	case 0x28: instr_jr(gb, gb->zero); break;
-	case 0x30: instr_jr(gb, !gb->carry); break;
-	case 0x38: instr_jr(gb, gb->carry); break;
-
-	case 0x09: instr_add_rr_vv(gb, &gb->hl, gb->bc); break;
-	case 0x19: instr_add_rr_vv(gb, &gb->hl, gb->de); break;
-	case 0x29: instr_add_rr_vv(gb, &gb->hl, gb->hl); break;
-	case 0x39: instr_add_rr_vv(gb, &gb->hl, gb->sp); break;
-
-	case 0x0A: instr_ld_r_aa(gb, &gb->a, gb->bc); break;
-	case 0x1A: instr_ld_r_aa(gb, &gb->a, gb->de); break;
-	case 0x2A: instr_ld_r_aa(gb, &gb->a, gb->hl++); break;
-	case 0x3A: instr_ld_r_aa(gb, &gb->a, gb->hl--); break;
-
-	case 0x0B: instr_dec_rr(gb, &gb->bc); break;
-	case 0x1B: instr_dec_rr(gb, &gb->de); break;
-	case 0x2B: instr_dec_rr(gb, &gb->hl); break;
-	case 0x3B: instr_dec_rr(gb, &gb->sp); break;
-
-	case 0x0C: instr_inc_r(gb, &gb->c); break;
-	case 0x1C: instr_inc_r(gb, &gb->e); break;
-	case 0x2C: instr_inc_r(gb, &gb->l); break;
-	case 0x3C: instr_inc_r(gb, &gb->a); break;
-
-	case 0x0D: instr_dec_r(gb, &gb->c); break;
-	case 0x1D: instr_dec_r(gb, &gb->e); break;
-	case 0x2D: instr_dec_r(gb, &gb->l); break;
-	case 0x3D: instr_dec_r(gb, &gb->a); break;
-
-	case 0x0E: instr_ld_r_v(gb, &gb->c, iv(gb)); break;
-	case 0x1E: instr_ld_r_v(gb, &gb->e, iv(gb)); break;
-	case 0x2E: instr_ld_r_v(gb, &gb->l, iv(gb)); break;
-	case 0x3E: instr_ld_r_v(gb, &gb->a, iv(gb)); break;
-
-	case 0x40: instr_ld_r_v(gb, &gb->b, gb->b); break;
-	case 0x41: instr_ld_r_v(gb, &gb->b, gb->c); break;
-	case 0x42: instr_ld_r_v(gb, &gb->b, gb->d); break;
-	case 0x43: instr_ld_r_v(gb, &gb->b, gb->e); break;
-	case 0x44: instr_ld_r_v(gb, &gb->b, gb->h); break;
-	case 0x45: instr_ld_r_v(gb, &gb->b, gb->l); break;
-	case 0x47: instr_ld_r_v(gb, &gb->b, gb->a); break;
-
-	case 0x48: instr_ld_r_v(gb, &gb->c, gb->b); break;
-	case 0x49: instr_ld_r_v(gb, &gb->c, gb->c); break;
-	case 0x4A: instr_ld_r_v(gb, &gb->c, gb->d); break;
-	case 0x4B: instr_ld_r_v(gb, &gb->c, gb->e); break;
-	case 0x4C: instr_ld_r_v(gb, &gb->c, gb->h); break;
-	case 0x4D: instr_ld_r_v(gb, &gb->c, gb->l); break;
-	case 0x4F: instr_ld_r_v(gb, &gb->c, gb->a); break;
-
-	case 0x50: instr_ld_r_v(gb, &gb->d, gb->b); break;
-	case 0x51: instr_ld_r_v(gb, &gb->d, gb->c); break;
-	case 0x52: instr_ld_r_v(gb, &gb->d, gb->d); break;
-	case 0x53: instr_ld_r_v(gb, &gb->d, gb->e); break;
-	case 0x54: instr_ld_r_v(gb, &gb->d, gb->h); break;
-	case 0x55: instr_ld_r_v(gb, &gb->d, gb->l); break;
-	case 0x57: instr_ld_r_v(gb, &gb->d, gb->a); break;
-
-	case 0x58: instr_ld_r_v(gb, &gb->e, gb->b); break;
-	case 0x59: instr_ld_r_v(gb, &gb->e, gb->c); break;
-	case 0x5A: instr_ld_r_v(gb, &gb->e, gb->d); break;
-	case 0x5B: instr_ld_r_v(gb, &gb->e, gb->e); break;
-	case 0x5C: instr_ld_r_v(gb, &gb->e, gb->h); break;
-	case 0x5D: instr_ld_r_v(gb, &gb->e, gb->l); break;
-	case 0x5F: instr_ld_r_v(gb, &gb->e, gb->a); break;
-
-	case 0x60: instr_ld_r_v(gb, &gb->h, gb->b); break;
-	case 0x61: instr_ld_r_v(gb, &gb->h, gb->c); break;
-	case 0x62: instr_ld_r_v(gb, &gb->h, gb->d); break;
-	case 0x63: instr_ld_r_v(gb, &gb->h, gb->e); break;
-	case 0x64: instr_ld_r_v(gb, &gb->h, gb->h); break;
-	case 0x65: instr_ld_r_v(gb, &gb->h, gb->l); break;
-	case 0x67: instr_ld_r_v(gb, &gb->h, gb->a); break;
-
-	case 0x68: instr_ld_r_v(gb, &gb->l, gb->b); break;
-	case 0x69: instr_ld_r_v(gb, &gb->l, gb->c); break;
-	case 0x6A: instr_ld_r_v(gb, &gb->l, gb->d); break;
-	case 0x6B: instr_ld_r_v(gb, &gb->l, gb->e); break;
-	case 0x6C: instr_ld_r_v(gb, &gb->l, gb->h); break;
-	case 0x6D: instr_ld_r_v(gb, &gb->l, gb->l); break;
-	case 0x6F: instr_ld_r_v(gb, &gb->l, gb->a); break;
-
-	case 0x70: instr_ld_aa_v(gb, gb->hl, gb->b); break;
-	case 0x71: instr_ld_aa_v(gb, gb->hl, gb->c); break;
-	case 0x72: instr_ld_aa_v(gb, gb->hl, gb->d); break;
-	case 0x73: instr_ld_aa_v(gb, gb->hl, gb->e); break;
-	case 0x74: instr_ld_aa_v(gb, gb->hl, gb->h); break;
-	case 0x75: instr_ld_aa_v(gb, gb->hl, gb->l); break;
-	case 0x77: instr_ld_aa_v(gb, gb->hl, gb->a); break;
-
-	case 0x78: instr_ld_r_v(gb, &gb->a, gb->b); break;
-	case 0x79: instr_ld_r_v(gb, &gb->a, gb->c); break;
-	case 0x7A: instr_ld_r_v(gb, &gb->a, gb->d); break;
-	case 0x7B: instr_ld_r_v(gb, &gb->a, gb->e); break;
-	case 0x7C: instr_ld_r_v(gb, &gb->a, gb->h); break;
-	case 0x7D: instr_ld_r_v(gb, &gb->a, gb->l); break;
-	case 0x7F: instr_ld_r_v(gb, &gb->a, gb->a); break;
-
-	case 0x46: instr_ld_r_aa(gb, &gb->b, gb->hl); break;
-	case 0x4E: instr_ld_r_aa(gb, &gb->c, gb->hl); break;
-	case 0x56: instr_ld_r_aa(gb, &gb->d, gb->hl); break;
-	case 0x5E: instr_ld_r_aa(gb, &gb->e, gb->hl); break;
-	case 0x66: instr_ld_r_aa(gb, &gb->h, gb->hl); break;
-	case 0x6E: instr_ld_r_aa(gb, &gb->l, gb->hl); break;
-	case 0x7E: instr_ld_r_aa(gb, &gb->a, gb->hl); break;
-
-	case 0x80: instr_add_r_v(gb, &gb->a, gb->b); break;
-	case 0x81: instr_add_r_v(gb, &gb->a, gb->c); break;
-	case 0x82: instr_add_r_v(gb, &gb->a, gb->d); break;
-	case 0x83: instr_add_r_v(gb, &gb->a, gb->e); break;
-	case 0x84: instr_add_r_v(gb, &gb->a, gb->h); break;
-	case 0x85: instr_add_r_v(gb, &gb->a, gb->l); break;
-	case 0x87: instr_add_r_v(gb, &gb->a, gb->a); break;
-
-	case 0x88: instr_adc_r_v(gb, &gb->a, gb->b); break;
-	case 0x89: instr_adc_r_v(gb, &gb->a, gb->c); break;
-	case 0x8A: instr_adc_r_v(gb, &gb->a, gb->d); break;
-	case 0x8B: instr_adc_r_v(gb, &gb->a, gb->e); break;
-	case 0x8C: instr_adc_r_v(gb, &gb->a, gb->h); break;
-	case 0x8D: instr_adc_r_v(gb, &gb->a, gb->l); break;
-	case 0x8F: instr_adc_r_v(gb, &gb->a, gb->a); break;
-
-	case 0x90: instr_sub_r_v(gb, &gb->a, gb->b); break;
-	case 0x91: instr_sub_r_v(gb, &gb->a, gb->c); break;
-	case 0x92: instr_sub_r_v(gb, &gb->a, gb->d); break;
-	case 0x93: instr_sub_r_v(gb, &gb->a, gb->e); break;
-	case 0x94: instr_sub_r_v(gb, &gb->a, gb->h); break;
-	case 0x95: instr_sub_r_v(gb, &gb->a, gb->l); break;
-	case 0x97: instr_sub_r_v(gb, &gb->a, gb->a); break;
-
-	case 0x98: instr_sbc_r_v(gb, &gb->a, gb->b); break;
-	case 0x99: instr_sbc_r_v(gb, &gb->a, gb->c); break;
-	case 0x9A: instr_sbc_r_v(gb, &gb->a, gb->d); break;
-	case 0x9B: instr_sbc_r_v(gb, &gb->a, gb->e); break;
-	case 0x9C: instr_sbc_r_v(gb, &gb->a, gb->h); break;
-	case 0x9D: instr_sbc_r_v(gb, &gb->a, gb->l); break;
-	case 0x9F: instr_sbc_r_v(gb, &gb->a, gb->a); break;
-
-	case 0xA0: instr_and_r_v(gb, &gb->a, gb->b); break;
-	case 0xA1: instr_and_r_v(gb, &gb->a, gb->c); break;
-	case 0xA2: instr_and_r_v(gb, &gb->a, gb->d); break;
-	case 0xA3: instr_and_r_v(gb, &gb->a, gb->e); break;
-	case 0xA4: instr_and_r_v(gb, &gb->a, gb->h); break;
-	case 0xA5: instr_and_r_v(gb, &gb->a, gb->l); break;
-	case 0xA7: instr_and_r_v(gb, &gb->a, gb->a); break;
-
-	case 0xA8: instr_xor_r_v(gb, &gb->a, gb->b); break;
-	case 0xA9: instr_xor_r_v(gb, &gb->a, gb->c); break;
-	case 0xAA: instr_xor_r_v(gb, &gb->a, gb->d); break;
-	case 0xAB: instr_xor_r_v(gb, &gb->a, gb->e); break;
-	case 0xAC: instr_xor_r_v(gb, &gb->a, gb->h); break;
-	case 0xAD: instr_xor_r_v(gb, &gb->a, gb->l); break;
-	case 0xAF: instr_xor_r_v(gb, &gb->a, gb->a); break;
-
-	case 0xB0: instr_or_r_v(gb, &gb->a, gb->b); break;
-	case 0xB1: instr_or_r_v(gb, &gb->a, gb->c); break;
-	case 0xB2: instr_or_r_v(gb, &gb->a, gb->d); break;
-	case 0xB3: instr_or_r_v(gb, &gb->a, gb->e); break;
-	case 0xB4: instr_or_r_v(gb, &gb->a, gb->h); break;
-	case 0xB5: instr_or_r_v(gb, &gb->a, gb->l); break;
-	case 0xB7: instr_or_r_v(gb, &gb->a, gb->a); break;
-
-	case 0xB8: instr_cp_r_v(gb, &gb->a, gb->b); break;
-	case 0xB9: instr_cp_r_v(gb, &gb->a, gb->c); break;
-	case 0xBA: instr_cp_r_v(gb, &gb->a, gb->d); break;
-	case 0xBB: instr_cp_r_v(gb, &gb->a, gb->e); break;
-	case 0xBC: instr_cp_r_v(gb, &gb->a, gb->h); break;
-	case 0xBD: instr_cp_r_v(gb, &gb->a, gb->l); break;
-	case 0xBF: instr_cp_r_v(gb, &gb->a, gb->a); break;
-
-	case 0x86: instr_add_r_aa(gb, &gb->a, gb->hl); break;
-	case 0x8E: instr_adc_r_aa(gb, &gb->a, gb->hl); break;
-	case 0x96: instr_sub_r_aa(gb, &gb->a, gb->hl); break;
-	case 0x9E: instr_sbc_r_aa(gb, &gb->a, gb->hl); break;
-	case 0xA6: instr_and_r_aa(gb, &gb->a, gb->hl); break;
-	case 0xAE: instr_xor_r_aa(gb, &gb->a, gb->hl); break;
-	case 0xB6: instr_or_r_aa(gb, &gb->a, gb->hl); break;
-	case 0xBE: instr_cp_r_aa(gb, &gb->a, gb->hl); break;
-
-	case 0xC6: instr_add_r_v(gb, &gb->a, iv(gb)); break;
-	case 0xCE: instr_adc_r_v(gb, &gb->a, iv(gb)); break;
-	case 0xD6: instr_sub_r_v(gb, &gb->a, iv(gb)); break;
-	case 0xDE: instr_sbc_r_v(gb, &gb->a, iv(gb)); break;
-	case 0xE6: instr_and_r_v(gb, &gb->a, iv(gb)); break;
-	case 0xEE: instr_xor_r_v(gb, &gb->a, iv(gb)); break;
-	case 0xF6: instr_or_r_v(gb, &gb->a, iv(gb)); break;
-	case 0xFE: instr_cp_r_v(gb, &gb->a, iv(gb)); break;
-
-	case 0xC0: tick(gb); instr_ret(gb, !gb->zero); break;
-	case 0xC8: tick(gb); instr_ret(gb, gb->zero); break;
-	case 0xC9:           instr_ret(gb, true); break;
-	case 0xD0: tick(gb); instr_ret(gb, !gb->carry); break;
-	case 0xD8: tick(gb); instr_ret(gb, gb->carry); break;
-	case 0xD9:           instr_reti(gb); break;
-
-	case 0xE0: instr_ld_aa_v(gb, 0xFF00 | iv(gb), gb->a); break;
-	case 0xE2: instr_ld_aa_v(gb, 0xFF00 | gb->c, gb->a); break;
-	case 0xEA: instr_ld_aa_v(gb, iv16(gb), gb->a); break;
-	case 0xF0: instr_ld_r_aa(gb, &gb->a, 0xFF00 | iv(gb)); break;
-	case 0xF2: instr_ld_r_aa(gb, &gb->a, 0xFF00 | gb->c); break;
-	case 0xFA: instr_ld_r_aa(gb, &gb->a, iv16(gb)); break;
-
-	case 0xC1: instr_pop(gb, &gb->bc); break;
-	case 0xD1: instr_pop(gb, &gb->de); break;
-	case 0xE1: instr_pop(gb, &gb->hl); break;
-	case 0xF1: instr_pop(gb, &gb->af); gb->f &= 0xF0; break;
-
-	case 0xC2: instr_jp(gb, !gb->zero); break;
-	case 0xC3: instr_jp(gb, true); break;
-	case 0xCA: instr_jp(gb, gb->zero); break;
-	case 0xD2: instr_jp(gb, !gb->carry); break;
-	case 0xDA: instr_jp(gb, gb->carry); break;
-
-	case 0xC4: instr_call(gb, !gb->zero); break;
-	case 0xCC: instr_call(gb, gb->zero); break;
-	case 0xCD: instr_call(gb, true); break;
-	case 0xD4: instr_call(gb, !gb->carry); break;
-	case 0xDC: instr_call(gb, gb->carry); break;
-
-	case 0xC5: instr_push(gb, gb->bc); break;
-	case 0xD5: instr_push(gb, gb->de); break;
-	case 0xE5: instr_push(gb, gb->hl); break;
-	case 0xF5: instr_push(gb, gb->af); break;
-
-	case 0xC7: instr_rst(gb, 0x0000); break;
-	case 0xCF: instr_rst(gb, 0x0008); break;
-	case 0xD7: instr_rst(gb, 0x0010); break;
-	case 0xDF: instr_rst(gb, 0x0018); break;
-	case 0xE7: instr_rst(gb, 0x0020); break;
-	case 0xEF: instr_rst(gb, 0x0028); break;
-	case 0xF7: instr_rst(gb, 0x0030); break;
-	case 0xFF: instr_rst(gb, 0x0038); break;
+	if (block->idle == GAMEBOY_BLOCK_IDLE_UNKNOWN) {
+		int cycles = idle_loop_cycles(gb, block);
+		block->idle = cycles < 0 ? GAMEBOY_BLOCK_IDLE_NO : GAMEBOY_BLOCK_IDLE_YES;
+		block->idle_cycles = cycles < 0 ? 0 : cycles;
+	}
+	if (block->idle != GAMEBOY_BLOCK_IDLE_YES)
+		return;
+
+	gameboy_pack_flags(gb);
+	uint16_t regs[5] = { gb->af, gb->bc, gb->de, gb->hl, gb->sp };
+	long length = gb->cycles - block->idle_entry;
+	long expected = block->idle_cycles * (gb->double_speed ? 2 : 4);
+
+	// The last pass went straight round the loop (it took exactly as long
+	// as one iteration), started in the same state and didn't cross a
+	// deadline (which would have moved next_event_in past it)
+	if (block->idle_deadline == gb->next_event_in &&
+	    gb->ime_status == block->idle_ime &&
+	    length > 0 && (!expected || length == expected) &&
+	    !memcmp(regs, block->idle_regs, sizeof(regs)) &&
+	    idle_reads_safe(gb, block))
+		gb->cycles += (gb->next_event_in - 1 - gb->cycles) / length * length;
+
+	block->idle_entry = gb->cycles;
+	block->idle_deadline = gb->next_event_in;
+	block->idle_ime = gb->ime_status;
+	memcpy(block->idle_regs, regs, sizeof(regs));
+}
+
+// Each handler ends by fetching and dispatching the next opcode itself, so
+// the indirect branch is replicated per opcode rather than shared by all of
+// them.  Execution returns to the caller once the cycle budget is spent or
+// anything outside of plain instruction flow needs attention (interrupts,
+// EI's delay slot, HDMA, HALT/STOP, crashes).
+static void execute(struct gameboy *gb, long till)
+{
+	static const void *const opcodes[0x100] = {
+		&&op_00, &&op_01, &&op_02, &&op_03, &&op_04, &&op_05, &&op_06, &&op_07,
+		&&op_08, &&op_09, &&op_0A, &&op_0B, &&op_0C, &&op_0D, &&op_0E, &&op_0F,
+		&&op_10, &&op_11, &&op_12, &&op_13, &&op_14, &&op_15, &&op_16, &&op_17,
+		&&op_18, &&op_19, &&op_1A, &&op_1B, &&op_1C, &&op_1D, &&op_1E, &&op_1F,
+		&&op_20, &&op_21, &&op_22, &&op_23, &&op_24, &&op_25, &&op_26, &&op_27,
+		&&op_28, &&op_29, &&op_2A, &&op_2B, &&op_2C, &&op_2D, &&op_2E, &&op_2F,
+		&&op_30, &&op_31, &&op_32, &&op_33, &&op_34, &&op_35, &&op_36, &&op_37,
+		&&op_38, &&op_39, &&op_3A, &&op_3B, &&op_3C, &&op_3D, &&op_3E, &&op_3F,
+		&&op_40, &&op_41, &&op_42, &&op_43, &&op_44, &&op_45, &&op_46, &&op_47,
+		&&op_48, &&op_49, &&op_4A, &&op_4B, &&op_4C, &&op_4D, &&op_4E, &&op_4F,
+		&&op_50, &&op_51, &&op_52, &&op_53, &&op_54, &&op_55, &&op_56, &&op_57,
+		&&op_58, &&op_59, &&op_5A, &&op_5B, &&op_5C, &&op_5D, &&op_5E, &&op_5F,
+		&&op_60, &&op_61, &&op_62, &&op_63, &&op_64, &&op_65, &&op_66, &&op_67,
+		&&op_68, &&op_69, &&op_6A, &&op_6B, &&op_6C, &&op_6D, &&op_6E, &&op_6F,
+		&&op_70, &&op_71, &&op_72, &&op_73, &&op_74, &&op_75, &&op_76, &&op_77,
+		&&op_78, &&op_79, &&op_7A, &&op_7B, &&op_7C, &&op_7D, &&op_7E, &&op_7F,
+		&&op_80, &&op_81, &&op_82, &&op_83, &&op_84, &&op_85, &&op_86, &&op_87,
+		&&op_88, &&op_89, &&op_8A, &&op_8B, &&op_8C, &&op_8D, &&op_8E, &&op_8F,
+		&&op_90, &&op_91, &&op_92, &&op_93, &&op_94, &&op_95, &&op_96, &&op_97,
+		&&op_98, &&op_99, &&op_9A, &&op_9B, &&op_9C, &&op_9D, &&op_9E, &&op_9F,
+		&&op_A0, &&op_A1, &&op_A2, &&op_A3, &&op_A4, &&op_A5, &&op_A6, &&op_A7,
+		&&op_A8, &&op_A9, &&op_AA, &&op_AB, &&op_AC, &&op_AD, &&op_AE, &&op_AF,
+		&&op_B0, &&op_B1, &&op_B2, &&op_B3, &&op_B4, &&op_B5, &&op_B6, &&op_B7,
+		&&op_B8, &&op_B9, &&op_BA, &&op_BB, &&op_BC, &&op_BD, &&op_BE, &&op_BF,
+		&&op_C0, &&op_C1, &&op_C2, &&op_C3, &&op_C4, &&op_C5, &&op_C6, &&op_C7,
+		&&op_C8, &&op_C9, &&op_CA, &&op_CB, &&op_CC, &&op_CD, &&op_CE, &&op_CF,
+		&&op_D0, &&op_D1, &&op_D2, &&op_D3, &&op_D4, &&op_D5, &&op_D6, &&op_D7,
+		&&op_D8, &&op_D9, &&op_DA, &&op_DB, &&op_DC, &&op_DD, &&op_DE, &&op_DF,
+		&&op_E0, &&op_E1, &&op_E2, &&op_E3, &&op_E4, &&op_E5, &&op_E6, &&op_E7,
+		&&op_E8, &&op_E9, &&op_EA, &&op_EB, &&op_EC, &&op_ED, &&op_EE, &&op_EF,
+		&&op_F0, &&op_F1, &&op_F2, &&op_F3, &&op_F4, &&op_F5, &&op_F6, &&op_F7,
+		&&op_F8, &&op_F9, &&op_FA, &&op_FB, &&op_FC, &&op_FD, &&op_FE, &&op_FF,
+	};
+
+	struct gameboy_block *block = NULL;
+	const struct gameboy_insn *insn = NULL;
+	uint8_t opcode;
+	uint16_t insn_pc;
+	long insn_cycles;
+
+// Instructions come from the predecoded block covering PC when there is one
+// and from the bus otherwise.  Both paths tick once per byte fetched.  A
+// block with a native translation runs that instead, all at once, unless
+// the profiler, tracer, or breakpoints need to see each instruction, or
+// gameboy_tick is single-stepping (till already reached).  Idle loops are
+// only skipped under the same conditions.
+#define FETCH() \
+	do { \
+		if (gb->breakpoints && breakpoint_exec(gb)) \
+			return; \
+		if (gb->profile) \
+			profile_insn(gb, gb->pc); \
+		if (!insn || ++insn == block->insns + block->count || \
+		    !block_mapped(gb, block)) { \
+			block = block_lookup(gb, gb->pc); \
+			insn = block ? block->insns : NULL; \
+			if (block && !gb->profile && !gb->trace && \
+			    !gb->breakpoints && gb->cycles < till) \
+				skip_idle_loop(gb, block); \
+			if (block && gb->jit && !gb->profile && !gb->trace && \
+			    !gb->breakpoints && gb->cycles < till && jit_run(gb, block)) { \
+				insn = NULL; \
+				goto next; \
+			} \
+		} \
+		insn_pc = gb->pc; \
+		insn_cycles = gb->cycles; \
+		if (insn) { \
+			++gb->pc; \
+			tick(gb); \
+			opcode = insn->opcode; \
+		} else { \
+			opcode = iv(gb); \
+		} \
+		if (gb->trace) \
+			trace_insn(gb, insn_pc, insn_cycles, opcode); \
+	} while (0)
+
+#define IMM8()  (insn ? imm8(gb, insn) : iv(gb))
+#define IMM16() (insn ? imm16(gb, insn) : iv16(gb))
+
+#define DISPATCH() \
+	do { \
+		if (gb->cycles >= till || cpu_needs_attention(gb)) \
+			return; \
+		FETCH(); \
+		goto *opcodes[opcode]; \
+	} while (0)
+
+	FETCH();
+	goto *opcodes[opcode];
+
+next:
+	DISPATCH();
+
+	op_00: instr_nop(gb); DISPATCH();
+	op_10: instr_stop(gb); DISPATCH();
+	op_76: instr_halt(gb); DISPATCH();
+	op_CB: process_cb_opcode(gb, IMM8()); DISPATCH();
+	op_F3: instr_di(gb); DISPATCH();
+	op_FB: instr_ei(gb); DISPATCH();
+
+	op_01: LD(gb->bc, IMM16()); DISPATCH();
+	op_11: LD(gb->de, IMM16()); DISPATCH();
+	op_21: LD(gb->hl, IMM16()); DISPATCH();
+	op_31: LD(gb->sp, IMM16()); DISPATCH();
+
+	op_02: instr_ld_aa_v(gb, gb->bc, gb->a); DISPATCH();
+	op_12: instr_ld_aa_v(gb, gb->de, gb->a); DISPATCH();
+	op_22: instr_ld_aa_v(gb, gb->hl++, gb->a); DISPATCH();
+	op_32: instr_ld_aa_v(gb, gb->hl--, gb->a); DISPATCH();
+
+	op_03: INC16(gb->bc); DISPATCH();
+	op_13: INC16(gb->de); DISPATCH();
+	op_23: INC16(gb->hl); DISPATCH();
+	op_33: INC16(gb->sp); DISPATCH();
+
+	op_04: INC(gb->b); DISPATCH();
+	op_14: INC(gb->d); DISPATCH();
+	op_24: INC(gb->h); DISPATCH();
+	op_34: RMW_HL(INC); DISPATCH();
+
+	op_05: DEC(gb->b); DISPATCH();
+	op_15: DEC(gb->d); DISPATCH();
+	op_25: DEC(gb->h); DISPATCH();
+	op_35: RMW_HL(DEC); DISPATCH();
+
+	op_06: LD(gb->b, IMM8()); DISPATCH();
+	op_16: LD(gb->d, IMM8()); DISPATCH();
+	op_26: LD(gb->h, IMM8()); DISPATCH();
+	op_36: instr_ld_aa_v(gb, gb->hl, IMM8()); DISPATCH();
+
+	op_07: instr_rlca(gb); DISPATCH();
+	op_0F: instr_rrca(gb); DISPATCH();
+	op_17: instr_rla(gb); DISPATCH();
+	op_1F: instr_rra(gb); DISPATCH();
+	op_27: instr_daa(gb); DISPATCH();
+	op_2F: instr_cpl(gb); DISPATCH();
+	op_37: instr_scf(gb); DISPATCH();
+	op_3F: instr_ccf(gb); DISPATCH();
+
+	op_08: instr_ld_aa_vv(gb, IMM16(), gb->sp); DISPATCH();
+
+	op_18: instr_jr(gb, true, IMM8()); DISPATCH();
+	op_20: instr_jr(gb, !ZERO, IMM8()); DISPATCH();
+	op_28: instr_jr(gb, ZERO, IMM8()); DISPATCH();
+	op_30: instr_jr(gb, !CARRY, IMM8()); DISPATCH();
+	op_38: instr_jr(gb, CARRY, IMM8()); DISPATCH();
+
+	op_09: ADD_HL(gb->bc); DISPATCH();
+	op_19: ADD_HL(gb->de); DISPATCH();
+	op_29: ADD_HL(gb->hl); DISPATCH();
+	op_39: ADD_HL(gb->sp); DISPATCH();
+
+	op_0A: LD(gb->a, timed_read(gb, gb->bc)); DISPATCH();
+	op_1A: LD(gb->a, timed_read(gb, gb->de)); DISPATCH();
+	op_2A: LD(gb->a, timed_read(gb, gb->hl++)); DISPATCH();
+	op_3A: LD(gb->a, timed_read(gb, gb->hl--)); DISPATCH();
+
+	op_0B: DEC16(gb->bc); DISPATCH();
+	op_1B: DEC16(gb->de); DISPATCH();
+	op_2B: DEC16(gb->hl); DISPATCH();
+	op_3B: DEC16(gb->sp); DISPATCH();
+
+	op_0C: INC(gb->c); DISPATCH();
+	op_1C: INC(gb->e); DISPATCH();
+	op_2C: INC(gb->l); DISPATCH();
+	op_3C: INC(gb->a); DISPATCH();
+
+	op_0D: DEC(gb->c); DISPATCH();
+	op_1D: DEC(gb->e); DISPATCH();
+	op_2D: DEC(gb->l); DISPATCH();
+	op_3D: DEC(gb->a); DISPATCH();
+
+	op_0E: LD(gb->c, IMM8()); DISPATCH();
+	op_1E: LD(gb->e, IMM8()); DISPATCH();
+	op_2E: LD(gb->l, IMM8()); DISPATCH();
+	op_3E: LD(gb->a, IMM8()); DISPATCH();
+
+	op_40: LD(gb->b, gb->b); DISPATCH();
+	op_41: LD(gb->b, gb->c); DISPATCH();
+	op_42: LD(gb->b, gb->d); DISPATCH();
+	op_43: LD(gb->b, gb->e); DISPATCH();
+	op_44: LD(gb->b, gb->h); DISPATCH();
+	op_45: LD(gb->b, gb->l); DISPATCH();
+	op_47: LD(gb->b, gb->a); DISPATCH();
+
+	op_48: LD(gb->c, gb->b); DISPATCH();
+	op_49: LD(gb->c, gb->c); DISPATCH();
+	op_4A: LD(gb->c, gb->d); DISPATCH();
+	op_4B: LD(gb->c, gb->e); DISPATCH();
+	op_4C: LD(gb->c, gb->h); DISPATCH();
+	op_4D: LD(gb->c, gb->l); DISPATCH();
+	op_4F: LD(gb->c, gb->a); DISPATCH();
+
+	op_50: LD(gb->d, gb->b); DISPATCH();
+	op_51: LD(gb->d, gb->c); DISPATCH();
+	op_52: LD(gb->d, gb->d); DISPATCH();
+	op_53: LD(gb->d, gb->e); DISPATCH();
+	op_54: LD(gb->d, gb->h); DISPATCH();
+	op_55: LD(gb->d, gb->l); DISPATCH();
+	op_57: LD(gb->d, gb->a); DISPATCH();
+
+	op_58: LD(gb->e, gb->b); DISPATCH();
+	op_59: LD(gb->e, gb->c); DISPATCH();
+	op_5A: LD(gb->e, gb->d); DISPATCH();
+	op_5B: LD(gb->e, gb->e); DISPATCH();
+	op_5C: LD(gb->e, gb->h); DISPATCH();
+	op_5D: LD(gb->e, gb->l); DISPATCH();
+	op_5F: LD(gb->e, gb->a); DISPATCH();
+
+	op_60: LD(gb->h, gb->b); DISPATCH();
+	op_61: LD(gb->h, gb->c); DISPATCH();
+	op_62: LD(gb->h, gb->d); DISPATCH();
+	op_63: LD(gb->h, gb->e); DISPATCH();
+	op_64: LD(gb->h, gb->h); DISPATCH();
+	op_65: LD(gb->h, gb->l); DISPATCH();
+	op_67: LD(gb->h, gb->a); DISPATCH();
+
+	op_68: LD(gb->l, gb->b); DISPATCH();
+	op_69: LD(gb->l, gb->c); DISPATCH();
+	op_6A: LD(gb->l, gb->d); DISPATCH();
+	op_6B: LD(gb->l, gb->e); DISPATCH();
+	op_6C: LD(gb->l, gb->h); DISPATCH();
+	op_6D: LD(gb->l, gb->l); DISPATCH();
+	op_6F: LD(gb->l, gb->a); DISPATCH();
+
+	op_70: instr_ld_aa_v(gb, gb->hl, gb->b); DISPATCH();
+	op_71: instr_ld_aa_v(gb, gb->hl, gb->c); DISPATCH();
+	op_72: instr_ld_aa_v(gb, gb->hl, gb->d); DISPATCH();
+	op_73: instr_ld_aa_v(gb, gb->hl, gb->e); DISPATCH();
+	op_74: instr_ld_aa_v(gb, gb->hl, gb->h); DISPATCH();
+	op_75: instr_ld_aa_v(gb, gb->hl, gb->l); DISPATCH();
+	op_77: instr_ld_aa_v(gb, gb->hl, gb->a); DISPATCH();
+
+	op_78: LD(gb->a, gb->b); DISPATCH();
+	op_79: LD(gb->a, gb->c); DISPATCH();
+	op_7A: LD(gb->a, gb->d); DISPATCH();
+	op_7B: LD(gb->a, gb->e); DISPATCH();
+	op_7C: LD(gb->a, gb->h); DISPATCH();
+	op_7D: LD(gb->a, gb->l); DISPATCH();
+	op_7F: LD(gb->a, gb->a); DISPATCH();
+
+	op_46: LD(gb->b, timed_read(gb, gb->hl)); DISPATCH();
+	op_4E: LD(gb->c, timed_read(gb, gb->hl)); DISPATCH();
+	op_56: LD(gb->d, timed_read(gb, gb->hl)); DISPATCH();
+	op_5E: LD(gb->e, timed_read(gb, gb->hl)); DISPATCH();
+	op_66: LD(gb->h, timed_read(gb, gb->hl)); DISPATCH();
+	op_6E: LD(gb->l, timed_read(gb, gb->hl)); DISPATCH();
+	op_7E: LD(gb->a, timed_read(gb, gb->hl)); DISPATCH();
+
+	op_80: ADD(gb->b); DISPATCH();
+	op_81: ADD(gb->c); DISPATCH();
+	op_82: ADD(gb->d); DISPATCH();
+	op_83: ADD(gb->e); DISPATCH();
+	op_84: ADD(gb->h); DISPATCH();
+	op_85: ADD(gb->l); DISPATCH();
+	op_87: ADD(gb->a); DISPATCH();
+
+	op_88: ADC(gb->b); DISPATCH();
+	op_89: ADC(gb->c); DISPATCH();
+	op_8A: ADC(gb->d); DISPATCH();
+	op_8B: ADC(gb->e); DISPATCH();
+	op_8C: ADC(gb->h); DISPATCH();
+	op_8D: ADC(gb->l); DISPATCH();
+	op_8F: ADC(gb->a); DISPATCH();
+
+	op_90: SUB(gb->b); DISPATCH();
+	op_91: SUB(gb->c); DISPATCH();
+	op_92: SUB(gb->d); DISPATCH();
+	op_93: SUB(gb->e); DISPATCH();
+	op_94: SUB(gb->h); DISPATCH();
+	op_95: SUB(gb->l); DISPATCH();
+	op_97: SUB(gb->a); DISPATCH();
+
+	op_98: SBC(gb->b); DISPATCH();
+	op_99: SBC(gb->c); DISPATCH();
+	op_9A: SBC(gb->d); DISPATCH();
+	op_9B: SBC(gb->e); DISPATCH();
+	op_9C: SBC(gb->h); DISPATCH();
+	op_9D: SBC(gb->l); DISPATCH();
+	op_9F: SBC(gb->a); DISPATCH();
+
+	op_A0: AND(gb->b); DISPATCH();
+	op_A1: AND(gb->c); DISPATCH();
+	op_A2: AND(gb->d); DISPATCH();
+	op_A3: AND(gb->e); DISPATCH();
+	op_A4: AND(gb->h); DISPATCH();
+	op_A5: AND(gb->l); DISPATCH();
+	op_A7: AND(gb->a); DISPATCH();
+
+	op_A8: XOR(gb->b); DISPATCH();
+	op_A9: XOR(gb->c); DISPATCH();
+	op_AA: XOR(gb->d); DISPATCH();
+	op_AB: XOR(gb->e); DISPATCH();
+	op_AC: XOR(gb->h); DISPATCH();
+	op_AD: XOR(gb->l); DISPATCH();
+	op_AF: XOR(gb->a); DISPATCH();
+
+	op_B0: OR(gb->b); DISPATCH();
+	op_B1: OR(gb->c); DISPATCH();
+	op_B2: OR(gb->d); DISPATCH();
+	op_B3: OR(gb->e); DISPATCH();
+	op_B4: OR(gb->h); DISPATCH();
+	op_B5: OR(gb->l); DISPATCH();
+	op_B7: OR(gb->a); DISPATCH();
+
+	op_B8: CP(gb->b); DISPATCH();
+	op_B9: CP(gb->c); DISPATCH();
+	op_BA: CP(gb->d); DISPATCH();
+	op_BB: CP(gb->e); DISPATCH();
+	op_BC: CP(gb->h); DISPATCH();
+	op_BD: CP(gb->l); DISPATCH();
+	op_BF: CP(gb->a); DISPATCH();
+
+	op_86: ADD(timed_read(gb, gb->hl)); DISPATCH();
+	op_8E: ADC(timed_read(gb, gb->hl)); DISPATCH();
+	op_96: SUB(timed_read(gb, gb->hl)); DISPATCH();
+	op_9E: SBC(timed_read(gb, gb->hl)); DISPATCH();
+	op_A6: AND(timed_read(gb, gb->hl)); DISPATCH();
+	op_AE: XOR(timed_read(gb, gb->hl)); DISPATCH();
+	op_B6: OR(timed_read(gb, gb->hl)); DISPATCH();
+	op_BE: CP(timed_read(gb, gb->hl)); DISPATCH();
+
+	op_C6: ADD(IMM8()); DISPATCH();
+	op_CE: ADC(IMM8()); DISPATCH();
+	op_D6: SUB(IMM8()); DISPATCH();
+	op_DE: SBC(IMM8()); DISPATCH();
+	op_E6: AND(IMM8()); DISPATCH();
+	op_EE: XOR(IMM8()); DISPATCH();
+	op_F6: OR(IMM8()); DISPATCH();
+	op_FE: CP(IMM8()); DISPATCH();
+
+	op_C0: tick(gb); instr_ret(gb, !ZERO); DISPATCH();
+	op_C8: tick(gb); instr_ret(gb, ZERO); DISPATCH();
+	op_C9:           instr_ret(gb, true); DISPATCH();
+	op_D0: tick(gb); instr_ret(gb, !CARRY); DISPATCH();
+	op_D8: tick(gb); instr_ret(gb, CARRY); DISPATCH();
+	op_D9:           instr_reti(gb); DISPATCH();
+
+	op_E0: instr_ld_aa_v(gb, 0xFF00 | IMM8(), gb->a); DISPATCH();
+	op_E2: instr_ld_aa_v(gb, 0xFF00 | gb->c, gb->a); DISPATCH();
+	op_EA: instr_ld_aa_v(gb, IMM16(), gb->a); DISPATCH();
+	op_F0: LD(gb->a, timed_read(gb, 0xFF00 | IMM8())); DISPATCH();
+	op_F2: LD(gb->a, timed_read(gb, 0xFF00 | gb->c)); DISPATCH();
+	op_FA: LD(gb->a, timed_read(gb, IMM16())); DISPATCH();
+
+	op_C1: POP(gb->bc); DISPATCH();
+	op_D1: POP(gb->de); DISPATCH();
+	op_E1: POP(gb->hl); DISPATCH();
+	op_F1: POP(gb->af); gameboy_unpack_flags(gb); DISPATCH();
+
+	op_C2: instr_jp(gb, !ZERO, IMM16()); DISPATCH();
+	op_C3: instr_jp(gb, true, IMM16()); DISPATCH();
+	op_CA: instr_jp(gb, ZERO, IMM16()); DISPATCH();
+	op_D2: instr_jp(gb, !CARRY, IMM16()); DISPATCH();
+	op_DA: instr_jp(gb, CARRY, IMM16()); DISPATCH();
+
+	op_C4: instr_call(gb, !ZERO, IMM16()); DISPATCH();
+	op_CC: instr_call(gb, ZERO, IMM16()); DISPATCH();
+	op_CD: instr_call(gb, true, IMM16()); DISPATCH();
+	op_D4: instr_call(gb, !CARRY, IMM16()); DISPATCH();
+	op_DC: instr_call(gb, CARRY, IMM16()); DISPATCH();
+
+	op_C5: instr_push(gb, gb->bc); DISPATCH();
+	op_D5: instr_push(gb, gb->de); DISPATCH();
+	op_E5: instr_push(gb, gb->hl); DISPATCH();
+	op_F5: gameboy_pack_flags(gb); instr_push(gb, gb->af); DISPATCH();
+
+	op_C7: instr_rst(gb, 0x0000); DISPATCH();
+	op_CF: instr_rst(gb, 0x0008); DISPATCH();
+	op_D7: instr_rst(gb, 0x0010); DISPATCH();
+	op_DF: instr_rst(gb, 0x0018); DISPATCH();
+	op_E7: instr_rst(gb, 0x0020); DISPATCH();
+	op_EF: instr_rst(gb, 0x0028); DISPATCH();
+	op_F7: instr_rst(gb, 0x0030); DISPATCH();
+	op_FF: instr_rst(gb, 0x0038); DISPATCH();
 
 	// These instructions have some odd timing... bus issue?
-	case 0xE8:
+	op_E8:
 		tick(gb);
 		tick(gb);
-		instr_ld_rr_vv_jr(gb, &gb->sp, gb->sp);
-		break;
-	case 0xF8:
+		LD_SP_JR(gb->sp, IMM8());
+		DISPATCH();
+	op_F8:
 		tick(gb);
-		instr_ld_rr_vv_jr(gb, &gb->hl, gb->sp);
-		break;
+		LD_SP_JR(gb->hl, IMM8());
+		DISPATCH();
 
-	case 0xE9:
-		instr_ld_rr_vv(gb, &gb->pc, gb->hl);
-		break;
-	case 0xF9:
+	op_E9:
+		LD(gb->pc, gb->hl);
+		DISPATCH();
+	op_F9:
 		tick(gb);
-		instr_ld_rr_vv(gb, &gb->sp, gb->hl);
-		break;
-
-	case 0xD3: case 0xDB: case 0xDD:
-	case 0xE3: case 0xE4: case 0xEB: case 0xEC: case 0xED:
-	case 0xF4: case 0xFC: case 0xFD:
+		LD(gb->sp, gb->hl);
+		DISPATCH();
+	op_D3: op_DB: op_DD:
+	op_E3: op_E4: op_EB: op_EC: op_ED:
+	op_F4: op_FC: op_FD:
 		instr_undefined(gb, opcode);
-		break;
+		return;
 
-	default:
-		GBLOG("Opcode not yet implemented: %02X", opcode);
-		gb->cpu_status = GAMEBOY_CPU_CRASHED;
-	}
+#undef DISPATCH
+#undef IMM16
+#undef IMM8
+#undef FETCH
 }
 
 static void process_interrupts(struct gameboy *gb)
@@ -1268,7 +1285,23 @@ void irq_flag(struct gameboy *gb, enum gameboy_irq irq)
 	gb->irq_flagged |= (1 << irq);
 }
 
-void gameboy_tick(struct gameboy *gb)
+// Only a peripheral raising an interrupt can wake a halted CPU, and they
+// only do that from sched_sync, so every tick before the one that reaches
+// the next deadline would be a no-op; skip straight to it.
+static void halt_until_event(struct gameboy *gb)
+{
+	long step = gb->double_speed ? 2 : 4;
+
+	if (gb->next_event_in > gb->cycles && gb->next_event_in != LONG_MAX)
+		gb->cycles += (gb->next_event_in - gb->cycles - 1) / step * step;
+
+	tick(gb);
+}
+
+// One step of whatever the CPU is doing: an interrupt dispatch followed by
+// instructions up to till, one HDMA block, or some idle time.  A till that
+// has already passed means a single instruction (or tick while halted).
+static void step(struct gameboy *gb, long till)
 {
 	switch (gb->cpu_status) {
 	case GAMEBOY_CPU_CRASHED:
@@ -1277,14 +1310,18 @@ void gameboy_tick(struct gameboy *gb)
 		break;
 
 	case GAMEBOY_CPU_HALTED:
+		breakpoint_outside_insn(gb);
 		process_interrupts(gb);
 		if (gb->cpu_status == GAMEBOY_CPU_RUNNING)
-			process_opcode(gb, iv(gb));
+			execute(gb, till);
+		else if (gb->cycles < till)
+			halt_until_event(gb);
 		else
 			tick(gb);
 		break;
 
 	case GAMEBOY_CPU_RUNNING:
+		breakpoint_outside_insn(gb);
 		if (gb->hdma_enabled && gb->hdma_blocks_queued) {
 			for (int i = 0; i < 0x10; ++i) {
 				uint8_t tmp = mmu_read(gb, gb->hdma_src++);
@@ -1302,7 +1339,45 @@ void gameboy_tick(struct gameboy *gb)
 			break;
 		}
 		process_interrupts(gb);
-		process_opcode(gb, iv(gb));
+		execute(gb, till);
 		break;
 	}
 }
+
+// Runs exactly one instruction (or HDMA block, or tick while halted), never
+// a whole native block or a skipped stretch of an idle loop
+void gameboy_tick(struct gameboy *gb)
+{
+	gb->run_exits = 0;
+
+	PERF_BEGIN(PERF_CPU);
+	step(gb, gb->cycles);
+	PERF_END();
+}
+
+unsigned int gameboy_run_until(struct gameboy *gb, long cycles)
+{
+	gb->run_exits = 0;
+
+	PERF_BEGIN(PERF_CPU);
+	while (gb->cycles < cycles && !gb->run_exits) {
+		step(gb, cycles);
+		if (gb->cpu_status == GAMEBOY_CPU_CRASHED)
+			gb->run_exits |= GAMEBOY_RUN_CRASHED;
+	}
+	PERF_END();
+
+	return gb->run_exits;
+}
+
+unsigned int gameboy_run_frame(struct gameboy *gb)
+{
+	long till = gb->cycles + GAMEBOY_FRAME_CYCLES;
+	unsigned int exits = 0;
+
+	unsigned int stops = GAMEBOY_RUN_VBLANK | GAMEBOY_RUN_CRASHED | GAMEBOY_RUN_BREAKPOINT;
+	while (gb->cycles < till && !(exits & stops))
+		exits |= gameboy_run_until(gb, till);
+
+	return exits;
+}
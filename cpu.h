@@ -6,4 +6,27 @@
 
 void irq_flag(struct gameboy *gb, enum gameboy_irq irq);
 
+// Whether anything besides plain instruction flow has to be handled before
+// the next instruction (interrupts, EI's delay slot, HDMA, HALT/STOP, ...)
+static inline bool cpu_needs_attention(struct gameboy *gb)
+{
+	if (gb->cpu_status != GAMEBOY_CPU_RUNNING)
+		return true;
+
+	if (gb->run_exits)
+		return true;
+
+	if (gb->hdma_enabled && gb->hdma_blocks_queued)
+		return true;
+
+	switch (gb->ime_status) {
+	case GAMEBOY_IME_PENDING:
+		return true;
+	case GAMEBOY_IME_ENABLED:
+		return gb->irq_enabled & gb->irq_flagged & 0x1F;
+	default:
+		return false;
+	}
+}
+
 #endif
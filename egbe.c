@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #define _GNU_SOURCE
 #include "egbe.h"
+#include "perf.h"
 #include "common.h"
 #include <dlfcn.h>
 #include <glob.h>
@@ -8,11 +9,16 @@
 #include <limits.h>
 #include <SDL2/SDL.h>
 #include <string.h>
+#include <unistd.h>
 
 char PLUGIN_UNSPECIFIED[] = "<Unspecified>";
 
+// Pixels are drawn into buffer and copied to the texture when presented,
+// unless the texture is locked and they are drawn straight into it
 struct texture {
 	int *pixels;
+	int *buffer;
+	bool locked;
 	struct SDL_Texture *texture;
 	struct SDL_Rect rect;
 };
@@ -28,6 +34,11 @@ struct view {
 	struct texture dbg_palettes;
 	struct texture dbg_vram;
 	struct texture dbg_vram_gbc;
+	bool debug;
+
+	// When the next frame is due, in performance counter ticks
+	bool frameskip_auto;
+	Uint64 deadline;
 };
 
 struct audio {
@@ -36,11 +47,12 @@ struct audio {
 
 static int texture_init(struct texture *t, struct SDL_Renderer *r, size_t size)
 {
-	t->pixels = calloc(1, size);
-	if (!t->pixels) {
+	t->buffer = calloc(1, size);
+	if (!t->buffer) {
 		GBLOG("Unable to allocate texture: %m");
 		return errno;
 	}
+	t->pixels = t->buffer;
 
 	t->texture = SDL_CreateTexture(
 		r,
@@ -58,13 +70,41 @@ static int texture_init(struct texture *t, struct SDL_Renderer *r, size_t size)
 	return 0;
 }
 
+// Points pixels at the texture's own memory until it is next presented, if
+// its rows are laid out like ours (otherwise they stay in buffer)
+static void texture_lock(struct texture *t)
+{
+	void *pixels;
+	int pitch;
+
+	t->pixels = t->buffer;
+	if (SDL_LockTexture(t->texture, NULL, &pixels, &pitch)) {
+		GBLOG("Failure in SDL_LockTexture: %s", SDL_GetError());
+		return;
+	}
+
+	if (pitch != (int)sizeof(int) * t->rect.w) {
+		SDL_UnlockTexture(t->texture);
+		return;
+	}
+
+	t->pixels = pixels;
+	t->locked = true;
+}
+
 static void texture_free(struct texture *t)
 {
-	free(t->pixels);
+	if (t->locked)
+		SDL_UnlockTexture(t->texture);
+	t->locked = false;
+
+	free(t->buffer);
+	t->buffer = NULL;
 	t->pixels = NULL;
 
 	if (t->texture)
 		SDL_DestroyTexture(t->texture);
+	t->texture = NULL;
 }
 
 static int view_init(struct view *v)
@@ -97,12 +137,61 @@ static int view_init(struct view *v)
 	struct gameboy *gb;
 
 	return texture_init(&v->screen, v->renderer, sizeof(*gb->screen))
-	    || texture_init(&v->alt_screen, v->renderer, sizeof(*gb->screen))
-	    || texture_init(&v->dbg_background, v->renderer, sizeof(*gb->dbg_background))
-	    || texture_init(&v->dbg_window, v->renderer, sizeof(*gb->dbg_window))
-	    || texture_init(&v->dbg_palettes, v->renderer, sizeof(*gb->dbg_palettes))
-	    || texture_init(&v->dbg_vram, v->renderer, sizeof(*gb->dbg_vram))
-	    || texture_init(&v->dbg_vram_gbc, v->renderer, sizeof(*gb->dbg_vram_gbc));
+	    || texture_init(&v->alt_screen, v->renderer, sizeof(*gb->screen));
+}
+
+static void view_hide_debug(struct view *v, struct gameboy *gb)
+{
+	gb->dbg_background = NULL;
+	gb->dbg_window = NULL;
+	gb->dbg_palettes = NULL;
+	gb->dbg_vram = NULL;
+	gb->dbg_vram_gbc = NULL;
+
+	texture_free(&v->dbg_background);
+	texture_free(&v->dbg_window);
+	texture_free(&v->dbg_palettes);
+	texture_free(&v->dbg_vram);
+	texture_free(&v->dbg_vram_gbc);
+
+	v->debug = false;
+}
+
+// The VRAM, tilemap and palette views are only allocated (and drawn by the
+// core) while shown
+static int view_show_debug(struct view *v, struct gameboy *gb)
+{
+	int rc = texture_init(&v->dbg_background, v->renderer, sizeof(*gb->dbg_background))
+	      || texture_init(&v->dbg_window, v->renderer, sizeof(*gb->dbg_window))
+	      || texture_init(&v->dbg_palettes, v->renderer, sizeof(*gb->dbg_palettes))
+	      || texture_init(&v->dbg_vram, v->renderer, sizeof(*gb->dbg_vram))
+	      || texture_init(&v->dbg_vram_gbc, v->renderer, sizeof(*gb->dbg_vram_gbc));
+	if (rc) {
+		view_hide_debug(v, gb);
+		return rc;
+	}
+
+	gb->dbg_background = (void *)v->dbg_background.pixels;
+	gb->dbg_window = (void *)v->dbg_window.pixels;
+	gb->dbg_palettes = (void *)v->dbg_palettes.pixels;
+	gb->dbg_vram = (void *)v->dbg_vram.pixels;
+	gb->dbg_vram_gbc = (void *)v->dbg_vram_gbc.pixels;
+
+	// Frames skipped since hiding may not have noticed the views were gone
+	gb->dbg_dirty.all = true;
+
+	for (int y = 0; y < 82; ++y) {
+		for (int x = 0; x < 86; ++x) {
+			if ((x + y) % 2)
+				(*gb->dbg_palettes)[y][x] = 0x00CCCCCC;
+			else
+				(*gb->dbg_palettes)[y][x] = 0x00DDDDDD;
+		}
+	}
+
+	v->debug = true;
+
+	return 0;
 }
 
 static void view_free(struct view *v)
@@ -127,15 +216,52 @@ static void view_render_texture(struct view *v, struct texture *t)
 	if (!t->pixels)
 		return;
 
-	SDL_UpdateTexture(t->texture, NULL, t->pixels, sizeof(int) * t->rect.w);
+	if (t->locked)
+		SDL_UnlockTexture(t->texture);
+	else
+		SDL_UpdateTexture(t->texture, NULL, t->pixels, sizeof(int) * t->rect.w);
+	t->locked = false;
 
 	SDL_RenderCopy(v->renderer, t->texture, NULL, &t->rect);
 }
 
+// Skipped frames aren't presented, so they can't wait on vsync; they sleep
+// until they are due instead.  With FRAMESKIP=auto, finishing a frame after
+// it was due skips more frames, and finishing well ahead skips fewer.
+static void pace_frame(struct view *v, struct gameboy *gb)
+{
+	Uint64 frame = SDL_GetPerformanceFrequency() * (GAMEBOY_FRAME_CYCLES / EGBE_CLOCK_HZ);
+	Uint64 now = SDL_GetPerformanceCounter();
+
+	// Start over after a pause (e.g. in the debugger)
+	if (!v->deadline || now > v->deadline + 4 * frame)
+		v->deadline = now;
+	v->deadline += frame;
+
+	if (v->frameskip_auto) {
+		if (now > v->deadline && gb->frameskip < EGBE_FRAMESKIP_MAX)
+			++gb->frameskip;
+		else if (now + frame / 2 < v->deadline && gb->frameskip)
+			--gb->frameskip;
+	}
+
+	if (gb->skip_frame && now < v->deadline)
+		SDL_Delay((v->deadline - now) * 1000 / SDL_GetPerformanceFrequency());
+}
+
 static void on_vblank(struct gameboy *gb, void *context)
+{
+	pace_frame(context, gb);
+}
+
+// Frame sink for the host: presents the finished frame with the rest of the
+// view, then has the next one drawn straight into the screen texture
+static void *present_frame(struct gameboy *gb, void *frame, void *context)
 {
 	struct view *v = context;
 
+	PERF_BEGIN(PERF_VBLANK);
+
 	SDL_RenderClear(v->renderer);
 
 	view_render_texture(v, &v->screen);
@@ -147,6 +273,11 @@ static void on_vblank(struct gameboy *gb, void *context)
 	view_render_texture(v, &v->dbg_vram_gbc);
 
 	SDL_RenderPresent(v->renderer);
+	texture_lock(&v->screen);
+
+	PERF_END();
+
+	return v->screen.pixels;
 }
 
 static int audio_init(struct audio *audio)
@@ -188,6 +319,8 @@ static void queue_audio(struct gameboy *gb, void *context)
 {
 	struct audio *audio = context;
 
+	PERF_BEGIN(PERF_AUDIO);
+
 	int buf[MAX_APU_SAMPLES][2];
 
 	for (size_t i = 0; i < gb->apu_index; ++i) {
@@ -211,6 +344,8 @@ static void queue_audio(struct gameboy *gb, void *context)
 	}
 
 	SDL_QueueAudio(audio->device_id, buf, gb->apu_index * sizeof(int) * 2);
+
+	PERF_END();
 }
 
 static void toggle_channel(struct apu_channel *super, char *name)
@@ -222,8 +357,7 @@ static void toggle_channel(struct apu_channel *super, char *name)
 static void local_solo_tick(struct egbe_gameboy *self)
 {
 	self->till = self->gb->cycles + EGBE_EVENT_CYCLES;
-	while (self->gb->cycles < self->till)
-		gameboy_tick(self->gb);
+	egbe_gameboy_run(self);
 }
 
 static void local_serial_interrupt(struct gameboy *gb, void *context)
@@ -240,12 +374,10 @@ static void local_serial_tick(struct egbe_gameboy *host)
 
 	// Note that host->till could be set early from local_serial_interrupt
 	host->till = host->gb->cycles + EGBE_EVENT_CYCLES;
-	while (host->gb->cycles < host->till)
-		gameboy_tick(host->gb);
+	egbe_gameboy_run(host);
 
 	guest->till = host->till;
-	while (guest->gb->cycles < guest->till)
-		gameboy_tick(guest->gb);
+	egbe_gameboy_run(guest);
 
 	if (host->xfer_pending) {
 		gameboy_start_serial(host->gb, guest->gb->sb);
@@ -254,6 +386,46 @@ static void local_serial_tick(struct egbe_gameboy *host)
 	}
 }
 
+// Runs up to self->till (which callbacks may pull in), stopping for the
+// debugger at breakpoints along the way
+void egbe_gameboy_run(struct egbe_gameboy *self)
+{
+	while (self->gb->cycles < self->till)
+		if (gameboy_run_until(self->gb, self->till) & GAMEBOY_RUN_BREAKPOINT)
+			egbe_gameboy_debug(self);
+}
+
+void egbe_gameboy_debug(struct egbe_gameboy *self)
+{
+	struct gameboy_breakpoint_hit hit;
+	if ((self->gb->run_exits & GAMEBOY_RUN_BREAKPOINT) &&
+	    gameboy_last_breakpoint(self->gb, &hit)) {
+		if (hit.type == GAMEBOY_BREAK_EXEC)
+			GBLOG("Breakpoint at %04X", hit.pc);
+		else if (hit.outside_insn)
+			GBLOG("Watchpoint: %s %02X at %04X by interrupt dispatch or HDMA (PC %04X)",
+			      hit.type == GAMEBOY_BREAK_READ ? "read" : "wrote",
+			      hit.val, hit.addr, hit.pc);
+		else
+			GBLOG("Watchpoint: %s %02X at %04X by %04X",
+			      hit.type == GAMEBOY_BREAK_READ ? "read" : "wrote",
+			      hit.val, hit.addr, hit.pc);
+	}
+
+	if (!self->start_debugger) {
+		GBLOG("No debugger configured");
+		return;
+	}
+
+	gameboy_pack_flags(self->gb);
+	self->start_debugger(self);
+
+	// The debugger may have poked at flags, code, or deadlines
+	gameboy_unpack_flags(self->gb);
+	gameboy_flush_blocks(self->gb);
+	gameboy_reschedule(self->gb);
+}
+
 void egbe_gameboy_init(struct egbe_gameboy *self, char *cart_path, char *boot_path)
 {
 	self->link_status = EGBE_LINK_DISCONNECTED;
@@ -281,16 +453,55 @@ void egbe_gameboy_init(struct egbe_gameboy *self, char *cart_path, char *boot_pa
 
 	if (self->boot_path)
 		gameboy_insert_boot_rom(self->gb, self->boot_path);
-	if (self->cart_path)
-		gameboy_insert_cartridge(self->gb, self->cart_path);
+	if (self->cart_path && !gameboy_insert_cartridge(self->gb, self->cart_path))
+		gameboy_inspect_cartridge(self->gb);
 	if (self->sram_path)
 		gameboy_load_sram(self->gb, self->sram_path);
 
+	char idle_path[PATH_MAX];
+	if (self->cart_path &&
+	    snprintf(idle_path, sizeof(idle_path), "%s.idle", self->cart_path) < (int)sizeof(idle_path) &&
+	    access(idle_path, R_OK) == 0)
+		gameboy_load_idle_loops(self->gb, idle_path);
+
+	char *cpu = getenv("CPU");
+	if (cpu && strcmp(cpu, "jit") == 0)
+		gameboy_enable_jit(self->gb);
+
+	char *profile = getenv("PROFILE");
+	if (profile && strcmp(profile, "1") == 0 && self->cart_path)
+		gameboy_enable_profile(self->gb);
+
+	// TRACE=1 keeps the most recent instructions for saving on exit;
+	// TRACE=stream writes every instruction out as it goes
+	char *trace = getenv("TRACE");
+	char trace_path[PATH_MAX];
+	if (trace && self->cart_path &&
+	    snprintf(trace_path, sizeof(trace_path), "%s.trace", self->cart_path) < (int)sizeof(trace_path)) {
+		if (strcmp(trace, "1") == 0)
+			gameboy_enable_trace(self->gb, 0, NULL);
+		else if (strcmp(trace, "stream") == 0)
+			gameboy_enable_trace(self->gb, 0, trace_path);
+	}
+
 	gameboy_restart(self->gb);
 }
 
 void egbe_gameboy_cleanup(struct egbe_gameboy *self)
 {
+	char profile_path[PATH_MAX];
+	if (self->gb && self->gb->profile) {
+		gameboy_report_profile(self->gb, 20);
+		if (snprintf(profile_path, sizeof(profile_path), "%s.profile", self->cart_path) < (int)sizeof(profile_path))
+			gameboy_save_profile(self->gb, profile_path);
+	}
+
+	char trace_path[PATH_MAX];
+	char *trace = getenv("TRACE");
+	if (self->gb && self->gb->trace && trace && strcmp(trace, "1") == 0 &&
+	    snprintf(trace_path, sizeof(trace_path), "%s.trace", self->cart_path) < (int)sizeof(trace_path))
+		gameboy_save_trace(self->gb, trace_path);
+
 	if (self->gb)
 		gameboy_free(self->gb);
 
@@ -346,8 +557,11 @@ static void egbe_main(struct egbe_application *app)
 	struct egbe_gameboy host = {
 		.gb = gameboy_alloc(system),
 		.tick = local_solo_tick,
+		.start_debugger = app->start_debugger,
+	};
+	struct egbe_gameboy guest = {
+		.start_debugger = app->start_debugger,
 	};
-	struct egbe_gameboy guest = { 0 };
 	struct egbe_gameboy *focus = &host;
 
 	if (!host.gb)
@@ -430,21 +644,20 @@ static void egbe_main(struct egbe_application *app)
 		host.gb->on_vblank.callback = on_vblank;
 		host.gb->on_vblank.context = &view;
 
+		host.gb->frame_sink.next = present_frame;
+		host.gb->frame_sink.context = &view;
+
+		texture_lock(&view.screen);
 		host.gb->screen = (void *)view.screen.pixels;
-		host.gb->dbg_background = (void *)view.dbg_background.pixels;
-		host.gb->dbg_window = (void *)view.dbg_window.pixels;
-		host.gb->dbg_palettes = (void *)view.dbg_palettes.pixels;
-		host.gb->dbg_vram = (void *)view.dbg_vram.pixels;
-		host.gb->dbg_vram_gbc = (void *)view.dbg_vram_gbc.pixels;
-
-		for (int y = 0; y < 82; ++y) {
-			for (int x = 0; x < 86; ++x) {
-				if ((x + y) % 2)
-					(*host.gb->dbg_palettes)[y][x] = 0x00CCCCCC;
-				else
-					(*host.gb->dbg_palettes)[y][x] = 0x00DDDDDD;
-			}
-		}
+
+		if (getenv("VIEWS") && view_show_debug(&view, host.gb))
+			GBLOG("Failed to show debug views");
+
+		char *frameskip = getenv("FRAMESKIP");
+		if (frameskip && strcmp(frameskip, "auto") == 0)
+			view.frameskip_auto = true;
+		else if (frameskip)
+			host.gb->frameskip = strtoul(frameskip, NULL, 10);
 
 		if (guest.gb)
 			guest.gb->screen = (void *)view.alt_screen.pixels;
@@ -541,10 +754,16 @@ static void egbe_main(struct egbe_application *app)
 					break;
 
 				case SDLK_g:
-					if (app->start_debugger)
-						app->start_debugger(focus);
-					else
-						GBLOG("No debugger configured");
+					egbe_gameboy_debug(focus);
+					break;
+
+				case SDLK_v:
+					if (!view.renderer)
+						break;
+					if (view.debug)
+						view_hide_debug(&view, host.gb);
+					else if (view_show_debug(&view, host.gb))
+						GBLOG("Failed to show debug views");
 					break;
 				}
 				break;
@@ -573,6 +792,8 @@ static void egbe_main(struct egbe_application *app)
 	if (guest.gb && guest.gb->sram && strcmp(host.sram_path, guest.sram_path) != 0)
 		gameboy_save_sram(guest.gb, guest.sram_path);
 
+	PERF_REPORT();
+
 	egbe_gameboy_cleanup(&host);
 	egbe_gameboy_cleanup(&guest);
 
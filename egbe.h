@@ -8,6 +8,11 @@
 // Also works well with games that sync every other VBlank (~140448)
 #define EGBE_EVENT_CYCLES 150000
 
+#define EGBE_CLOCK_HZ 4194304.0
+
+// Most frames in a row FRAMESKIP=auto leaves undrawn when falling behind
+#define EGBE_FRAMESKIP_MAX 4
+
 // TODO: Make this dynamic
 #define EGBE_MAX_PLUGINS 32
 
@@ -97,6 +102,9 @@ struct egbe_gameboy {
 
 	void (*tick)(struct egbe_gameboy *self);
 
+	// Entered on G and whenever a breakpoint or watchpoint stops emulation
+	EGBE_PLUGIN_START_DEBUGGER start_debugger;
+
 	int link_status;
 	void *link_context;
 	void (*link_cleanup)(struct egbe_gameboy *self);
@@ -106,6 +114,9 @@ struct egbe_gameboy {
 void egbe_gameboy_init(struct egbe_gameboy *self, char *cart_path, char *boot_path);
 void egbe_gameboy_cleanup(struct egbe_gameboy *self);
 
+void egbe_gameboy_run(struct egbe_gameboy *self);
+void egbe_gameboy_debug(struct egbe_gameboy *self);
+
 void egbe_gameboy_set_savestate_num(struct egbe_gameboy *self, char n);
 
 #endif
@@ -1,5 +1,7 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #include "lcd.h"
+#include "mmu.h"
+#include "profile.h"
 #include "common.h"
 #include <string.h>
 
@@ -170,7 +172,9 @@ static int prepare_cartridge(struct gameboy *gb, FILE *in)
 	return 0;
 }
 
-static void inspect_cartridge(struct gameboy *gb)
+// Prints the cartridge header; insertion itself stays quiet so headless
+// runs (EX: egbe-batch workers) don't interleave it on stdout
+void gameboy_inspect_cartridge(struct gameboy *gb)
 {
 	#define line(key, fmt, ...) printf("%-19s" fmt "\n", key ": ", ##__VA_ARGS__)
 	uint8_t *rom = gb->rom[0];
@@ -309,8 +313,8 @@ int gameboy_insert_cartridge(struct gameboy *gb, char *path)
 	int rc = prepare_cartridge(gb, in);
 	if (rc)
 		gameboy_remove_cartridge(gb);
-	else
-		inspect_cartridge(gb);
+	mmu_remap(gb);
+	gameboy_flush_blocks(gb);
 
 	fclose(in);
 
@@ -322,12 +326,68 @@ void gameboy_remove_boot_rom(struct gameboy *gb)
 	free(gb->boot);
 	gb->boot = NULL;
 	gb->boot_size = 0;
+	mmu_remap(gb);
+}
+
+// Inserts the cartridge already in owner without loading another copy of its
+// ROM; SRAM and idle loops are copied, so gb can be driven independently but
+// must be removed before owner is
+int gameboy_share_cartridge(struct gameboy *gb, struct gameboy *owner)
+{
+	gameboy_remove_cartridge(gb);
+
+	if (!owner->rom) {
+		GBLOG("No cartridge to share");
+		return EINVAL;
+	}
+
+	if (owner->sram_size) {
+		gb->sram = malloc(owner->sram_size);
+		if (!gb->sram) {
+			GBLOG("Failed to allocate SRAM: %m");
+			return ENOMEM;
+		}
+		memcpy(gb->sram, owner->sram, owner->sram_size);
+	}
+
+	if (owner->idle_loop_count) {
+		gb->idle_loops = malloc(owner->idle_loop_count * sizeof(*gb->idle_loops));
+		if (!gb->idle_loops) {
+			GBLOG("Failed to allocate idle loops: %m");
+			gameboy_remove_cartridge(gb);
+			return ENOMEM;
+		}
+		memcpy(gb->idle_loops, owner->idle_loops,
+		       owner->idle_loop_count * sizeof(*gb->idle_loops));
+		gb->idle_loop_count = owner->idle_loop_count;
+	}
+
+	gb->rom = owner->rom;
+	gb->rom_shared = true;
+	gb->rom_bank = 1;
+	gb->rom_banks = owner->rom_banks;
+	gb->rom_size = owner->rom_size;
+	gb->romx = gb->rom[gb->rom_bank];
+	gb->mbc = owner->mbc;
+	gb->features = owner->features;
+
+	gb->sram_bank = 0;
+	gb->sram_banks = owner->sram_banks;
+	gb->sram_size = owner->sram_size;
+	gb->sramx = gb->sram ? gb->sram[gb->sram_bank] : NULL;
+
+	mmu_remap(gb);
+	gameboy_flush_blocks(gb);
+
+	return 0;
 }
 
 void gameboy_remove_cartridge(struct gameboy *gb)
 {
-	free(gb->rom);
+	if (!gb->rom_shared)
+		free(gb->rom);
 	gb->rom = NULL;
+	gb->rom_shared = false;
 	gb->romx = NULL;
 	gb->rom_bank = 0;
 	gb->rom_banks = 0;
@@ -339,6 +399,83 @@ void gameboy_remove_cartridge(struct gameboy *gb)
 	gb->sram_bank = 0;
 	gb->sram_banks = 0;
 	gb->sram_size = 0;
+	mmu_remap(gb);
+
+	free(gb->idle_loops);
+	gb->idle_loops = NULL;
+	gb->idle_loop_count = 0;
+
+	// Profile slots are laid out per ROM bank
+	profile_free(gb);
+}
+
+// One loop per line, as a hex address optionally preceded by a bank
+// ("BB:AAAA"); anything after a '#' is a comment
+static int fread_idle_loops(struct gameboy *gb, FILE *in)
+{
+	struct gameboy_idle_loop *loops = NULL;
+	size_t count = 0;
+	char line[256];
+	int number = 0;
+
+	while (fgets(line, sizeof(line), in)) {
+		++number;
+		line[strcspn(line, "#\r\n")] = '\0';
+
+		unsigned long bank, addr;
+		char extra;
+		struct gameboy_idle_loop loop;
+		if (sscanf(line, "%lx:%lx %c", &bank, &addr, &extra) == 2) {
+			loop.bank = bank;
+		} else if (sscanf(line, "%lx %c", &addr, &extra) == 1) {
+			loop.bank = -1;
+		} else if (sscanf(line, " %c", &extra) < 1) {
+			continue;
+		} else {
+			GBLOG("Bad idle loop on line %d", number);
+			free(loops);
+			return EINVAL;
+		}
+
+		if (addr > 0x7FFF) {
+			GBLOG("Idle loop on line %d isn't in ROM", number);
+			free(loops);
+			return EINVAL;
+		}
+		loop.addr = addr;
+
+		struct gameboy_idle_loop *grown = realloc(loops, (count + 1) * sizeof(*loops));
+		if (!grown) {
+			GBLOG("Failed to allocate idle loops: %m");
+			free(loops);
+			return ENOMEM;
+		}
+		loops = grown;
+		loops[count++] = loop;
+	}
+
+	free(gb->idle_loops);
+	gb->idle_loops = loops;
+	gb->idle_loop_count = count;
+
+	return 0;
+}
+
+int gameboy_load_idle_loops(struct gameboy *gb, char *path)
+{
+	FILE *in = fopen(path, "r");
+	if (!in) {
+		GBLOG("Failed to open idle loop file: %m");
+		return errno;
+	}
+
+	int rc = fread_idle_loops(gb, in);
+	if (!rc)
+		gameboy_flush_blocks(gb);
+
+	fclose(in);
+
+	return rc;
 }
 
 static int fread_sram(struct gameboy *gb, FILE *in)
@@ -440,11 +577,14 @@ static int fread_state(struct gameboy *gb, FILE *in)
 	state.gb.on_apu_buffer_filled = gb->on_apu_buffer_filled;
 	state.gb.on_serial_start = gb->on_serial_start;
 	state.gb.on_vblank = gb->on_vblank;
+	state.gb.frame_sink = gb->frame_sink;
+	state.gb.frameskip = gb->frameskip;
 
 	memset(&state.gb.apu_samples, 0, sizeof(state.gb.apu_samples));
 	state.gb.apu_index = 0;
 
 	state.gb.screen = gb->screen;
+	state.gb.screen_indexed = gb->screen_indexed;
 	state.gb.dbg_background = gb->dbg_background;
 	state.gb.dbg_window = gb->dbg_window;
 	state.gb.dbg_palettes = gb->dbg_palettes;
@@ -453,19 +593,28 @@ static int fread_state(struct gameboy *gb, FILE *in)
 
 	state.gb.boot = gb->boot;
 	state.gb.rom = gb->rom;
+	state.gb.rom_shared = gb->rom_shared;
 	state.gb.sram = gb->sram;
 	state.gb.wram = gb->wram;
+	state.gb.blocks = gb->blocks;
+	state.gb.jit = gb->jit;
+	state.gb.profile = gb->profile;
+	state.gb.trace = gb->trace;
+	state.gb.breakpoints = gb->breakpoints;
+	state.gb.idle_loops = gb->idle_loops;
+	state.gb.idle_loop_count = gb->idle_loop_count;
 
 	memcpy(gb, &state.gb, sizeof(state.gb));
+	gameboy_unpack_flags(gb);
 
 	gb->romx = gb->rom[gb->rom_bank];
 	gb->sramx = gb->sram[gb->sram_bank];
 	gb->wramx = gb->wram[gb->wram_bank];
+	mmu_init(gb);
+	gameboy_flush_blocks(gb);
 
-	for (int i = 0; i < 40; ++i)
-		gb->sprites_sorted[i] = &gb->sprites[i];
-	gb->sprites_unsorted = true;
-
+	gb->sprites_dirty = true;
+	gb->dbg_dirty.all = true;
 	for (int i = 0; i < 40; ++i)
 		lcd_refresh_sprite(gb, &gb->sprites[i]);
 
@@ -509,6 +658,7 @@ static int fwrite_state(struct gameboy *gb, FILE *out)
 	};
 	memcpy(&state.title_check, &gb->rom[0][GAMEBOY_ADDR_GAME_TITLE], 16);
 
+	gameboy_pack_flags(gb);
 	memcpy(&state.gb, gb, sizeof(*gb));
 
 	fwrite(&state, sizeof(state), 1, out);
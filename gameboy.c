@@ -1,14 +1,23 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #include "apu.h"
+#include "block.h"
+#include "breakpoint.h"
 #include "cpu.h"
+#include "jit.h"
 #include "lcd.h"
 #include "mmu.h"
+#include "profile.h"
+#include "trace.h"
 #include "common.h"
 
+// Front ends may change their plans in a callback (e.g. stop at a serial
+// transfer), so gameboy_run_until hands control back after one
 void gb_callback(struct gameboy *gb, struct gameboy_callback *cb)
 {
-	if (cb->callback)
+	if (cb->callback) {
 		cb->callback(gb, cb->context);
+		gb->run_exits |= GAMEBOY_RUN_CALLBACK;
+	}
 }
 
 struct gameboy *gameboy_alloc(enum gameboy_system system)
@@ -38,12 +47,21 @@ struct gameboy *gameboy_alloc(enum gameboy_system system)
 	}
 	gb->wram_bank = 1;
 	gb->wramx = gb->wram[gb->wram_bank];
+	mmu_init(gb);
+
+	gb->blocks = calloc(1, sizeof(*gb->blocks));
+	if (!gb->blocks) {
+		GBLOG("Failed to allocate block cache: %m");
+		gameboy_free(gb);
+		return NULL;
+	}
 
 	gb->cpu_status = GAMEBOY_CPU_CRASHED;
 	gb->cycles = 0;
 
 	apu_init(gb);
 	lcd_init(gb);
+	gameboy_reschedule(gb);
 
 	return gb;
 }
@@ -53,6 +71,11 @@ void gameboy_free(struct gameboy *gb)
 	gameboy_remove_boot_rom(gb);
 	gameboy_remove_cartridge(gb);
 
+	jit_free(gb);
+	profile_free(gb);
+	trace_free(gb);
+	breakpoint_free(gb);
+	free(gb->blocks);
 	free(gb->wram);
 	free(gb);
 }
@@ -76,6 +99,7 @@ void gameboy_restart(struct gameboy *gb)
 		gb->de = 0x00D8;
 		gb->hl = 0x014D;
 	}
+	gameboy_unpack_flags(gb);
 
 	gb->cpu_status = GAMEBOY_CPU_RUNNING;
 	gb->cycles = 0;
@@ -85,9 +109,12 @@ void gameboy_restart(struct gameboy *gb)
 
 	gb->rtc_latch = ~0; // Just to avoid the important 0x0001
 
+	mmu_remap(gb);
 	gameboy_update_joypad(gb, NULL);
 
 	lcd_init(gb);
+	gameboy_flush_blocks(gb);
+	gameboy_reschedule(gb);
 }
 
 // Note: Bits of P1 are _unset_ when the corresponding button is pressed
@@ -9,10 +9,17 @@
 // TODO: Temporary; 800 samples at 48000Hz roughly matches the 60 FPS LCD
 #define MAX_APU_SAMPLES 800
 
+#define GAMEBOY_FRAME_CYCLES 70224
+
 struct gameboy;
 struct gameboy_audio_sample;
+struct gameboy_block_cache;
 struct gameboy_callback;
+struct gameboy_jit;
 struct gameboy_palette;
+struct gameboy_profile;
+struct gameboy_trace;
+struct gameboy_breakpoints;
 struct gameboy_tile;
 
 enum gameboy_addr {
@@ -103,6 +110,15 @@ enum gameboy_cpu_status {
 	GAMEBOY_CPU_STOPPED,
 };
 
+// Peripheral events, synced in this order when several fall due together
+enum gameboy_event {
+	GAMEBOY_EVENT_APU,
+	GAMEBOY_EVENT_LCD,
+	GAMEBOY_EVENT_SERIAL,
+	GAMEBOY_EVENT_TIMER,
+	GAMEBOY_EVENT_MAX,
+};
+
 enum gameboy_features {
 	GAMEBOY_FEATURE_SRAM          = (1 << 0),
 	GAMEBOY_FEATURE_BATTERY       = (1 << 1),
@@ -163,6 +179,41 @@ enum gameboy_rtc_status {
 	GAMEBOY_RTC_FLAGS    = 5, // ... 0x0C
 };
 
+// Why gameboy_run_until stopped short of its budget
+enum gameboy_run_exit {
+	GAMEBOY_RUN_VBLANK     = (1 << 0),
+	GAMEBOY_RUN_CALLBACK   = (1 << 1),
+	GAMEBOY_RUN_CRASHED    = (1 << 2),
+	GAMEBOY_RUN_BREAKPOINT = (1 << 3),
+};
+
+enum gameboy_breakpoint_type {
+	GAMEBOY_BREAK_EXEC  = (1 << 0),
+	GAMEBOY_BREAK_READ  = (1 << 1),
+	GAMEBOY_BREAK_WRITE = (1 << 2),
+};
+
+// Palettes as numbered in indexed frames (see screen_indexed), where each
+// pixel is a palette number shifted left by two and or'd with a color code
+enum gameboy_screen_palette {
+	GAMEBOY_SCREEN_BGP      = 0,  // BGP 0-7
+	GAMEBOY_SCREEN_OBP      = 8,  // OBP 0-7
+	GAMEBOY_SCREEN_BLANK    = 16, // Lines with the background disabled
+	GAMEBOY_SCREEN_PALETTES = 17,
+};
+
+// Execution breakpoints stop before the instruction at addr runs (and let it
+// run on resume); watchpoints stop after the instruction that accessed addr.
+// Accesses made by interrupt dispatch or HDMA belong to no instruction, and
+// their pc is where the CPU was at the time.
+struct gameboy_breakpoint_hit {
+	enum gameboy_breakpoint_type type;
+	uint16_t addr;
+	uint16_t pc;
+	uint8_t val;
+	bool outside_insn;
+};
+
 enum gameboy_system {
 	GAMEBOY_SYSTEM_DMG,
 	GAMEBOY_SYSTEM_GBP,
@@ -257,6 +308,21 @@ struct gameboy_callback {
 	void *context;
 };
 
+// Takes each finished frame at VBlank and returns the buffer to draw the next
+// one into (or NULL to stop drawing), so front ends can render straight into
+// memory they present from
+struct gameboy_frame_sink {
+	void *(*next)(struct gameboy *gb, void *frame, void *context);
+	void *context;
+};
+
+// A known busy-wait loop; bank is the ROM bank for 4000-7FFF, or -1 to match
+// whatever is mapped
+struct gameboy_idle_loop {
+	long bank;
+	uint16_t addr;
+};
+
 struct gameboy_joypad {
 	bool right;
 	bool left;
@@ -290,8 +356,11 @@ struct gameboy_sprite {
 	bool priority;
 };
 
+// Each row packs eight 2-bit color codes with the leftmost pixel in the top
+// bits, decoded both as stored and mirrored so X-flipped sprites and cells
+// read the same way
 struct gameboy_tile {
-	uint8_t pixels[8][8]; // 8x8 2-bit color codes
+	uint16_t rows[2][8]; // [flipx][y]
 	uint8_t raw[16];
 };
 
@@ -308,6 +377,24 @@ struct gameboy_background_cell {
 	bool priority;
 };
 
+// What changed since the debug views were last drawn, so render_debug only
+// redraws that; views are redrawn in full when first attached and after all
+// is set
+struct gameboy_debug_dirty {
+	bool all;
+	bool palettes;
+	bool tiles[2 * 384];
+	bool cells[2][1024];
+
+	uint8_t background_tilemap;
+	uint8_t window_tilemap;
+	const void *background;
+	const void *window;
+	const void *palettes_view;
+	const void *vram;
+	const void *vram_gbc;
+};
+
 struct gameboy_background_table {
 	union {
 		struct gameboy_background_cell cells[32][32];
@@ -324,6 +411,10 @@ struct gameboy {
 	enum gameboy_cpu_status cpu_status;
 	long cycles;
 	long div_offset;
+	unsigned int run_exits; // enum gameboy_run_exit
+
+	long next_event_in;
+	long event_deadlines[GAMEBOY_EVENT_MAX];
 
 	bool double_speed;
 	bool double_speed_switch;
@@ -405,16 +496,37 @@ struct gameboy {
 	bool obp_increment;
 
 	struct gameboy_callback on_vblank;
+	struct gameboy_frame_sink frame_sink;
+
+	// Frames left undrawn between drawn ones (LCD timing is unaffected);
+	// skip_frame says whether the frame in progress is one of them, and may
+	// be checked from on_vblank to skip presenting it
+	unsigned int frameskip;
+	unsigned int frames_skipped;
+	bool skip_frame;
+
 	int (*screen)[144][160];
+
+	// Optional 8-bit output alongside (or instead of) screen, converted to
+	// colors with the palettes as of the end of the frame; see
+	// gameboy_convert_frame
+	uint8_t (*screen_indexed)[144][160];
+	int screen_palettes[GAMEBOY_SCREEN_PALETTES][4];
 	int (*dbg_background)[256][256];
 	int (*dbg_window)[256][256];
 	int (*dbg_palettes)[82][86];
 	int (*dbg_vram)[192][128];
 	int (*dbg_vram_gbc)[192][128];
+	struct gameboy_debug_dirty dbg_dirty;
 
 	struct gameboy_sprite sprites[40];
-	struct gameboy_sprite *sprites_sorted[40];
-	bool sprites_unsorted;
+
+	// Indices into sprites of the (at most 10) sprites on each line, in
+	// drawing priority order; rebuilt from OAM before the next line is
+	// drawn whenever a sprite moves or changes size
+	uint8_t line_sprites[144][10];
+	uint8_t line_sprite_counts[144];
+	bool sprites_dirty;
 
 	struct gameboy_tile tiles[2][384];
 	struct gameboy_background_table tilemaps[2];
@@ -432,6 +544,7 @@ struct gameboy {
 	size_t rom_bank;
 	size_t rom_banks;
 	size_t rom_size;
+	bool rom_shared; // Borrowed from another instance; see gameboy_share_cartridge
 
 	bool sram_enabled;
 	uint8_t (*sram)[0x2000];
@@ -448,6 +561,25 @@ struct gameboy {
 
 	uint8_t hram[0x007F];
 
+	// Host memory behind each 256-byte page of the address space, or NULL
+	// where accesses need the handlers in mmu.c; rebuilt by mmu_remap
+	// whenever banks or mappings change
+	const uint8_t *read_pages[0x100];
+	uint8_t *write_pages[0x100];
+
+	// Per-register handlers for FF00-FFFF (HRAM included), picked for DMG
+	// or GBC by mmu_init
+	uint8_t (*io_reads[0x100])(struct gameboy *gb, uint16_t addr);
+	void (*io_writes[0x100])(struct gameboy *gb, uint16_t addr, uint8_t val);
+
+	struct gameboy_block_cache *blocks;
+	struct gameboy_jit *jit;
+	struct gameboy_profile *profile;
+	struct gameboy_trace *trace;
+	struct gameboy_breakpoints *breakpoints;
+	struct gameboy_idle_loop *idle_loops;
+	size_t idle_loop_count;
+
 	bool mbc1_sram_mode;
 
 	enum gameboy_rtc_status rtc_status;
@@ -499,19 +631,65 @@ struct gameboy {
 		};
 		uint16_t hl;
 	};
+
+	// The CPU evaluates flags lazily from the last operation that set
+	// them; F (and the bitfields above) only reflect these after a call to
+	// gameboy_pack_flags, and writes to F only take effect after a call to
+	// gameboy_unpack_flags.
+	uint8_t flag_z; // Z is set iff this is 0
+	bool flag_n;
+	uint16_t flag_h; // H is bit 4
+	uint16_t flag_c; // C is bit 8
 };
 
 struct gameboy *gameboy_alloc(enum gameboy_system system);
 void gameboy_free(struct gameboy *gb);
 
+// A batch of instances of one cartridge, run a frame each in turn (e.g. many
+// copies of a game fed different inputs).  The first instance owns the ROM
+// image and the rest borrow it, so only that is loaded once; everything else
+// (RAM, block cache, JIT code) is per instance, and each executes on its own.
+struct gameboy_batch {
+	struct gameboy **gbs;
+	unsigned int *exits; // Per instance, from the last run
+	size_t count;
+};
+
+struct gameboy_batch *gameboy_batch_alloc(enum gameboy_system system, size_t count);
+void gameboy_batch_free(struct gameboy_batch *batch);
+int gameboy_batch_insert_cartridge(struct gameboy_batch *batch, char *path);
+void gameboy_batch_restart(struct gameboy_batch *batch);
+unsigned int gameboy_batch_run_frame(struct gameboy_batch *batch);
+
 void gameboy_restart(struct gameboy *gb);
+void gameboy_reschedule(struct gameboy *gb);
+void gameboy_pack_flags(struct gameboy *gb);
+void gameboy_unpack_flags(struct gameboy *gb);
+void gameboy_flush_blocks(struct gameboy *gb);
+int gameboy_enable_jit(struct gameboy *gb);
+int gameboy_enable_profile(struct gameboy *gb);
+void gameboy_reset_profile(struct gameboy *gb);
+void gameboy_report_profile(struct gameboy *gb, int limit);
+int gameboy_save_profile(struct gameboy *gb, char *path);
+int gameboy_enable_trace(struct gameboy *gb, size_t entries, char *path);
+int gameboy_save_trace(struct gameboy *gb, char *path);
+int gameboy_set_breakpoint(struct gameboy *gb, uint16_t addr, unsigned int types);
+void gameboy_clear_breakpoint(struct gameboy *gb, uint16_t addr, unsigned int types);
+void gameboy_clear_breakpoints(struct gameboy *gb);
+bool gameboy_last_breakpoint(struct gameboy *gb, struct gameboy_breakpoint_hit *hit);
 void gameboy_tick(struct gameboy *gb);
+unsigned int gameboy_run_until(struct gameboy *gb, long cycles);
+unsigned int gameboy_run_frame(struct gameboy *gb);
 
 int gameboy_insert_boot_rom(struct gameboy *gb, char *path);
 void gameboy_remove_boot_rom(struct gameboy *gb);
 int gameboy_insert_cartridge(struct gameboy *gb, char *path);
+void gameboy_inspect_cartridge(struct gameboy *gb);
+int gameboy_share_cartridge(struct gameboy *gb, struct gameboy *owner);
 void gameboy_remove_cartridge(struct gameboy *gb);
 
+int gameboy_load_idle_loops(struct gameboy *gb, char *path);
+
 int gameboy_load_sram(struct gameboy *gb, char *path);
 int gameboy_save_sram(struct gameboy *gb, char *path);
 
@@ -520,6 +698,9 @@ int gameboy_save_state(struct gameboy *gb, char *path);
 
 void gameboy_update_joypad(struct gameboy *gb, struct gameboy_joypad *jp);
 
+void gameboy_convert_frame(const uint8_t (*frame)[144][160], const int (*palettes)[4],
+                           int (*out)[144][160]);
+
 void gameboy_start_serial(struct gameboy *gb, uint8_t xfer);
 
 #endif
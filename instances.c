@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "common.h"
+
+struct gameboy_batch *gameboy_batch_alloc(enum gameboy_system system, size_t count)
+{
+	if (!count) {
+		GBLOG("A batch needs at least one instance");
+		return NULL;
+	}
+
+	struct gameboy_batch *batch = calloc(1, sizeof(*batch));
+	if (!batch) {
+		GBLOG("Failed to allocate batch: %m");
+		return NULL;
+	}
+
+	batch->gbs = calloc(count, sizeof(*batch->gbs));
+	batch->exits = calloc(count, sizeof(*batch->exits));
+	if (!batch->gbs || !batch->exits) {
+		GBLOG("Failed to allocate batch instances: %m");
+		gameboy_batch_free(batch);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		batch->gbs[i] = gameboy_alloc(system);
+		if (!batch->gbs[i]) {
+			gameboy_batch_free(batch);
+			return NULL;
+		}
+		batch->count = i + 1;
+	}
+
+	return batch;
+}
+
+void gameboy_batch_free(struct gameboy_batch *batch)
+{
+	if (!batch)
+		return;
+
+	// Borrowers go before the owner of the ROM
+	for (size_t i = batch->count; i-- > 0;)
+		gameboy_free(batch->gbs[i]);
+
+	free(batch->gbs);
+	free(batch->exits);
+	free(batch);
+}
+
+int gameboy_batch_insert_cartridge(struct gameboy_batch *batch, char *path)
+{
+	for (size_t i = batch->count; i-- > 1;)
+		gameboy_remove_cartridge(batch->gbs[i]);
+
+	int rc = gameboy_insert_cartridge(batch->gbs[0], path);
+	for (size_t i = 1; i < batch->count && !rc; ++i)
+		rc = gameboy_share_cartridge(batch->gbs[i], batch->gbs[0]);
+
+	return rc;
+}
+
+void gameboy_batch_restart(struct gameboy_batch *batch)
+{
+	for (size_t i = 0; i < batch->count; ++i) {
+		gameboy_restart(batch->gbs[i]);
+		batch->exits[i] = 0;
+	}
+}
+
+// Runs each instance for a frame in turn, so a frame's worth of guest code
+// from the shared ROM stays hot across the batch; returns the exits of all
+// instances combined (see exits for which)
+unsigned int gameboy_batch_run_frame(struct gameboy_batch *batch)
+{
+	unsigned int exits = 0;
+
+	for (size_t i = 0; i < batch->count; ++i) {
+		struct gameboy *gb = batch->gbs[i];
+
+		if (gb->cpu_status == GAMEBOY_CPU_CRASHED)
+			batch->exits[i] = GAMEBOY_RUN_CRASHED;
+		else
+			batch->exits[i] = gameboy_run_frame(gb);
+		exits |= batch->exits[i];
+	}
+
+	return exits;
+}
@@ -0,0 +1,1341 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+#include "block.h"
+#include "cpu.h"
+#include "jit.h"
+#include "mmu.h"
+#include "common.h"
+#include <string.h>
+#include <sys/mman.h>
+
+// Hot ROM blocks are translated to x86-64.  Translated code keeps A, BC, DE,
+// HL and SP in callee-saved host registers and the (lazy) flags in their
+// usual fields of struct gameboy, skipping stores to flags that are
+// overwritten before anything can read them.
+//
+// Peripherals are only synchronized when a tick crosses next_event_in, so a
+// block is only entered when its worst-case cycle count fits before the next
+// deadline; cycles are still added before each memory access so anything
+// that reads them (DIV, etc.) sees the same value the interpreter would.  A
+// write that could change that picture (I/O, MBC registers) ends the block
+// early and hands control back to the interpreter.
+
+#define JIT_THRESHOLD 16
+#define JIT_CODE_SIZE (4 << 20)
+#define JIT_BLOCK_MARGIN 8192
+
+#if defined(__x86_64__)
+
+enum {
+	RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+	R8 = 8, R9 = 9, R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+	NO_INDEX = -1,
+};
+
+// Guest state pinned to host registers while a block runs
+enum {
+	REG_GB = RBX,
+	REG_A  = R12,
+	REG_BC = R13,
+	REG_DE = R14,
+	REG_HL = R15,
+	REG_SP = RBP,
+};
+
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5 };
+enum { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+enum { SHIFT_SHL = 4, SHIFT_SHR = 5 };
+
+enum {
+	FZ = 0x1,
+	FN = 0x2,
+	FH = 0x4,
+	FC = 0x8,
+	FALL = FZ | FN | FH | FC,
+};
+
+#define OFF(field) ((int32_t)offsetof(struct gameboy, field))
+
+struct emitter {
+	uint8_t *p;
+	uint8_t *end;
+};
+
+static void emit8(struct emitter *e, uint8_t v)
+{
+	if (e->p < e->end)
+		*e->p = v;
+	++e->p;
+}
+
+static void emit16(struct emitter *e, uint16_t v)
+{
+	emit8(e, v);
+	emit8(e, v >> 8);
+}
+
+static void emit32(struct emitter *e, uint32_t v)
+{
+	emit16(e, v);
+	emit16(e, v >> 16);
+}
+
+static void emit64(struct emitter *e, uint64_t v)
+{
+	emit32(e, v);
+	emit32(e, v >> 32);
+}
+
+// force is needed to address SPL/BPL/SIL/DIL instead of AH/CH/DH/BH
+static void rex(struct emitter *e, bool w, int reg, int index, int base, bool force)
+{
+	uint8_t r = 0x40
+	          | (w << 3)
+	          | (((reg >> 3) & 1) << 2)
+	          | ((index > 0 ? (index >> 3) & 1 : 0) << 1)
+	          | ((base >> 3) & 1);
+
+	if (r != 0x40 || force)
+		emit8(e, r);
+}
+
+static void modrm_rr(struct emitter *e, int reg, int rm)
+{
+	emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// [base + index + disp32]
+static void modrm_mem(struct emitter *e, int reg, int base, int index, int32_t disp)
+{
+	if (index == NO_INDEX) {
+		emit8(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+		if ((base & 7) == RSP)
+			emit8(e, 0x24);
+	} else {
+		emit8(e, 0x80 | ((reg & 7) << 3) | RSP);
+		emit8(e, ((index & 7) << 3) | (base & 7));
+	}
+	emit32(e, disp);
+}
+
+static void mov_rr(struct emitter *e, int dst, int src)
+{
+	rex(e, false, src, 0, dst, false);
+	emit8(e, 0x89);
+	modrm_rr(e, src, dst);
+}
+
+static void mov64_rr(struct emitter *e, int dst, int src)
+{
+	rex(e, true, src, 0, dst, false);
+	emit8(e, 0x89);
+	modrm_rr(e, src, dst);
+}
+
+static void mov_ri(struct emitter *e, int dst, uint32_t imm)
+{
+	rex(e, false, 0, 0, dst, false);
+	emit8(e, 0xB8 + (dst & 7));
+	emit32(e, imm);
+}
+
+static void mov_r64_imm(struct emitter *e, int dst, uint64_t imm)
+{
+	rex(e, true, 0, 0, dst, false);
+	emit8(e, 0xB8 + (dst & 7));
+	emit64(e, imm);
+}
+
+static void alu_rr(struct emitter *e, int op, int dst, int src)
+{
+	rex(e, false, src, 0, dst, false);
+	emit8(e, (op << 3) | 0x01);
+	modrm_rr(e, src, dst);
+}
+
+static void alu_ri(struct emitter *e, int op, int dst, uint32_t imm)
+{
+	rex(e, false, 0, 0, dst, false);
+	emit8(e, 0x81);
+	modrm_rr(e, op, dst);
+	emit32(e, imm);
+}
+
+static void shift_ri(struct emitter *e, int op, int dst, uint8_t n)
+{
+	rex(e, false, 0, 0, dst, false);
+	emit8(e, 0xC1);
+	modrm_rr(e, op, dst);
+	emit8(e, n);
+}
+
+static void movzx8_rr(struct emitter *e, int dst, int src)
+{
+	rex(e, false, dst, 0, src, src >= RSP && src <= RDI);
+	emit8(e, 0x0F);
+	emit8(e, 0xB6);
+	modrm_rr(e, dst, src);
+}
+
+static void movzx16_rr(struct emitter *e, int dst, int src)
+{
+	rex(e, false, dst, 0, src, false);
+	emit8(e, 0x0F);
+	emit8(e, 0xB7);
+	modrm_rr(e, dst, src);
+}
+
+static void load8(struct emitter *e, int dst, int base, int index, int32_t disp)
+{
+	rex(e, false, dst, index, base, false);
+	emit8(e, 0x0F);
+	emit8(e, 0xB6);
+	modrm_mem(e, dst, base, index, disp);
+}
+
+static void load16(struct emitter *e, int dst, int base, int32_t disp)
+{
+	rex(e, false, dst, 0, base, false);
+	emit8(e, 0x0F);
+	emit8(e, 0xB7);
+	modrm_mem(e, dst, base, NO_INDEX, disp);
+}
+
+static void load64(struct emitter *e, int dst, int base, int32_t disp)
+{
+	rex(e, true, dst, 0, base, false);
+	emit8(e, 0x8B);
+	modrm_mem(e, dst, base, NO_INDEX, disp);
+}
+
+static void store8(struct emitter *e, int src, int base, int index, int32_t disp)
+{
+	rex(e, false, src, index, base, src >= RSP && src <= RDI);
+	emit8(e, 0x88);
+	modrm_mem(e, src, base, index, disp);
+}
+
+static void store16(struct emitter *e, int src, int base, int32_t disp)
+{
+	emit8(e, 0x66);
+	rex(e, false, src, 0, base, false);
+	emit8(e, 0x89);
+	modrm_mem(e, src, base, NO_INDEX, disp);
+}
+
+static void store8_imm(struct emitter *e, int base, int32_t disp, uint8_t imm)
+{
+	rex(e, false, 0, 0, base, false);
+	emit8(e, 0xC6);
+	modrm_mem(e, 0, base, NO_INDEX, disp);
+	emit8(e, imm);
+}
+
+static void store16_imm(struct emitter *e, int base, int32_t disp, uint16_t imm)
+{
+	emit8(e, 0x66);
+	rex(e, false, 0, 0, base, false);
+	emit8(e, 0xC7);
+	modrm_mem(e, 0, base, NO_INDEX, disp);
+	emit16(e, imm);
+}
+
+static void add64_mem_imm(struct emitter *e, int base, int32_t disp, uint32_t imm)
+{
+	rex(e, true, 0, 0, base, false);
+	emit8(e, 0x81);
+	modrm_mem(e, ALU_ADD, base, NO_INDEX, disp);
+	emit32(e, imm);
+}
+
+static void cmp8_mem_imm(struct emitter *e, int base, int index, int32_t disp, uint8_t imm)
+{
+	rex(e, false, 0, index, base, false);
+	emit8(e, 0x80);
+	modrm_mem(e, ALU_CMP, base, index, disp);
+	emit8(e, imm);
+}
+
+static void cmp32_mem_imm(struct emitter *e, int base, int32_t disp, uint8_t imm)
+{
+	rex(e, false, 0, 0, base, false);
+	emit8(e, 0x83);
+	modrm_mem(e, ALU_CMP, base, NO_INDEX, disp);
+	emit8(e, imm);
+}
+
+static void test16_mem_imm(struct emitter *e, int base, int32_t disp, uint16_t imm)
+{
+	emit8(e, 0x66);
+	rex(e, false, 0, 0, base, false);
+	emit8(e, 0xF7);
+	modrm_mem(e, 0, base, NO_INDEX, disp);
+	emit16(e, imm);
+}
+
+static void xor16_mem_imm(struct emitter *e, int base, int32_t disp, uint16_t imm)
+{
+	emit8(e, 0x66);
+	rex(e, false, 0, 0, base, false);
+	emit8(e, 0x81);
+	modrm_mem(e, ALU_XOR, base, NO_INDEX, disp);
+	emit16(e, imm);
+}
+
+static void test8_rr(struct emitter *e, int a, int b)
+{
+	rex(e, false, b, 0, a, false);
+	emit8(e, 0x84);
+	modrm_rr(e, b, a);
+}
+
+static void push(struct emitter *e, int r)
+{
+	rex(e, false, 0, 0, r, false);
+	emit8(e, 0x50 + (r & 7));
+}
+
+static void pop(struct emitter *e, int r)
+{
+	rex(e, false, 0, 0, r, false);
+	emit8(e, 0x58 + (r & 7));
+}
+
+static void call(struct emitter *e, const void *fn)
+{
+	mov_r64_imm(e, RAX, (uintptr_t)fn);
+	emit8(e, 0xFF);
+	modrm_rr(e, 2, RAX);
+}
+
+// Forward branches; the returned pointer is patched once the target is known
+static uint8_t *jcc(struct emitter *e, int cc)
+{
+	emit8(e, 0x0F);
+	emit8(e, 0x80 + cc);
+	uint8_t *ref = e->p;
+	emit32(e, 0);
+	return ref;
+}
+
+static uint8_t *jmp(struct emitter *e)
+{
+	emit8(e, 0xE9);
+	uint8_t *ref = e->p;
+	emit32(e, 0);
+	return ref;
+}
+
+static void patch(struct emitter *e, uint8_t *ref)
+{
+	if (e->p > e->end)
+		return;
+
+	int32_t rel = e->p - (ref + 4);
+	memcpy(ref, &rel, sizeof(rel));
+}
+
+// Guest 8-bit registers, in opcode operand order (B, C, D, E, H, L, -, A)
+static const struct {
+	int pair;
+	bool high;
+} regs8[8] = {
+	{ REG_BC, true },
+	{ REG_BC, false },
+	{ REG_DE, true },
+	{ REG_DE, false },
+	{ REG_HL, true },
+	{ REG_HL, false },
+	{ -1, false },
+	{ REG_A, false },
+};
+
+static void get8(struct emitter *e, int r, int dst)
+{
+	mov_rr(e, dst, regs8[r].pair);
+	if (regs8[r].pair == REG_A)
+		return;
+
+	if (regs8[r].high)
+		shift_ri(e, SHIFT_SHR, dst, 8);
+	else
+		alu_ri(e, ALU_AND, dst, 0x00FF);
+}
+
+// Clobbers src
+static void set8(struct emitter *e, int r, int src)
+{
+	int pair = regs8[r].pair;
+
+	if (pair == REG_A) {
+		mov_rr(e, pair, src);
+	} else if (regs8[r].high) {
+		alu_ri(e, ALU_AND, pair, 0x00FF);
+		shift_ri(e, SHIFT_SHL, src, 8);
+		alu_rr(e, ALU_OR, pair, src);
+	} else {
+		alu_ri(e, ALU_AND, pair, 0xFF00);
+		alu_rr(e, ALU_OR, pair, src);
+	}
+}
+
+// Guest register pairs, in opcode operand order (BC, DE, HL, SP)
+static const int regs16[4] = { REG_BC, REG_DE, REG_HL, REG_SP };
+
+static void spill(struct emitter *e)
+{
+	store8(e, REG_A, REG_GB, NO_INDEX, OFF(a));
+	store16(e, REG_BC, REG_GB, OFF(bc));
+	store16(e, REG_DE, REG_GB, OFF(de));
+	store16(e, REG_HL, REG_GB, OFF(hl));
+	store16(e, REG_SP, REG_GB, OFF(sp));
+}
+
+static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+
+static void prologue(struct emitter *e)
+{
+	for (size_t i = 0; i < sizeof(saved) / sizeof(saved[0]); ++i)
+		push(e, saved[i]);
+
+	// Six pushes leave RSP 8 bytes off of the 16-byte call alignment
+	rex(e, true, 0, 0, RSP, false);
+	emit8(e, 0x83);
+	modrm_rr(e, ALU_SUB, RSP);
+	emit8(e, 8);
+
+	mov64_rr(e, REG_GB, RDI);
+
+	load8(e, REG_A, REG_GB, NO_INDEX, OFF(a));
+	load16(e, REG_BC, REG_GB, OFF(bc));
+	load16(e, REG_DE, REG_GB, OFF(de));
+	load16(e, REG_HL, REG_GB, OFF(hl));
+	load16(e, REG_SP, REG_GB, OFF(sp));
+}
+
+// Expects PC and the registers to have been stored already
+static void leave(struct emitter *e)
+{
+	rex(e, true, 0, 0, RSP, false);
+	emit8(e, 0x83);
+	modrm_rr(e, ALU_ADD, RSP);
+	emit8(e, 8);
+
+	for (int i = sizeof(saved) / sizeof(saved[0]) - 1; i >= 0; --i)
+		pop(e, saved[i]);
+
+	emit8(e, 0xC3);
+}
+
+static void epilogue(struct emitter *e, uint16_t pc)
+{
+	store16_imm(e, REG_GB, OFF(pc), pc);
+	spill(e);
+	leave(e);
+}
+
+struct op_info {
+	int cycles;     // Worst case, in M-cycles
+	uint8_t reads;  // Flags read
+	uint8_t writes; // Flags written
+	bool may_exit;  // Through a bus access that needs the interpreter
+	bool ends_block;
+};
+
+// Returns false for anything that isn't translated; the block is cut short
+// there and the interpreter picks up from that instruction
+static bool describe(uint8_t op, struct op_info *info)
+{
+	*info = (struct op_info){ 0 };
+
+	switch (op) {
+	case 0x00:
+		info->cycles = 1;
+		return true;
+
+	case 0x01: case 0x11: case 0x21: case 0x31:
+		info->cycles = 3;
+		return true;
+
+	case 0x02: case 0x12: case 0x22: case 0x32:
+		info->cycles = 2;
+		info->may_exit = true;
+		return true;
+
+	case 0x0A: case 0x1A: case 0x2A: case 0x3A:
+		info->cycles = 2;
+		info->may_exit = true;
+		return true;
+
+	case 0x03: case 0x13: case 0x23: case 0x33:
+	case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+		info->cycles = 2;
+		return true;
+
+	case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x3C:
+	case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x3D:
+		info->cycles = 1;
+		info->writes = FZ | FN | FH;
+		return true;
+
+	case 0x34: case 0x35:
+		info->cycles = 3;
+		info->writes = FZ | FN | FH;
+		info->may_exit = true;
+		return true;
+
+	case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x3E:
+		info->cycles = 2;
+		return true;
+
+	case 0x36:
+		info->cycles = 3;
+		info->may_exit = true;
+		return true;
+
+	case 0x07: case 0x0F:
+		info->cycles = 1;
+		info->writes = FALL;
+		return true;
+
+	case 0x17: case 0x1F:
+		info->cycles = 1;
+		info->reads = FC;
+		info->writes = FALL;
+		return true;
+
+	case 0x09: case 0x19: case 0x29: case 0x39:
+		info->cycles = 2;
+		info->writes = FN | FH | FC;
+		return true;
+
+	case 0x2F:
+		info->cycles = 1;
+		info->writes = FN | FH;
+		return true;
+
+	case 0x37:
+		info->cycles = 1;
+		info->writes = FN | FH | FC;
+		return true;
+
+	case 0x3F:
+		info->cycles = 1;
+		info->reads = FC;
+		info->writes = FN | FH | FC;
+		return true;
+
+	case 0x40 ... 0x75:
+	case 0x77 ... 0x7F:
+		info->cycles = ((op & 0x07) == 0x06 || (op & 0xF8) == 0x70) ? 2 : 1;
+		info->may_exit = (op & 0x07) == 0x06 || (op & 0xF8) == 0x70;
+		return true;
+
+	case 0x80 ... 0xBF:
+	case 0xC6: case 0xCE: case 0xD6: case 0xDE:
+	case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+		info->cycles = (op >= 0xC0 || (op & 0x07) == 0x06) ? 2 : 1;
+		info->may_exit = op < 0xC0 && (op & 0x07) == 0x06;
+		if ((op & 0x38) == 0x08 || (op & 0x38) == 0x18)
+			info->reads = FC;
+		info->writes = FALL;
+		return true;
+
+	case 0xE0:
+		info->cycles = 3;
+		info->may_exit = true;
+		return true;
+	case 0xF0:
+		info->cycles = 3;
+		info->may_exit = true;
+		return true;
+	case 0xE2:
+		info->cycles = 2;
+		info->may_exit = true;
+		return true;
+	case 0xF2:
+		info->cycles = 2;
+		info->may_exit = true;
+		return true;
+	case 0xEA:
+		info->cycles = 4;
+		info->may_exit = true;
+		return true;
+	case 0xFA:
+		info->cycles = 4;
+		info->may_exit = true;
+		return true;
+
+	case 0x18:
+		info->cycles = 3;
+		info->ends_block = true;
+		return true;
+	case 0x20: case 0x28:
+		info->cycles = 3;
+		info->reads = FZ;
+		info->ends_block = true;
+		return true;
+	case 0x30: case 0x38:
+		info->cycles = 3;
+		info->reads = FC;
+		info->ends_block = true;
+		return true;
+
+	case 0xC3:
+		info->cycles = 4;
+		info->ends_block = true;
+		return true;
+	case 0xC2: case 0xCA:
+		info->cycles = 4;
+		info->reads = FZ;
+		info->ends_block = true;
+		return true;
+	case 0xD2: case 0xDA:
+		info->cycles = 4;
+		info->reads = FC;
+		info->ends_block = true;
+		return true;
+
+	case 0xE9:
+		info->cycles = 1;
+		info->ends_block = true;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+struct compiler {
+	struct emitter e;
+	int scale;     // Clocks per M-cycle
+	int pending;   // M-cycles not yet added to gb->cycles
+	long remaining; // Worst-case clocks left in the block after this insn
+	uint16_t pc;   // Address of the next instruction
+	uint8_t live;  // Flags that must be stored by this instruction
+	bool checked_read; // Whether the instruction read through mmu_read
+};
+
+static void flush_cycles(struct compiler *c)
+{
+	if (c->pending)
+		add64_mem_imm(&c->e, REG_GB, OFF(cycles), c->pending * c->scale);
+	c->pending = 0;
+}
+
+static uint8_t jit_read(struct gameboy *gb, uint16_t addr)
+{
+	return mmu_read(gb, addr);
+}
+
+// Anything that may have switched banks, raised an interrupt, started HDMA,
+// or pulled a deadline into the rest of the block sends us back to the
+// interpreter
+static bool jit_write(struct gameboy *gb, uint16_t addr, uint8_t val, long remaining)
+{
+	mmu_write(gb, addr, val);
+
+	return addr < 0x8000
+	    || cpu_needs_attention(gb)
+	    || gb->cycles + remaining >= gb->next_event_in;
+}
+
+// Leaves the host pointer for WRAM addresses in RDX and the offset in RAX;
+// jumps to the returned reference for anything else.  ESI holds the address.
+static uint8_t *wram_lookup(struct compiler *c)
+{
+	struct emitter *e = &c->e;
+
+	mov_rr(e, RAX, RSI);
+	alu_ri(e, ALU_SUB, RAX, 0xC000);
+	alu_ri(e, ALU_CMP, RAX, 0x1000);
+	uint8_t *bank0 = jcc(e, CC_B);
+	alu_ri(e, ALU_SUB, RAX, 0x1000);
+	alu_ri(e, ALU_CMP, RAX, 0x1000);
+	uint8_t *slow = jcc(e, CC_AE);
+	load64(e, RDX, REG_GB, OFF(wramx));
+	uint8_t *done = jmp(e);
+	patch(e, bank0);
+	load64(e, RDX, REG_GB, OFF(wram));
+	patch(e, done);
+
+	return slow;
+}
+
+// Bad reads crash the CPU, which the interpreter notices after finishing the
+// instruction
+static void check_read(struct compiler *c)
+{
+	struct emitter *e = &c->e;
+
+	cmp32_mem_imm(e, REG_GB, OFF(cpu_status), GAMEBOY_CPU_RUNNING);
+	uint8_t *ok = jcc(e, CC_E);
+	if (c->pending)
+		add64_mem_imm(e, REG_GB, OFF(cycles), c->pending * c->scale);
+	epilogue(e, c->pc);
+	patch(e, ok);
+}
+
+// Reads the byte at ESI into EAX
+static void read_dynamic(struct compiler *c)
+{
+	struct emitter *e = &c->e;
+
+	flush_cycles(c);
+
+	uint8_t *slow = wram_lookup(c);
+	load8(e, RAX, RDX, RAX, 0);
+	uint8_t *done = jmp(e);
+
+	patch(e, slow);
+	store16_imm(e, REG_GB, OFF(pc), c->pc);
+	mov64_rr(e, RDI, REG_GB);
+	call(e, jit_read);
+	movzx8_rr(e, RAX, RAX);
+	patch(e, done);
+
+	c->checked_read = true;
+}
+
+// Writes CL to the address in ESI, leaving the block if jit_write says so
+static void write_dynamic(struct compiler *c)
+{
+	struct emitter *e = &c->e;
+
+	flush_cycles(c);
+
+	uint8_t *slow = wram_lookup(c);
+	load64(e, R8, REG_GB, OFF(blocks));
+	mov_rr(e, R9, RSI);
+	shift_ri(e, SHIFT_SHR, R9, 8);
+	cmp8_mem_imm(e, R8, R9, offsetof(struct gameboy_block_cache, code_pages), 0);
+	uint8_t *code = jcc(e, CC_NE);
+	store8(e, RCX, RDX, RAX, 0);
+	uint8_t *done = jmp(e);
+
+	patch(e, slow);
+	patch(e, code);
+	spill(e);
+	store16_imm(e, REG_GB, OFF(pc), c->pc);
+	mov64_rr(e, RDI, REG_GB);
+	mov_rr(e, RDX, RCX);
+	mov_r64_imm(e, RCX, c->remaining);
+	call(e, jit_write);
+	test8_rr(e, RAX, RAX);
+	uint8_t *stay = jcc(e, CC_E);
+	epilogue(e, c->pc);
+	patch(e, stay);
+	patch(e, done);
+}
+
+static void read_addr(struct compiler *c, uint16_t addr)
+{
+	mov_ri(&c->e, RSI, addr);
+	read_dynamic(c);
+}
+
+static void write_addr(struct compiler *c, uint16_t addr)
+{
+	mov_ri(&c->e, RSI, addr);
+	write_dynamic(c);
+}
+
+static void store_flag_z(struct compiler *c, int src)
+{
+	if (c->live & FZ)
+		store8(&c->e, src, REG_GB, NO_INDEX, OFF(flag_z));
+}
+
+static void store_flag_z_imm(struct compiler *c, uint8_t v)
+{
+	if (c->live & FZ)
+		store8_imm(&c->e, REG_GB, OFF(flag_z), v);
+}
+
+static void store_flag_n(struct compiler *c, bool v)
+{
+	if (c->live & FN)
+		store8_imm(&c->e, REG_GB, OFF(flag_n), v);
+}
+
+static void store_flag_h(struct compiler *c, int src)
+{
+	if (c->live & FH)
+		store16(&c->e, src, REG_GB, OFF(flag_h));
+}
+
+static void store_flag_h_imm(struct compiler *c, uint16_t v)
+{
+	if (c->live & FH)
+		store16_imm(&c->e, REG_GB, OFF(flag_h), v);
+}
+
+static void store_flag_c(struct compiler *c, int src)
+{
+	if (c->live & FC)
+		store16(&c->e, src, REG_GB, OFF(flag_c));
+}
+
+static void store_flag_c_imm(struct compiler *c, uint16_t v)
+{
+	if (c->live & FC)
+		store16_imm(&c->e, REG_GB, OFF(flag_c), v);
+}
+
+// ECX = the carry flag as 0 or 1
+static void load_carry(struct compiler *c)
+{
+	load16(&c->e, RCX, REG_GB, OFF(flag_c));
+	shift_ri(&c->e, SHIFT_SHR, RCX, 8);
+	alu_ri(&c->e, ALU_AND, RCX, 1);
+}
+
+// A op= ECX, for the eight ALU operations in opcode order
+static void alu_a(struct compiler *c, int op)
+{
+	struct emitter *e = &c->e;
+
+	switch (op) {
+	case 0: // ADD
+	case 1: // ADC
+	case 2: // SUB
+	case 3: // SBC
+	case 7: // CP
+		mov_rr(e, RAX, REG_A);
+		alu_rr(e, (op == 0 || op == 1) ? ALU_ADD : ALU_SUB, RAX, RCX);
+		if (op == 1 || op == 3) {
+			mov_rr(e, RDX, RCX);
+			load_carry(c);
+			alu_rr(e, op == 1 ? ALU_ADD : ALU_SUB, RAX, RCX);
+			mov_rr(e, RCX, RDX);
+		}
+		if (c->live & FH) {
+			mov_rr(e, RDX, REG_A);
+			alu_rr(e, ALU_XOR, RDX, RCX);
+			alu_rr(e, ALU_XOR, RDX, RAX);
+			store_flag_h(c, RDX);
+		}
+		store_flag_c(c, RAX);
+		store_flag_z(c, RAX);
+		store_flag_n(c, op >= 2);
+		if (op != 7)
+			movzx8_rr(e, REG_A, RAX);
+		break;
+
+	case 4: // AND
+	case 5: // XOR
+	case 6: // OR
+		alu_rr(e, op == 4 ? ALU_AND : op == 5 ? ALU_XOR : ALU_OR, REG_A, RCX);
+		store_flag_z(c, REG_A);
+		store_flag_n(c, false);
+		store_flag_h_imm(c, op == 4 ? 0x10 : 0);
+		store_flag_c_imm(c, 0);
+		break;
+	}
+}
+
+// INC/DEC of the byte in EAX
+static void inc_dec(struct compiler *c, bool dec)
+{
+	struct emitter *e = &c->e;
+
+	mov_rr(e, RDX, RAX);
+	alu_ri(e, dec ? ALU_SUB : ALU_ADD, RAX, 1);
+	alu_ri(e, ALU_AND, RAX, 0xFF);
+	store_flag_z(c, RAX);
+	store_flag_n(c, dec);
+	if (c->live & FH) {
+		alu_rr(e, ALU_XOR, RDX, RAX);
+		alu_ri(e, ALU_XOR, RDX, 1);
+		store_flag_h(c, RDX);
+	}
+}
+
+// Sets ESI to HL (post-incrementing or decrementing it as asked)
+static void hl_address(struct compiler *c, int step)
+{
+	mov_rr(&c->e, RSI, REG_HL);
+	if (step) {
+		alu_ri(&c->e, step > 0 ? ALU_ADD : ALU_SUB, REG_HL, 1);
+		alu_ri(&c->e, ALU_AND, REG_HL, 0xFFFF);
+	}
+}
+
+// Sets up the host flags for a conditional branch; returns the condition
+// code under which the branch is *not* taken
+static int condition(struct compiler *c, uint8_t op)
+{
+	switch ((op >> 3) & 0x03) {
+	case 0: // NZ
+		cmp8_mem_imm(&c->e, REG_GB, NO_INDEX, OFF(flag_z), 0);
+		return CC_E;
+	case 1: // Z
+		cmp8_mem_imm(&c->e, REG_GB, NO_INDEX, OFF(flag_z), 0);
+		return CC_NE;
+	case 2: // NC
+		test16_mem_imm(&c->e, REG_GB, OFF(flag_c), 0x100);
+		return CC_NE;
+	default: // C
+		test16_mem_imm(&c->e, REG_GB, OFF(flag_c), 0x100);
+		return CC_E;
+	}
+}
+
+// Taken branches spend an extra cycle computing the target
+static void branch(struct compiler *c, uint8_t op, bool conditional, uint16_t target)
+{
+	struct emitter *e = &c->e;
+
+	flush_cycles(c);
+
+	uint8_t *not_taken = NULL;
+	if (conditional)
+		not_taken = jcc(e, condition(c, op));
+
+	add64_mem_imm(e, REG_GB, OFF(cycles), c->scale);
+	epilogue(e, target);
+
+	if (not_taken) {
+		patch(e, not_taken);
+		epilogue(e, c->pc);
+	}
+}
+
+static void translate(struct compiler *c, const struct gameboy_insn *insn)
+{
+	struct emitter *e = &c->e;
+	uint8_t op = insn->opcode;
+	int dst = (op >> 3) & 0x07;
+	int src = op & 0x07;
+
+	// Fetch ticks are all that precede the first memory access
+	c->pending += insn->length;
+
+	switch (op) {
+	case 0x00:
+		break;
+
+	case 0x01: case 0x11: case 0x21: case 0x31:
+		mov_ri(e, regs16[op >> 4], insn->imm);
+		break;
+
+	case 0x02: case 0x12: case 0x22: case 0x32:
+		if (op >= 0x22)
+			hl_address(c, op == 0x22 ? 1 : -1);
+		else
+			mov_rr(e, RSI, regs16[op >> 4]);
+		mov_rr(e, RCX, REG_A);
+		c->pending += 1;
+		write_dynamic(c);
+		break;
+
+	case 0x0A: case 0x1A: case 0x2A: case 0x3A:
+		if (op >= 0x2A)
+			hl_address(c, op == 0x2A ? 1 : -1);
+		else
+			mov_rr(e, RSI, regs16[op >> 4]);
+		c->pending += 1;
+		read_dynamic(c);
+		mov_rr(e, REG_A, RAX);
+		break;
+
+	case 0x03: case 0x13: case 0x23: case 0x33:
+	case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+		alu_ri(e, (op & 0x08) ? ALU_SUB : ALU_ADD, regs16[op >> 4], 1);
+		alu_ri(e, ALU_AND, regs16[op >> 4], 0xFFFF);
+		c->pending += 1;
+		break;
+
+	case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x3C:
+	case 0x05: case 0x0D: case 0x15: case 0x1D: case 0x25: case 0x2D: case 0x3D:
+		get8(e, dst, RAX);
+		inc_dec(c, op & 0x01);
+		set8(e, dst, RAX);
+		break;
+
+	case 0x34: case 0x35:
+		hl_address(c, 0);
+		c->pending += 1;
+		read_dynamic(c);
+		inc_dec(c, op & 0x01);
+		mov_rr(e, RCX, RAX);
+		mov_rr(e, RSI, REG_HL);
+		c->pending += 1;
+		write_dynamic(c);
+		break;
+
+	case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x3E:
+		mov_ri(e, RAX, insn->imm & 0xFF);
+		set8(e, dst, RAX);
+		break;
+
+	case 0x36:
+		hl_address(c, 0);
+		mov_ri(e, RCX, insn->imm & 0xFF);
+		c->pending += 1;
+		write_dynamic(c);
+		break;
+
+	case 0x07: // RLCA
+	case 0x0F: // RRCA
+	case 0x17: // RLA
+	case 0x1F: // RRA
+		mov_rr(e, RAX, REG_A);
+		if (op == 0x07) {
+			shift_ri(e, SHIFT_SHL, RAX, 1);
+			mov_rr(e, RDX, REG_A);
+			shift_ri(e, SHIFT_SHR, RDX, 7);
+			alu_rr(e, ALU_OR, RAX, RDX);
+			alu_ri(e, ALU_AND, RAX, 0xFF);
+			mov_rr(e, REG_A, RAX);
+			shift_ri(e, SHIFT_SHL, RAX, 8);
+		} else if (op == 0x0F) {
+			shift_ri(e, SHIFT_SHR, RAX, 1);
+			mov_rr(e, RDX, REG_A);
+			shift_ri(e, SHIFT_SHL, RDX, 7);
+			alu_rr(e, ALU_OR, RAX, RDX);
+			alu_ri(e, ALU_AND, RAX, 0xFF);
+			mov_rr(e, REG_A, RAX);
+			shift_ri(e, SHIFT_SHL, RAX, 1);
+		} else if (op == 0x17) {
+			load_carry(c);
+			shift_ri(e, SHIFT_SHL, RAX, 1);
+			alu_rr(e, ALU_OR, RAX, RCX);
+			movzx8_rr(e, REG_A, RAX);
+		} else {
+			shift_ri(e, SHIFT_SHL, RAX, 8);
+			mov_rr(e, RDX, REG_A);
+			shift_ri(e, SHIFT_SHR, RDX, 1);
+			load_carry(c);
+			shift_ri(e, SHIFT_SHL, RCX, 7);
+			alu_rr(e, ALU_OR, RDX, RCX);
+			mov_rr(e, REG_A, RDX);
+		}
+		store_flag_c(c, RAX);
+		store_flag_z_imm(c, 1);
+		store_flag_n(c, false);
+		store_flag_h_imm(c, 0);
+		break;
+
+	case 0x09: case 0x19: case 0x29: case 0x39:
+		mov_rr(e, RAX, REG_HL);
+		alu_rr(e, ALU_ADD, RAX, regs16[op >> 4]);
+		if (c->live & FH) {
+			mov_rr(e, RDX, REG_HL);
+			alu_rr(e, ALU_XOR, RDX, regs16[op >> 4]);
+			alu_rr(e, ALU_XOR, RDX, RAX);
+			shift_ri(e, SHIFT_SHR, RDX, 8);
+			store_flag_h(c, RDX);
+		}
+		movzx16_rr(e, REG_HL, RAX);
+		shift_ri(e, SHIFT_SHR, RAX, 8);
+		store_flag_c(c, RAX);
+		store_flag_n(c, false);
+		c->pending += 1;
+		break;
+
+	case 0x2F:
+		alu_ri(e, ALU_XOR, REG_A, 0xFF);
+		store_flag_n(c, true);
+		store_flag_h_imm(c, 0x10);
+		break;
+
+	case 0x37:
+		store_flag_n(c, false);
+		store_flag_h_imm(c, 0);
+		store_flag_c_imm(c, 0x100);
+		break;
+
+	case 0x3F:
+		store_flag_n(c, false);
+		store_flag_h_imm(c, 0);
+		xor16_mem_imm(e, REG_GB, OFF(flag_c), 0x100);
+		break;
+
+	case 0x40 ... 0x75:
+	case 0x77 ... 0x7F:
+		if (src == 6) {
+			hl_address(c, 0);
+			c->pending += 1;
+			read_dynamic(c);
+			set8(e, dst, RAX);
+		} else if (dst == 6) {
+			hl_address(c, 0);
+			get8(e, src, RCX);
+			c->pending += 1;
+			write_dynamic(c);
+		} else if (src != dst) {
+			get8(e, src, RAX);
+			set8(e, dst, RAX);
+		}
+		break;
+
+	case 0x80 ... 0xBF:
+		if (src == 6) {
+			hl_address(c, 0);
+			c->pending += 1;
+			read_dynamic(c);
+			mov_rr(e, RCX, RAX);
+		} else {
+			get8(e, src, RCX);
+		}
+		alu_a(c, dst);
+		break;
+
+	case 0xC6: case 0xCE: case 0xD6: case 0xDE:
+	case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+		mov_ri(e, RCX, insn->imm & 0xFF);
+		alu_a(c, dst);
+		break;
+
+	case 0xE0:
+		mov_rr(e, RCX, REG_A);
+		c->pending += 1;
+		write_addr(c, 0xFF00 | (insn->imm & 0xFF));
+		break;
+	case 0xF0:
+		c->pending += 1;
+		read_addr(c, 0xFF00 | (insn->imm & 0xFF));
+		mov_rr(e, REG_A, RAX);
+		break;
+	case 0xE2:
+		get8(e, 1, RSI);
+		alu_ri(e, ALU_OR, RSI, 0xFF00);
+		mov_rr(e, RCX, REG_A);
+		c->pending += 1;
+		write_dynamic(c);
+		break;
+	case 0xF2:
+		get8(e, 1, RSI);
+		alu_ri(e, ALU_OR, RSI, 0xFF00);
+		c->pending += 1;
+		read_dynamic(c);
+		mov_rr(e, REG_A, RAX);
+		break;
+	case 0xEA:
+		mov_rr(e, RCX, REG_A);
+		c->pending += 1;
+		write_addr(c, insn->imm);
+		break;
+	case 0xFA:
+		c->pending += 1;
+		read_addr(c, insn->imm);
+		mov_rr(e, REG_A, RAX);
+		break;
+
+	case 0x18:
+		branch(c, op, false, c->pc + (int8_t)insn->imm);
+		break;
+	case 0x20: case 0x28: case 0x30: case 0x38:
+		branch(c, op, true, c->pc + (int8_t)insn->imm);
+		break;
+
+	case 0xC3:
+		branch(c, op, false, insn->imm);
+		break;
+	case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+		branch(c, op, true, insn->imm);
+		break;
+
+	case 0xE9:
+		flush_cycles(c);
+		spill(e);
+		store16(e, REG_HL, REG_GB, OFF(pc));
+		leave(e);
+		break;
+	}
+}
+
+// Flips the code buffer between writable (while compile emits into it) and
+// executable (whenever guest code may run)
+static bool protect(struct gameboy_jit *jit, bool writable)
+{
+	int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+	if (mprotect(jit->code, jit->size, prot) == 0)
+		return true;
+
+	GBLOG("Failed to make JIT code buffer %s, interpreting instead: %m",
+	      writable ? "writable" : "executable");
+	jit->disabled = true;
+
+	return false;
+}
+
+static bool compile(struct gameboy *gb, struct gameboy_block *block)
+{
+	struct gameboy_jit *jit = gb->jit;
+
+	struct op_info info[BLOCK_MAX_INSNS];
+	int count = 0;
+	long cycles = 0;
+
+	for (; count < block->count; ++count) {
+		if (!describe(block->insns[count].opcode, &info[count]))
+			break;
+		cycles += info[count].cycles;
+		if (info[count].ends_block) {
+			++count;
+			break;
+		}
+	}
+
+	if (!count)
+		return false;
+
+	// Flags only need to be stored if something in the block reads them
+	// before they're overwritten, or if the block can be left right after
+	uint8_t live_out[BLOCK_MAX_INSNS];
+	uint8_t live = FALL;
+	for (int i = count - 1; i >= 0; --i) {
+		if (info[i].may_exit || info[i].ends_block || i == count - 1)
+			live = FALL;
+		live_out[i] = live;
+		live = (live & ~info[i].writes) | info[i].reads;
+	}
+
+	if (!protect(jit, true))
+		return false;
+
+	if (jit->size - jit->used < JIT_BLOCK_MARGIN)
+		jit_reset(gb);
+
+	struct compiler c = {
+		.e = {
+			.p = jit->code + jit->used,
+			.end = jit->code + jit->size,
+		},
+		.scale = gb->double_speed ? 2 : 4,
+		.pc = block->pc,
+	};
+	uint8_t *start = c.e.p;
+	long left = cycles;
+
+	prologue(&c.e);
+	for (int i = 0; i < count; ++i) {
+		const struct gameboy_insn *insn = &block->insns[i];
+		left -= info[i].cycles;
+		c.pc += insn->length;
+		c.live = live_out[i];
+		c.remaining = left * c.scale;
+		c.checked_read = false;
+		translate(&c, insn);
+		if (c.checked_read && !info[i].ends_block)
+			check_read(&c);
+	}
+	if (!info[count - 1].ends_block) {
+		flush_cycles(&c);
+		epilogue(&c.e, c.pc);
+	}
+
+	if (!protect(jit, false) || c.e.p > c.e.end)
+		return false;
+
+	jit->used = c.e.p - jit->code;
+
+	block->native = (void (*)(struct gameboy *))start;
+	block->native_cycles = cycles * c.scale;
+	block->native_double_speed = gb->double_speed;
+
+	return true;
+}
+
+bool jit_run(struct gameboy *gb, struct gameboy_block *block)
+{
+	if (gb->jit->disabled)
+		return false;
+
+	if (!block->native) {
+		if (block->native_failed || block->region > GAMEBOY_BLOCK_ROMX)
+			return false;
+		if (++block->hits < JIT_THRESHOLD)
+			return false;
+		if (!compile(gb, block)) {
+			block->native_failed = true;
+			return false;
+		}
+	}
+
+	if (block->native_double_speed != gb->double_speed)
+		return false;
+	if (gb->cycles + block->native_cycles >= gb->next_event_in)
+		return false;
+	if (cpu_needs_attention(gb))
+		return false;
+
+	block->native(gb);
+
+	return true;
+}
+
+void jit_reset(struct gameboy *gb)
+{
+	if (!gb->jit)
+		return;
+
+	gb->jit->used = 0;
+
+	for (int i = 0; i < BLOCK_CACHE_SIZE; ++i) {
+		gb->blocks->blocks[i].native = NULL;
+		gb->blocks->blocks[i].native_failed = false;
+		gb->blocks->blocks[i].hits = 0;
+	}
+}
+
+int gameboy_enable_jit(struct gameboy *gb)
+{
+	if (gb->jit)
+		return 0;
+
+	struct gameboy_jit *jit = calloc(1, sizeof(*jit));
+	if (!jit) {
+		GBLOG("Failed to allocate JIT: %m");
+		return ENOMEM;
+	}
+
+	jit->size = JIT_CODE_SIZE;
+	jit->code = mmap(NULL, jit->size, PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED) {
+		GBLOG("Failed to map JIT code buffer: %m");
+		free(jit);
+		return errno;
+	}
+
+	gb->jit = jit;
+	jit_reset(gb);
+
+	return 0;
+}
+
+void jit_free(struct gameboy *gb)
+{
+	if (!gb->jit)
+		return;
+
+	munmap(gb->jit->code, gb->jit->size);
+	free(gb->jit);
+	gb->jit = NULL;
+}
+
+#else
+
+bool jit_run(struct gameboy *gb, struct gameboy_block *block)
+{
+	return false;
+}
+
+void jit_reset(struct gameboy *gb)
+{
+}
+
+int gameboy_enable_jit(struct gameboy *gb)
+{
+	GBLOG("The JIT is only available on x86-64");
+	return ENOTSUP;
+}
+
+void jit_free(struct gameboy *gb)
+{
+}
+
+#endif
@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef EGBE_JIT_H
+#define EGBE_JIT_H
+
+#include "gameboy.h"
+
+struct gameboy_block;
+
+// Executable memory for translated blocks; allocated bump-style and thrown
+// away wholesale when it fills up or the block cache is flushed.  It is only
+// ever writable or executable, never both; disabled is set (and everything
+// left to the interpreter) if the host refuses to switch it.
+struct gameboy_jit {
+	uint8_t *code;
+	size_t size;
+	size_t used;
+	bool disabled;
+};
+
+bool jit_run(struct gameboy *gb, struct gameboy_block *block);
+void jit_reset(struct gameboy *gb);
+void jit_free(struct gameboy *gb);
+
+#endif
@@ -1,9 +1,19 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #include "cpu.h"
 #include "lcd.h"
+#include "perf.h"
+#include "scheduler.h"
 #include "common.h"
+#include <limits.h>
+#include <string.h>
 #include <sys/param.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 // Used to more easily debug VRAM (no changing palette or duplicated colors)
 static const struct gameboy_palette monochrome = {
 	.colors = {
@@ -14,16 +24,82 @@ static const struct gameboy_palette monochrome = {
 	},
 };
 
-void lcd_update_palette_dmg(struct gameboy_palette *p, uint8_t val)
+// Spreads the bits of a bitplane byte to every other bit, so a tile row is
+// spread(lo) | spread(hi) << 1; the mirrored table also reverses the pixels
+#define SPREAD(b) \
+	( ((b) & 0x01)       | ((b) & 0x02) << 1 | ((b) & 0x04) << 2 | ((b) & 0x08) << 3 \
+	| ((b) & 0x10) << 4 | ((b) & 0x20) << 5 | ((b) & 0x40) << 6 | ((b) & 0x80) << 7)
+#define SPREAD_MIRRORED(b) \
+	( ((b) & 0x01) << 14 | ((b) & 0x02) << 11 | ((b) & 0x04) << 8 | ((b) & 0x08) << 5 \
+	| ((b) & 0x10) << 2  | ((b) & 0x20) >> 1  | ((b) & 0x40) >> 4 | ((b) & 0x80) >> 7)
+#define SPREAD_4(f, n)   f(n), f((n) + 1), f((n) + 2), f((n) + 3)
+#define SPREAD_16(f, n)  SPREAD_4(f, n), SPREAD_4(f, (n) + 4), SPREAD_4(f, (n) + 8), SPREAD_4(f, (n) + 12)
+#define SPREAD_64(f, n)  SPREAD_16(f, n), SPREAD_16(f, (n) + 16), SPREAD_16(f, (n) + 32), SPREAD_16(f, (n) + 48)
+#define SPREAD_256(f)    SPREAD_64(f, 0), SPREAD_64(f, 64), SPREAD_64(f, 128), SPREAD_64(f, 192)
+
+static const uint16_t spread[2][256] = {
+	{ SPREAD_256(SPREAD) },
+	{ SPREAD_256(SPREAD_MIRRORED) },
+};
+
+// Color code of pixel x (0 is leftmost) in a packed tile row
+static inline uint8_t row_code(uint16_t row, int x)
 {
+	return (row >> (14 - 2 * x)) & 0x03;
+}
+
+// Expands all eight pixels of a packed tile row to colors
+static inline void expand_row(int *out, uint16_t row, const int *colors)
+{
+#if defined(__AVX2__)
+	// Shift each pixel's code to the bottom of a lane and use it to index
+	// the palette directly
+	__m256i codes = _mm256_srlv_epi32(_mm256_set1_epi32(row),
+	                                  _mm256_setr_epi32(14, 12, 10, 8, 6, 4, 2, 0));
+	codes = _mm256_and_si256(codes, _mm256_set1_epi32(0x03));
+	__m256i palette = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)colors));
+	_mm256_storeu_si256((__m256i *)out, _mm256_permutevar8x32_epi32(palette, codes));
+#elif defined(__SSE2__)
+	// No variable shifts or shuffles, so pick between colors with a
+	// mask per code bit instead
+	__m128i rows = _mm_set1_epi32(row);
+	__m128i c0 = _mm_set1_epi32(colors[0]);
+	__m128i c2 = _mm_set1_epi32(colors[2]);
+	__m128i c01 = _mm_xor_si128(c0, _mm_set1_epi32(colors[1]));
+	__m128i c23 = _mm_xor_si128(c2, _mm_set1_epi32(colors[3]));
+
+	for (int half = 0; half < 2; ++half) {
+		int shift = 8 - 8 * half;
+		__m128i lo = _mm_setr_epi32(0x40 << shift, 0x10 << shift, 0x04 << shift, 0x01 << shift);
+		__m128i hi = _mm_add_epi32(lo, lo);
+
+		__m128i lo_set = _mm_cmpeq_epi32(_mm_and_si128(rows, lo), lo);
+		__m128i hi_set = _mm_cmpeq_epi32(_mm_and_si128(rows, hi), hi);
+		__m128i low = _mm_xor_si128(c0, _mm_and_si128(c01, lo_set));
+		__m128i high = _mm_xor_si128(c2, _mm_and_si128(c23, lo_set));
+		__m128i color = _mm_xor_si128(low, _mm_and_si128(_mm_xor_si128(low, high), hi_set));
+		_mm_storeu_si128((__m128i *)&out[4 * half], color);
+	}
+#else
+	for (int x = 0; x < 8; ++x)
+		out[x] = colors[row_code(row, x)];
+#endif
+}
+
+void lcd_update_palette_dmg(struct gameboy *gb, struct gameboy_palette *p, uint8_t val)
+{
+	gb->dbg_dirty.palettes = true;
+
 	p->colors[0] = monochrome.colors[(val & BITS(0, 1)) >> 0];
 	p->colors[1] = monochrome.colors[(val & BITS(2, 3)) >> 2];
 	p->colors[2] = monochrome.colors[(val & BITS(4, 5)) >> 4];
 	p->colors[3] = monochrome.colors[(val & BITS(6, 7)) >> 6];
 }
 
-void lcd_update_palette_gbc(struct gameboy_palette *p, uint8_t index)
+void lcd_update_palette_gbc(struct gameboy *gb, struct gameboy_palette *p, uint8_t index)
 {
+	gb->dbg_dirty.palettes = true;
+
 	int tmp = (p->raw[(index << 1) + 1] << 8) | p->raw[index << 1];
 
 	tmp = ((tmp & BITS(0, 4))   << 19) // R
@@ -36,132 +112,224 @@ void lcd_update_palette_gbc(struct gameboy_palette *p, uint8_t index)
 	p->colors[index] = tmp;
 }
 
-static void render_debug(struct gameboy *gb)
+// Draws an 8x8 tile into a debug view with the given row stride
+static void draw_tile(int *out, int stride, const struct gameboy_tile *tile, const int *colors)
 {
-	struct gameboy_background_cell *cell;
-	struct gameboy_tile *tile;
+	for (int dy = 0; dy < 8; ++dy)
+		expand_row(&out[dy * stride], tile->rows[0][dy], colors);
+}
 
-	if (gb->dbg_vram) {
-		for (int ty = 0; ty < 24; ++ty) {
-			for (int tx = 0; tx < 16; ++tx) {
-				tile = &gb->tiles[0][(16 * ty) + tx];
+// Whether a view needs a full redraw, because it was just attached (or
+// swapped for another buffer) or everything is dirty
+static bool view_stale(struct gameboy *gb, const void **drawn, const void *view)
+{
+	bool stale = gb->dbg_dirty.all || *drawn != view;
+	*drawn = view;
 
-				for (int dy = 0; dy < 8; ++dy) {
-					for (int dx = 0; dx < 8; ++dx) {
-						int y = (8 * ty) + dy;
-						int x = (8 * tx) + dx;
-						int color = tile->pixels[dy][dx];
+	return stale;
+}
 
-						(*gb->dbg_vram)[y][x] = monochrome.colors[color];
-					}
-				}
-			}
-		}
+static void render_vram(struct gameboy *gb, int (*view)[192][128], const void **drawn, int bank)
+{
+	struct gameboy_debug_dirty *dirty = &gb->dbg_dirty;
+	bool stale = view_stale(gb, drawn, view);
+
+	for (int i = 0; i < 384; ++i) {
+		if (!stale && !dirty->tiles[384 * bank + i])
+			continue;
+
+		int tx = i % 16;
+		int ty = i / 16;
+		draw_tile(&(*view)[8 * ty][8 * tx], 128, &gb->tiles[bank][i], monochrome.colors);
 	}
+}
 
-	if (gb->dbg_vram_gbc) {
-		for (int ty = 0; ty < 24; ++ty) {
-			for (int tx = 0; tx < 16; ++tx) {
-				tile = &gb->tiles[1][(16 * ty) + tx];
+static void render_tilemap(struct gameboy *gb, int (*view)[256][256], const void **drawn,
+                           uint8_t tilemap, uint8_t *drawn_tilemap)
+{
+	struct gameboy_debug_dirty *dirty = &gb->dbg_dirty;
+	bool stale = view_stale(gb, drawn, view) || dirty->palettes || *drawn_tilemap != tilemap;
+	*drawn_tilemap = tilemap;
 
-				for (int dy = 0; dy < 8; ++dy) {
-					for (int dx = 0; dx < 8; ++dx) {
-						int y = (8 * ty) + dy;
-						int x = (8 * tx) + dx;
-						int color = tile->pixels[dy][dx];
+	for (int i = 0; i < 1024; ++i) {
+		struct gameboy_background_cell *cell = &gb->tilemaps[tilemap].cells_flat[i];
 
-						(*gb->dbg_vram_gbc)[y][x] = monochrome.colors[color];
-					}
-				}
-			}
-		}
+		if (!stale && !dirty->cells[tilemap][i] &&
+		    !dirty->tiles[cell->tile - &gb->tiles[0][0]])
+			continue;
+
+		int tx = i % 32;
+		int ty = i / 32;
+		draw_tile(&(*view)[8 * ty][8 * tx], 256, cell->tile, cell->palette->colors);
 	}
+}
 
-	if (gb->dbg_background) {
-		for (int ty = 0; ty < 32; ++ty) {
-			for (int tx = 0; tx < 32; ++tx) {
-				cell = &gb->tilemaps[gb->background_tilemap].cells[ty][tx];
+static void render_palettes(struct gameboy *gb)
+{
+	struct gameboy_debug_dirty *dirty = &gb->dbg_dirty;
+	if (!view_stale(gb, &dirty->palettes_view, gb->dbg_palettes) && !dirty->palettes)
+		return;
 
-				for (int dy = 0; dy < 8; ++dy) {
-					for (int dx = 0; dx < 8; ++dx) {
-						int y = (8 * ty) + dy;
-						int x = (8 * tx) + dx;
-						int color = cell->tile->pixels[dy][dx];
+	for (int i = 0; i < 8; ++i) {
+		for (int j = 0; j < 4; ++j) {
+			int color;
 
-						(*gb->dbg_background)[y][x] = cell->palette->colors[color];
-					}
+			color = gb->bgp[i].colors[j];
+			for (int dy = 0; dy < 8; ++dy) {
+				for (int dx = 0; dx < 8; ++dx) {
+					int y = (i * 10) + dy + 2;
+					int x = (j * 10) + dx + 2;
+					(*gb->dbg_palettes)[y][x] = color;
 				}
 			}
-		}
-	}
-
-	if (gb->dbg_window) {
-		for (int ty = 0; ty < 32; ++ty) {
-			for (int tx = 0; tx < 32; ++tx) {
-				cell = &gb->tilemaps[gb->window_tilemap].cells[ty][tx];
 
-				for (int dy = 0; dy < 8; ++dy) {
-					for (int dx = 0; dx < 8; ++dx) {
-						int y = (8 * ty) + dy;
-						int x = (8 * tx) + dx;
-						int color = cell->tile->pixels[dy][dx];
-
-						(*gb->dbg_window)[y][x] = cell->palette->colors[color];
-					}
+			color = gb->obp[i].colors[j];
+			for (int dy = 0; dy < 8; ++dy) {
+				for (int dx = 0; dx < 8; ++dx) {
+					int y = (i * 10) + dy + 2;
+					int x = (j * 10) + dx + 46;
+					(*gb->dbg_palettes)[y][x] = color;
 				}
 			}
 		}
 	}
+}
 
-	if (gb->dbg_palettes) {
-		for (int i = 0; i < 8; ++i) {
-			for (int j = 0; j < 4; ++j) {
-				int color;
-
-				color = gb->bgp[i].colors[j];
-				for (int dy = 0; dy < 8; ++dy) {
-					for (int dx = 0; dx < 8; ++dx) {
-						int y = (i * 10) + dy + 2;
-						int x = (j * 10) + dx + 2;
-						(*gb->dbg_palettes)[y][x] = color;
-					}
-				}
+// Debug views are only drawn while attached, and then only where tiles,
+// tilemap cells or palettes have changed since the last frame
+static void render_debug(struct gameboy *gb)
+{
+	struct gameboy_debug_dirty *dirty = &gb->dbg_dirty;
+
+	// A detached view's buffer may come back at the same address, so it
+	// has to be redrawn in full when reattached all the same
+	if (!gb->dbg_vram)
+		dirty->vram = NULL;
+	if (!gb->dbg_vram_gbc)
+		dirty->vram_gbc = NULL;
+	if (!gb->dbg_background)
+		dirty->background = NULL;
+	if (!gb->dbg_window)
+		dirty->window = NULL;
+	if (!gb->dbg_palettes)
+		dirty->palettes_view = NULL;
+
+	if (!gb->dbg_vram && !gb->dbg_vram_gbc && !gb->dbg_background &&
+	    !gb->dbg_window && !gb->dbg_palettes)
+		return;
 
-				color = gb->obp[i].colors[j];
-				for (int dy = 0; dy < 8; ++dy) {
-					for (int dx = 0; dx < 8; ++dx) {
-						int y = (i * 10) + dy + 2;
-						int x = (j * 10) + dx + 46;
-						(*gb->dbg_palettes)[y][x] = color;
-					}
-				}
-			}
+	if (gb->dbg_vram)
+		render_vram(gb, gb->dbg_vram, &dirty->vram, 0);
+
+	if (gb->dbg_vram_gbc)
+		render_vram(gb, gb->dbg_vram_gbc, &dirty->vram_gbc, 1);
+
+	if (gb->dbg_background)
+		render_tilemap(gb, gb->dbg_background, &dirty->background,
+		               gb->background_tilemap, &dirty->background_tilemap);
+
+	if (gb->dbg_window)
+		render_tilemap(gb, gb->dbg_window, &dirty->window,
+		               gb->window_tilemap, &dirty->window_tilemap);
+
+	if (gb->dbg_palettes)
+		render_palettes(gb);
+
+	dirty->all = false;
+	dirty->palettes = false;
+	memset(dirty->tiles, 0, sizeof(dirty->tiles));
+	memset(dirty->cells, 0, sizeof(dirty->cells));
+}
+
+// Whether sprite a is drawn over sprite b where they overlap: on DMG the one
+// further left wins, then (as on GBC) the one earlier in OAM
+static bool sprite_wins(struct gameboy *gb, uint8_t a, uint8_t b)
+{
+	if (!gb->gbc && gb->sprites[a].x != gb->sprites[b].x)
+		return gb->sprites[a].x < gb->sprites[b].x;
+
+	return a < b;
+}
+
+// Repeats the hardware's OAM search for every line at once: the first 10
+// sprites in OAM overlapping a line are kept (whatever their X), then
+// ordered by priority as they are inserted
+static void select_sprites(struct gameboy *gb)
+{
+	memset(gb->line_sprite_counts, 0, sizeof(gb->line_sprite_counts));
+
+	for (int i = 0; i < 40; ++i) {
+		struct gameboy_sprite *spr = &gb->sprites[i];
+
+		for (int dy = 0; dy < gb->sprite_size; ++dy) {
+			uint8_t y = spr->y + dy;
+			if (y >= 144 || gb->line_sprite_counts[y] == 10)
+				continue;
+
+			uint8_t *list = gb->line_sprites[y];
+			int n = gb->line_sprite_counts[y]++;
+			for (; n > 0 && sprite_wins(gb, i, list[n - 1]); --n)
+				list[n] = list[n - 1];
+			list[n] = i;
 		}
 	}
+
+	gb->sprites_dirty = false;
 }
 
-static int sprite_qsort(const void *p1, const void *p2)
+// Draws pixels [x, end) of the current line from row dy of a tilemap,
+// starting dx pixels into it, a tile at a time; SCX/WX can leave partial
+// tiles at either end
+static void render_tiles(struct gameboy *gb, uint8_t *line, int x, int end,
+                         uint8_t tilemap, uint8_t dy, uint8_t dx)
 {
-	const struct gameboy_sprite *lhs = p1;
-	const struct gameboy_sprite *rhs = p2;
+	struct gameboy_background_cell *cells = gb->tilemaps[tilemap].cells[dy / 8];
+	int *out = gb->screen ? (*gb->screen)[gb->scanline] : NULL;
+	uint8_t *indexed = gb->screen_indexed ? (*gb->screen_indexed)[gb->scanline] : NULL;
+
+	while (x < end) {
+		struct gameboy_background_cell *cell = &cells[dx / 8];
+		const int *colors = cell->palette->colors;
+		uint16_t row = cell->tile->rows[0][dy % 8] << (2 * (dx % 8));
+		int n = MIN(8 - dx % 8, end - x);
+
+		if (!out) {
+			// Indexed output only
+		} else if (n == 8) {
+			expand_row(&out[x], row, colors);
+		} else {
+			for (int i = 0; i < n; ++i)
+				out[x + i] = colors[row_code(row, i)];
+		}
 
-	if (lhs->x != rhs->x)
-		return (lhs->x < rhs->x) ? -1 : 1;
+		for (int i = 0; i < n; ++i)
+			line[x + i] = row_code(row, i);
 
-	return (lhs < rhs) ? -1 : 1;
+		if (indexed) {
+			uint8_t palette = (GAMEBOY_SCREEN_BGP + cell->palette_index) << 2;
+			for (int i = 0; i < n; ++i)
+				indexed[x + i] = palette | line[x + i];
+		}
+
+		x += n;
+		dx += n;
+	}
 }
 
+// Marks pixels of line already claimed by a sprite, above the color code
+#define LINE_SPRITE 0x04
+
 static void render_scanline(struct gameboy *gb)
 {
-	if (!gb->screen)
+	if ((!gb->screen && !gb->screen_indexed) || gb->skip_frame)
 		return;
 
 	uint8_t line[160];
 	int y = gb->scanline;
 	uint8_t dy;
 
-	if (gb->sprites_unsorted)
-		qsort(gb->sprites_sorted, 40, sizeof(void *), sprite_qsort);
+	if (gb->sprites_dirty)
+		select_sprites(gb);
 
 	uint8_t window_start;
 	if (gb->window_enabled && gb->scanline >= gb->wy)
@@ -169,45 +337,38 @@ static void render_scanline(struct gameboy *gb)
 	else
 		window_start = 160;
 
-	dy = y + gb->sy;
-	for (int x = 0; x < window_start; ++x) {
-		if (!gb->background_enabled)
-			break;
-
-		uint8_t dx = x + gb->sx;
-
-		struct gameboy_background_cell *cell;
-		cell = &gb->tilemaps[gb->background_tilemap].cells[dy / 8][dx / 8];
-
-		uint8_t code = cell->tile->pixels[dy % 8][dx % 8];
-		line[x] = code;
-		(*gb->screen)[y][x] = cell->palette->colors[code];
+	if (gb->background_enabled) {
+		dy = y + gb->sy;
+		render_tiles(gb, line, 0, window_start, gb->background_tilemap, dy, gb->sx);
+	} else {
+		// Frame sinks may hand out buffers holding anything, so blank
+		// lines are drawn too
+		memset(line, 0, window_start);
+		for (int x = 0; x < window_start && gb->screen; ++x)
+			(*gb->screen)[y][x] = monochrome.colors[0];
+		if (gb->screen_indexed)
+			memset((*gb->screen_indexed)[y], GAMEBOY_SCREEN_BLANK << 2, window_start);
 	}
 
 	dy = y - gb->wy;
-	for (int x = window_start; x < 160; ++x) {
-		uint8_t dx = x - gb->wx;
-
-		struct gameboy_background_cell *cell;
-		cell = &gb->tilemaps[gb->window_tilemap].cells[dy / 8][dx / 8];
+	render_tiles(gb, line, window_start, 160, gb->window_tilemap, dy, window_start - gb->wx);
 
-		uint8_t code = cell->tile->pixels[dy % 8][dx % 8];
-		line[x] = code;
-		(*gb->screen)[y][x] = cell->palette->colors[code];
-	}
+	if (!gb->sprites_enabled)
+		return;
 
-	for (int i = 0; i < 40; ++i) {
-		struct gameboy_sprite *spr = gb->sprites_sorted[i];
+	// Sprites are drawn from the highest priority down, and each pixel goes
+	// to the first with a visible color there, even if that one then hides
+	// behind the background
+	for (int i = 0; i < gb->line_sprite_counts[y]; ++i) {
+		struct gameboy_sprite *spr = &gb->sprites[gb->line_sprites[y][i]];
 
 		dy = y - spr->y;
-		if (dy >= gb->sprite_size)
-			continue;
 
 		struct gameboy_tile *tile = spr->tile;
 		if (dy > 7)
 			++tile; // 8x16 mode: use next tile
 
-		uint8_t *row = tile->pixels[spr->flipy ? (7 - (dy % 8)) : (dy % 8)];
+		uint16_t row = tile->rows[spr->flipx][spr->flipy ? (7 - (dy % 8)) : (dy % 8)];
 
 		for (int sx = 0; sx < 8; ++sx) {
 			uint8_t dx = spr->x + sx;
@@ -215,41 +376,72 @@ static void render_scanline(struct gameboy *gb)
 			if (dx >= 160)
 				continue;
 
-			uint8_t code = row[spr->flipx ? (7 - sx) : sx];
+			uint8_t code = row_code(row, sx);
 
 			// Sprite color 0 is transparent
-			if (!code)
+			if (!code || (line[dx] & LINE_SPRITE))
 				continue;
 
 			// Low-priority sprites only prevail over bg color 0
-			if (spr->priority && line[dx])
+			bool hidden = spr->priority && line[dx];
+			line[dx] |= LINE_SPRITE;
+			if (hidden)
 				continue;
 
-			line[dx] = code;
-			(*gb->screen)[y][dx] = spr->palette->colors[code];
+			if (gb->screen)
+				(*gb->screen)[y][dx] = spr->palette->colors[code];
+			if (gb->screen_indexed)
+				(*gb->screen_indexed)[y][dx] = (GAMEBOY_SCREEN_OBP + spr->palette_index) << 2 | code;
 		}
+	}
+}
 
-		// TODO: Stop after 10th sprite per scanline
+// Indexed frames are converted with the palettes in effect as they finish;
+// games mostly change them during VBlank, between frames
+static void snapshot_palettes(struct gameboy *gb)
+{
+	for (int i = 0; i < 8; ++i) {
+		memcpy(gb->screen_palettes[GAMEBOY_SCREEN_BGP + i], gb->bgp[i].colors, sizeof(gb->bgp[i].colors));
+		memcpy(gb->screen_palettes[GAMEBOY_SCREEN_OBP + i], gb->obp[i].colors, sizeof(gb->obp[i].colors));
 	}
+
+	for (int i = 0; i < 4; ++i)
+		gb->screen_palettes[GAMEBOY_SCREEN_BLANK][i] = monochrome.colors[0];
 }
 
 static void enter_vblank(struct gameboy *gb)
 {
-	render_debug(gb);
+	PERF_FRAME();
+
+	if (!gb->skip_frame) {
+		PERF_BEGIN(PERF_DEBUG);
+		render_debug(gb);
+		PERF_END();
+
+		if (gb->screen_indexed)
+			snapshot_palettes(gb);
+
+		if (gb->frame_sink.next)
+			gb->screen = gb->frame_sink.next(gb, gb->screen, gb->frame_sink.context);
+	}
 
 	irq_flag(gb, GAMEBOY_IRQ_VBLANK);
 
 	if (gb->stat_on_vblank)
 		irq_flag(gb, GAMEBOY_IRQ_STAT);
 
+	gb->run_exits |= GAMEBOY_RUN_VBLANK;
 	gb_callback(gb, &gb->on_vblank);
+
+	// The callback may have changed frameskip for the frames to come
+	gb->skip_frame = gb->frames_skipped < gb->frameskip;
+	gb->frames_skipped = gb->skip_frame ? gb->frames_skipped + 1 : 0;
 }
 
 void lcd_init(struct gameboy *gb)
 {
-	for (int i = 0; i < 40; ++i)
-		gb->sprites_sorted[i] = &gb->sprites[i];
-	gb->sprites_unsorted = true;
+	gb->sprites_dirty = true;
+	gb->dbg_dirty.all = true;
 
 	gb->sprite_size = 16;
 	lcd_update_sprite_mode(gb, false);
@@ -285,8 +477,10 @@ void lcd_sync(struct gameboy *gb)
 		gb->next_lcd_status_in += 172;
 		break;
 
-	case GAMEBOY_LCD_HBLANK:
+	case GAMEBOY_LCD_HBLANK: {
+		PERF_BEGIN(PERF_RENDER);
 		render_scanline(gb);
+		PERF_END();
 
 		if (gb->hdma_enabled && gb->hdma_blocks_remaining && !gb->gdma)
 			gb->hdma_blocks_queued = 1;
@@ -301,6 +495,7 @@ void lcd_sync(struct gameboy *gb)
 
 		gb->next_lcd_status_in += 204;
 		break;
+	}
 
 	case GAMEBOY_LCD_VBLANK:
 		if (++gb->scanline == 153)
@@ -319,6 +514,11 @@ void lcd_sync(struct gameboy *gb)
 	}
 }
 
+long lcd_next_event(struct gameboy *gb)
+{
+	return gb->lcd_enabled ? gb->next_lcd_status_in : LONG_MAX;
+}
+
 void lcd_enable(struct gameboy *gb)
 {
 	if (gb->lcd_enabled)
@@ -329,6 +529,7 @@ void lcd_enable(struct gameboy *gb)
 	gb->lcd_status = GAMEBOY_LCD_OAM_SEARCH;
 	gb->next_lcd_status = GAMEBOY_LCD_PIXEL_TRANSFER;
 	gb->next_lcd_status_in = gb->cycles + 80;
+	sched_update(gb, GAMEBOY_EVENT_LCD);
 }
 
 void lcd_disable(struct gameboy *gb)
@@ -339,6 +540,7 @@ void lcd_disable(struct gameboy *gb)
 	gb->lcd_enabled = false;
 	gb->lcd_status = GAMEBOY_LCD_HBLANK;
 	gb->scanline = 0;
+	sched_update(gb, GAMEBOY_EVENT_LCD);
 }
 
 void lcd_update_scanline(struct gameboy *gb, uint8_t scanline)
@@ -377,12 +579,12 @@ void lcd_update_sprite(struct gameboy *gb, uint16_t offset, uint8_t val)
 	switch (offset % 4) {
 	case 0:
 		spr->y = val - 16;
-		gb->sprites_unsorted = true;
+		gb->sprites_dirty = true;
 		break;
 
 	case 1:
 		spr->x = val - 8;
-		gb->sprites_unsorted = true;
+		gb->sprites_dirty = true;
 		break;
 
 	case 2:
@@ -413,6 +615,7 @@ void lcd_update_sprite_mode(struct gameboy *gb, bool is_8x16)
 	if (new_sprite_size == gb->sprite_size)
 		return;
 	gb->sprite_size = new_sprite_size;
+	gb->sprites_dirty = true;
 
 	for (int i = 0; i < 40; ++i)
 		lcd_refresh_sprite(gb, &gb->sprites[i]);
@@ -429,16 +632,14 @@ void lcd_update_tile(struct gameboy *gb, uint16_t offset, uint8_t val)
 {
 	struct gameboy_tile *t = &gb->tiles[gb->vram_bank][offset / 16];
 	t->raw[offset % 16] = val;
+	gb->dbg_dirty.tiles[384 * gb->vram_bank + offset / 16] = true;
 
-	uint8_t *row = t->pixels[(offset / 2) % 8];
-	int bit = (offset % 2) ? 0x02 : 0x01;
+	int y = (offset / 2) % 8;
+	uint8_t lo = t->raw[2 * y];
+	uint8_t hi = t->raw[2 * y + 1];
 
-	for (int n = 0; n < 8; ++n) {
-		if (val & (1 << n))
-			row[7-n] |= bit;
-		else
-			row[7-n] &= ~bit;
-	}
+	t->rows[0][y] = spread[0][lo] | spread[0][hi] << 1;
+	t->rows[1][y] = spread[1][lo] | spread[1][hi] << 1;
 }
 
 uint8_t lcd_read_tilemap(struct gameboy *gb, uint16_t offset)
@@ -469,6 +670,7 @@ void lcd_update_tilemap(struct gameboy *gb, uint16_t offset, uint8_t val)
 	struct gameboy_background_cell *cell;
 
 	cell = &gb->tilemaps[offset >= 0x0400].cells_flat[offset % 0x0400];
+	gb->dbg_dirty.cells[offset >= 0x0400][offset % 0x0400] = true;
 
 	if (gb->vram_bank) {
 		cell->raw_flags = val;
@@ -489,9 +691,31 @@ void lcd_update_tilemap_mode(struct gameboy *gb, bool is_signed)
 	if (gb->tilemap_signed == is_signed)
 		return;
 	gb->tilemap_signed = is_signed;
+	gb->dbg_dirty.all = true;
 
 	for (int i = 0; i < 0x0400; ++i)
 		lcd_refresh_tilemap(gb, &gb->tilemaps[0].cells_flat[i]);
 	for (int i = 0; i < 0x0400; ++i)
 		lcd_refresh_tilemap(gb, &gb->tilemaps[1].cells_flat[i]);
 }
+
+// Expands an indexed frame to colors; palettes is a GAMEBOY_SCREEN_PALETTES
+// long snapshot (as in screen_palettes), so each pixel indexes it directly
+void gameboy_convert_frame(const uint8_t (*frame)[144][160], const int (*palettes)[4],
+                           int (*out)[144][160])
+{
+	const uint8_t *in = &(*frame)[0][0];
+	const int *colors = palettes[0];
+	int *px = &(*out)[0][0];
+	size_t count = sizeof(*frame);
+
+#if defined(__AVX2__)
+	for (size_t i = 0; i < count; i += 8) {
+		__m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&in[i]));
+		_mm256_storeu_si256((__m256i *)&px[i], _mm256_i32gather_epi32(colors, index, 4));
+	}
+#else
+	for (size_t i = 0; i < count; ++i)
+		px[i] = colors[in[i]];
+#endif
+}
@@ -6,14 +6,15 @@
 
 void lcd_init(struct gameboy *gb);
 void lcd_sync(struct gameboy *gb);
+long lcd_next_event(struct gameboy *gb);
 
 void lcd_enable(struct gameboy *gb);
 void lcd_disable(struct gameboy *gb);
 
 void lcd_update_scanline(struct gameboy *gb, uint8_t scanline);
 
-void lcd_update_palette_dmg(struct gameboy_palette *p, uint8_t val);
-void lcd_update_palette_gbc(struct gameboy_palette *p, uint8_t index);
+void lcd_update_palette_dmg(struct gameboy *gb, struct gameboy_palette *p, uint8_t val);
+void lcd_update_palette_gbc(struct gameboy *gb, struct gameboy_palette *p, uint8_t index);
 
 uint8_t lcd_read_sprite(struct gameboy *gb, uint16_t offset);
 void lcd_refresh_sprite(struct gameboy *gb, struct gameboy_sprite *spr);
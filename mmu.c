@@ -1,10 +1,14 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #include "apu.h"
+#include "block.h"
+#include "breakpoint.h"
 #include "lcd.h"
 #include "mmu.h"
+#include "scheduler.h"
 #include "timer.h"
 #include "common.h"
 #include <assert.h>
+#include <string.h>
 
 static inline bool is_oam_accessible(struct gameboy *gb)
 {
@@ -16,8 +20,73 @@ static inline bool is_vram_accessible(struct gameboy *gb)
 	return gb->lcd_status <= GAMEBOY_LCD_OAM_SEARCH;
 }
 
+// Pages with watchpoints go through the slow paths, which check them
+static void unmap_watched(struct gameboy *gb, int first, int end)
+{
+	for (int page = first; gb->breakpoints && page < end; ++page) {
+		if (gb->breakpoints->read_pages[page])
+			gb->read_pages[page] = NULL;
+		if (gb->breakpoints->write_pages[page])
+			gb->write_pages[page] = NULL;
+	}
+}
+
+static void remap_romx(struct gameboy *gb)
+{
+	for (int page = 0x40; page < 0x80; ++page)
+		gb->read_pages[page] = gb->rom ? gb->romx + (page - 0x40) * 0x100 : NULL;
+
+	unmap_watched(gb, 0x40, 0x80);
+}
+
+static bool is_sram_mapped(struct gameboy *gb)
+{
+	return gb->sram && gb->sram_enabled && !gb->rtc_status;
+}
+
+static void remap_sram(struct gameboy *gb)
+{
+	bool mapped = is_sram_mapped(gb);
+
+	for (int page = 0xA0; page < 0xC0; ++page) {
+		uint8_t *mem = mapped ? gb->sramx + (page - 0xA0) * 0x100 % gb->sram_size : NULL;
+		gb->read_pages[page] = mem;
+		gb->write_pages[page] = mem;
+	}
+
+	unmap_watched(gb, 0xA0, 0xC0);
+}
+
+static void remap_wramx(struct gameboy *gb)
+{
+	for (int page = 0xD0; page < 0xE0; ++page) {
+		uint8_t *mem = gb->wramx + (page - 0xD0) * 0x100;
+		gb->read_pages[page] = mem;
+		gb->write_pages[page] = mem;
+	}
+
+	unmap_watched(gb, 0xD0, 0xE0);
+}
+
+// MBC register writes only remap the windows whose banks actually changed,
+// since games switch ROM banks constantly
+static void switch_banks(struct gameboy *gb, bool sram_was_mapped)
+{
+	if (gb->romx != gb->rom[gb->rom_bank]) {
+		gb->romx = gb->rom[gb->rom_bank];
+		remap_romx(gb);
+	}
+
+	if (gb->sramx != gb->sram[gb->sram_bank] || is_sram_mapped(gb) != sram_was_mapped) {
+		gb->sramx = gb->sram[gb->sram_bank];
+		remap_sram(gb);
+	}
+}
+
 static void mbc1_write(struct gameboy *gb, uint16_t addr, uint8_t val)
 {
+	bool sram_was_mapped = is_sram_mapped(gb);
+
 	union {
 		struct {
 			uint8_t lo:5;
@@ -64,12 +133,13 @@ static void mbc1_write(struct gameboy *gb, uint16_t addr, uint8_t val)
 		gb->sram_bank = 0;
 	}
 
-	gb->romx = gb->rom[gb->rom_bank];
-	gb->sramx = gb->sram[gb->sram_bank];
+	switch_banks(gb, sram_was_mapped);
 }
 
 static void mbc3_write(struct gameboy *gb, uint16_t addr, uint8_t val)
 {
+	bool sram_was_mapped = is_sram_mapped(gb);
+
 	switch (addr) {
 	case 0x0000 ... 0x1FFF:
 		gb->sram_enabled = gb->sram && (val & 0x0F) == 0x0A;
@@ -105,8 +175,7 @@ static void mbc3_write(struct gameboy *gb, uint16_t addr, uint8_t val)
 		break;
 	}
 
-	gb->romx = gb->rom[gb->rom_bank];
-	gb->sramx = gb->sram[gb->sram_bank];
+	switch_banks(gb, sram_was_mapped);
 }
 
 static uint8_t rtc_read(struct gameboy *gb)
@@ -181,830 +250,1156 @@ static void rtc_write(struct gameboy *gb, uint8_t val)
 	}
 }
 
-uint8_t mmu_read(struct gameboy *gb, uint16_t addr)
+static uint8_t io_read_hram(struct gameboy *gb, uint16_t addr)
 {
-	switch (addr) {
-	case 0x0000 ... 0x00FF:
-		if (gb->boot_enabled)
-			return gb->boot[addr];
-		if (gb->rom)
-			return gb->rom[0][addr];
-		break;
-	case 0x0200 ... 0x08FF:
-		if (gb->boot_enabled && gb->gbc)
-			return gb->boot[addr];
-		if (gb->rom)
-			return gb->rom[0][addr];
-		break;
-	case 0x0100 ... 0x01FF:
-	case 0x0900 ... 0x3FFF:
-		if (gb->rom)
-			return gb->rom[0][addr];
-		break;
+	return gb->hram[addr % 0x0080];
+}
 
-	case 0x4000 ... 0x7FFF:
-		if (gb->rom)
-			return gb->romx[addr % 0x4000];
-		break;
+static uint8_t io_read_ie(struct gameboy *gb, uint16_t addr)
+{
+	return gb->irq_enabled;
+}
 
-	case 0x8000 ... 0x97FF:
-		if (is_vram_accessible(gb))
-			return lcd_read_tile(gb, addr % 0x2000);
-		break;
-	case 0x9800 ... 0x9FFF:
-		if (is_vram_accessible(gb))
-			return lcd_read_tilemap(gb, addr % 0x0800);
-		break;
+static uint8_t io_read_if(struct gameboy *gb, uint16_t addr)
+{
+	return gb->irq_flagged | 0xE0;
+}
 
-	case 0xA000 ... 0xBFFF:
-		if (!gb->sram_enabled)
-			break;
+static uint8_t io_read_p1(struct gameboy *gb, uint16_t addr)
+{
+	if (gb->joypad_status == GAMEBOY_JOYPAD_ARROWS)
+		return gb->p1_arrows;
+	else
+		return gb->p1_buttons;
+}
 
-		if (gb->rtc_status)
-			return rtc_read(gb);
-		else
-			return gb->sramx[addr % 0x2000 % gb->sram_size];
-		break;
+static uint8_t io_read_sb(struct gameboy *gb, uint16_t addr)
+{
+	if (gb->is_serial_pending)
+		GBLOG("Mid-transfer read from SB!");
+	return gb->sb;
+}
 
-	case 0xC000 ... 0xCFFF:
-		return gb->wram[0][addr % 0x1000];
-	case 0xD000 ... 0xDFFF:
-		return gb->wramx[addr % 0x1000];
+static uint8_t io_read_sc(struct gameboy *gb, uint16_t addr)
+{
+	return BITS(1, 6)
+	     | (gb->is_serial_pending ? BIT(7) : 0)
+	     | (gb->is_serial_internal ? BIT(0) : 0);
+}
 
-	case 0xE000 ... 0xFDFF:
-		GBLOG("Bad read from ECHO RAM: %04X", addr);
-		gb->cpu_status = GAMEBOY_CPU_CRASHED;
-		break;
+static uint8_t io_read_div(struct gameboy *gb, uint16_t addr)
+{
+	return ((gb->cycles - gb->div_offset) >> 8) & 0xFF;
+}
 
-	case 0xFE00 ... 0xFE9F:
-		if (is_oam_accessible(gb))
-			return lcd_read_sprite(gb, addr % 0x0100);
-		break;
+static uint8_t io_read_tima(struct gameboy *gb, uint16_t addr)
+{
+	return gb->timer_counter;
+}
 
-	case 0xFF80 ... 0xFFFE:
-		return gb->hram[addr % 0x0080];
+static uint8_t io_read_tma(struct gameboy *gb, uint16_t addr)
+{
+	return gb->timer_modulo;
+}
 
-	case GAMEBOY_ADDR_IE:
-		return gb->irq_enabled;
+static uint8_t io_read_tac(struct gameboy *gb, uint16_t addr)
+{
+	return (gb->timer_frequency_code & 0x03)
+	     | 0xF8 // TODO: Do the unused bits return 0 or 1?
+	     | (gb->timer_enabled ? BIT(2) : 0);
+}
 
-	case GAMEBOY_ADDR_IF:
-		return gb->irq_flagged | 0xE0;
+static uint8_t io_read_lcdc(struct gameboy *gb, uint16_t addr)
+{
+	return (gb->background_enabled ? BIT(0) : 0)
+	     | (gb->sprites_enabled ? BIT(1) : 0)
+	     | (gb->sprite_size == 16 ? BIT(2) : 0)
+	     | (gb->background_tilemap ? BIT(3) : 0)
+	     | (gb->tilemap_signed ? 0 : BIT(4))
+	     | (gb->window_enabled ? BIT(5) : 0)
+	     | (gb->window_tilemap ? BIT(6) : 0)
+	     | (gb->lcd_enabled ? BIT(7) : 0);
+}
 
-	case GAMEBOY_ADDR_P1:
-		if (gb->joypad_status == GAMEBOY_JOYPAD_ARROWS)
-			return gb->p1_arrows;
-		else
-			return gb->p1_buttons;
-
-	case GAMEBOY_ADDR_SB:
-		if (gb->is_serial_pending)
-			GBLOG("Mid-transfer read from SB!");
-		return gb->sb;
-
-	case GAMEBOY_ADDR_SC:
-		return BITS(1, 6)
-		     | (gb->is_serial_pending ? BIT(7) : 0)
-		     | (gb->is_serial_internal ? BIT(0) : 0);
-
-	case GAMEBOY_ADDR_DIV:
-		return ((gb->cycles - gb->div_offset) >> 8) & 0xFF;
-
-	case GAMEBOY_ADDR_TIMA:
-		return gb->timer_counter;
-
-	case GAMEBOY_ADDR_TMA:
-		return gb->timer_modulo;
-
-	case GAMEBOY_ADDR_TAC:
-		return (gb->timer_frequency_code & 0x03)
-		     | 0xF8 // TODO: Do the unused bits return 0 or 1?
-		     | (gb->timer_enabled ? BIT(2) : 0);
-
-	case GAMEBOY_ADDR_LCDC:
-		return (gb->background_enabled ? BIT(0) : 0)
-		     | (gb->sprites_enabled ? BIT(1) : 0)
-		     | (gb->sprite_size == 16 ? BIT(2) : 0)
-		     | (gb->background_tilemap ? BIT(3) : 0)
-		     | (gb->tilemap_signed ? 0 : BIT(4))
-		     | (gb->window_enabled ? BIT(5) : 0)
-		     | (gb->window_tilemap ? BIT(6) : 0)
-		     | (gb->lcd_enabled ? BIT(7) : 0);
-
-	case GAMEBOY_ADDR_STAT:
-		return gb->lcd_enabled ? gb->lcd_status : 0
-		     | (gb->scanline == gb->scanline_compare) ? BIT(2) : 0
-		     | gb->stat_on_hblank ? BIT(3) : 0
-		     | gb->stat_on_vblank ? BIT(4) : 0
-		     | gb->stat_on_oam_search ? BIT(5) : 0
-		     | gb->stat_on_scanline ? BIT(6) : 0
-		     | BIT(7);
-
-	case GAMEBOY_ADDR_LY:
-		return gb->scanline;
-
-	case GAMEBOY_ADDR_LYC:
-		return gb->scanline_compare;
-
-	case GAMEBOY_ADDR_SCY:
-		return gb->sy;
-
-	case GAMEBOY_ADDR_SCX:
-		return gb->sx;
-
-	case GAMEBOY_ADDR_WY:
-		return gb->wy;
-
-	case GAMEBOY_ADDR_WX:
-		return gb->wx + 7;
-
-	case GAMEBOY_ADDR_BGP:
-		return gb->bgp[0].raw[0];
-
-	case GAMEBOY_ADDR_OBP0:
-		return gb->obp[0].raw[0];
-
-	case GAMEBOY_ADDR_OBP1:
-		return gb->obp[1].raw[0];
-
-	case GAMEBOY_ADDR_NR10:
-		return gb->sq1.sweep.shift
-		     | (gb->sq1.sweep.delta < 0 ? BIT(3) : 0)
-		     | (gb->sq1.sweep.sweeps_max << 4)
-		     | BIT(7);
-
-	case GAMEBOY_ADDR_NR11:
-		return BITS(0, 5)
-		     | (gb->sq1.duty << 6);
-
-	case GAMEBOY_ADDR_NR12:
-		return gb->sq1.envelope.clocks_max
-		     | (gb->sq1.envelope.delta > 0 ? BIT(3) : 0)
-		     | (gb->sq1.envelope.volume_max << 4);
-
-	case GAMEBOY_ADDR_NR13:
-		return BITS(0, 7);
-
-	case GAMEBOY_ADDR_NR14:
-		return BITS(0, 2) // Write-only frequency
-		     | BITS(3, 5) // Undefined
-		     | (gb->sq1.length.is_terminal ? BIT(6) : 0)
-		     | BIT(7);
-
-	case GAMEBOY_ADDR_NR21:
-		return BITS(0, 5)
-		     | (gb->sq2.duty << 6);
-
-	case GAMEBOY_ADDR_NR22:
-		return gb->sq2.envelope.clocks_max
-		     | (gb->sq2.envelope.delta > 0 ? BIT(3) : 0)
-		     | (gb->sq2.envelope.volume_max << 4);
-
-	case GAMEBOY_ADDR_NR23:
-		return BITS(0, 7);
-
-	case GAMEBOY_ADDR_NR24:
-		return BITS(0, 2) // Write-only frequency
-		     | BITS(3, 5) // Undefined
-		     | (gb->sq2.length.is_terminal ? BIT(6) : 0)
-		     | BIT(7);
-
-	case GAMEBOY_ADDR_NR30:
-		return BITS(0, 6)
-		     | (gb->wave.super.dac ? BIT(7) : 0);
-
-	case GAMEBOY_ADDR_NR31:
-		return BITS(0, 7); // Pretty sure this is write-only?
-
-	case GAMEBOY_ADDR_NR32:
-		switch (gb->wave.volume_shift) {
-		case 0: return BITS(0, 4) | (1 << 5) | BIT(7);
-		case 1: return BITS(0, 4) | (2 << 5) | BIT(7);
-		case 2: return BITS(0, 4) | (3 << 5) | BIT(7);
-		case 4: return BITS(0, 4) | (0 << 5) | BIT(7);
-		}
-		GBLOG("Invalid wave volume shift: %d", gb->wave.volume_shift);
-		break;
+static uint8_t io_read_stat(struct gameboy *gb, uint16_t addr)
+{
+	return gb->lcd_enabled ? gb->lcd_status : 0
+	     | (gb->scanline == gb->scanline_compare) ? BIT(2) : 0
+	     | gb->stat_on_hblank ? BIT(3) : 0
+	     | gb->stat_on_vblank ? BIT(4) : 0
+	     | gb->stat_on_oam_search ? BIT(5) : 0
+	     | gb->stat_on_scanline ? BIT(6) : 0
+	     | BIT(7);
+}
 
-	case GAMEBOY_ADDR_NR33:
-		return BITS(0, 7);
+static uint8_t io_read_ly(struct gameboy *gb, uint16_t addr)
+{
+	return gb->scanline;
+}
 
-	case GAMEBOY_ADDR_NR34:
-		return BITS(0, 2) // Write-only frequency
-		     | BITS(3, 5) // Undefined
-		     | (gb->wave.length.is_terminal ? BIT(6) : 0)
-		     | BIT(7);
+static uint8_t io_read_lyc(struct gameboy *gb, uint16_t addr)
+{
+	return gb->scanline_compare;
+}
 
-	case 0xFF30 ... 0xFF3F:
-	{
-		uint8_t offset = (addr % 0x10) * 2;
-		return (gb->wave.samples[offset] << 4) | gb->wave.samples[offset + 1];
-	}
+static uint8_t io_read_scy(struct gameboy *gb, uint16_t addr)
+{
+	return gb->sy;
+}
 
-	case GAMEBOY_ADDR_NR41:
-		return BITS(0, 5) // TODO: W or R/W?
-		     | BITS(6, 7);
-
-	case GAMEBOY_ADDR_NR42:
-		return gb->noise.envelope.clocks_max
-		     | (gb->noise.envelope.delta > 0 ? BIT(3) : 0)
-		     | (gb->noise.envelope.volume_max << 4);
-
-	case GAMEBOY_ADDR_NR43:
-		return gb->noise.divisor
-		     | (gb->noise.lfsr_mask == 0x4040 ? BIT(3) : 0)
-		     | (gb->noise.shift << 4);
-
-	case GAMEBOY_ADDR_NR44:
-		return BITS(0, 2) // Write-only frequency
-		     | BITS(3, 5) // Undefined
-		     | (gb->noise.length.is_terminal ? BIT(6) : 0)
-		     | BIT(7);
-
-	case GAMEBOY_ADDR_NR50:
-		return gb->so1_volume
-		     | (gb->so1_vin ? BIT(3) : 0)
-		     | (gb->so2_volume << 4)
-		     | (gb->so2_vin ? BIT(7) : 0);
-
-	case GAMEBOY_ADDR_NR51:
-		return (gb->sq1.super.output_left ? BIT(0) : 0)
-		     | (gb->sq2.super.output_left ? BIT(1) : 0)
-		     | (gb->wave.super.output_left ? BIT(2) : 0)
-		     | (gb->noise.super.output_left ? BIT(3) : 0)
-		     | (gb->sq1.super.output_right ? BIT(4) : 0)
-		     | (gb->sq2.super.output_right ? BIT(5) : 0)
-		     | (gb->wave.super.output_right ? BIT(6) : 0)
-		     | (gb->noise.super.output_right ? BIT(7) : 0);
-
-	case GAMEBOY_ADDR_NR52:
-		return (gb->sq1.super.enabled ? BIT(0) : 0)
-		     | (gb->sq2.super.enabled ? BIT(1) : 0)
-		     | (gb->wave.super.enabled ? BIT(2) : 0)
-		     | (gb->noise.super.enabled ? BIT(3) : 0)
-		     | BITS(4, 6)
-		     | (gb->apu_enabled ? BIT(7) : 0);
-
-	case GAMEBOY_ADDR_KEY1:
-		if (!gb->gbc)
-			break;
-		return (gb->double_speed_switch ? BIT(0) : 0)
-		     | BITS(1, 6)
-		     | (gb->double_speed ? BIT(7) : 0);
+static uint8_t io_read_scx(struct gameboy *gb, uint16_t addr)
+{
+	return gb->sx;
+}
 
-	case GAMEBOY_ADDR_VBK:
-		if (gb->gbc)
-			return 0xFE | gb->vram_bank;
-		break;
+static uint8_t io_read_wy(struct gameboy *gb, uint16_t addr)
+{
+	return gb->wy;
+}
 
-	case GAMEBOY_ADDR_HDMA1:
-	case GAMEBOY_ADDR_HDMA2:
-	case GAMEBOY_ADDR_HDMA3:
-	case GAMEBOY_ADDR_HDMA4:
-		// TCAGBD: "Always returns FFh when read"
-		break;
+static uint8_t io_read_wx(struct gameboy *gb, uint16_t addr)
+{
+	return gb->wx + 7;
+}
 
-	case GAMEBOY_ADDR_HDMA5:
-		if (!gb->gbc)
-			break;
+static uint8_t io_read_bgp(struct gameboy *gb, uint16_t addr)
+{
+	return gb->bgp[0].raw[0];
+}
 
-		if (!gb->hdma_enabled)
-			return 0xFF;
+static uint8_t io_read_obp0(struct gameboy *gb, uint16_t addr)
+{
+	return gb->obp[0].raw[0];
+}
 
-		return ((gb->hdma_blocks_remaining - 1) & BITS(0, 6))
-		     | (gb->gdma ? 0 : BIT(7));
+static uint8_t io_read_obp1(struct gameboy *gb, uint16_t addr)
+{
+	return gb->obp[1].raw[0];
+}
 
-	case GAMEBOY_ADDR_BGPI:
-		if (!gb->gbc)
-			break;
-		return (gb->bgp_index & BITS(0, 5))
-		     | BIT(6)
-		     | (gb->bgp_increment ? BIT(7) : 0);
+static uint8_t io_read_nr10(struct gameboy *gb, uint16_t addr)
+{
+	return gb->sq1.sweep.shift
+	     | (gb->sq1.sweep.delta < 0 ? BIT(3) : 0)
+	     | (gb->sq1.sweep.sweeps_max << 4)
+	     | BIT(7);
+}
 
-	case GAMEBOY_ADDR_BGPD:
-		if (!gb->gbc)
-			break;
-		return gb->bgp[gb->bgp_index / 8].raw[gb->bgp_index % 8];
+static uint8_t io_read_nr11(struct gameboy *gb, uint16_t addr)
+{
+	return BITS(0, 5)
+	     | (gb->sq1.duty << 6);
+}
 
-	case GAMEBOY_ADDR_OBPI:
-		if (!gb->gbc)
-			break;
-		return (gb->obp_index & BITS(0, 5))
-		     | BIT(6)
-		     | (gb->obp_increment ? BIT(7) : 0);
+static uint8_t io_read_nr12(struct gameboy *gb, uint16_t addr)
+{
+	return gb->sq1.envelope.clocks_max
+	     | (gb->sq1.envelope.delta > 0 ? BIT(3) : 0)
+	     | (gb->sq1.envelope.volume_max << 4);
+}
 
-	case GAMEBOY_ADDR_OBPD:
-		if (!gb->gbc)
-			break;
-		return gb->obp[gb->obp_index / 8].raw[gb->obp_index % 8];
+static uint8_t io_read_nr13(struct gameboy *gb, uint16_t addr)
+{
+	return BITS(0, 7);
+}
 
-	case GAMEBOY_ADDR_SVBK:
-		if (gb->gbc)
-			return gb->wram_bank | BITS(3, 7);
-		break;
-	}
+static uint8_t io_read_nr14(struct gameboy *gb, uint16_t addr)
+{
+	return BITS(0, 2) // Write-only frequency
+	     | BITS(3, 5) // Undefined
+	     | (gb->sq1.length.is_terminal ? BIT(6) : 0)
+	     | BIT(7);
+}
 
-	return 0xFF; // "Undefined" read
+static uint8_t io_read_nr21(struct gameboy *gb, uint16_t addr)
+{
+	return BITS(0, 5)
+	     | (gb->sq2.duty << 6);
 }
 
-void mmu_write(struct gameboy *gb, uint16_t addr, uint8_t val)
+static uint8_t io_read_nr22(struct gameboy *gb, uint16_t addr)
 {
-	switch (addr) {
-	case 0x0000 ... 0x7FFF:
-		switch (gb->mbc) {
-		case GAMEBOY_MBC_NONE:
-			break;
-		case GAMEBOY_MBC_MBC1:
-			mbc1_write(gb, addr, val);
-			break;
-		case GAMEBOY_MBC_MBC3:
-			mbc3_write(gb, addr, val);
-			break;
-		case GAMEBOY_MBC_MBC2:
-		case GAMEBOY_MBC_MMM01:
-		case GAMEBOY_MBC_MBC5:
-		case GAMEBOY_MBC_MBC6:
-		case GAMEBOY_MBC_MBC7:
-		case GAMEBOY_MBC_HUC1:
-		case GAMEBOY_MBC_HUC3:
-		case GAMEBOY_MBC_TAMA5:
-		case GAMEBOY_MBC_CAMERA:
-			GBLOG("MBC $%d not yet implemented", gb->mbc);
-			gb->cpu_status = GAMEBOY_CPU_CRASHED;
-			break;
-		}
-		break;
+	return gb->sq2.envelope.clocks_max
+	     | (gb->sq2.envelope.delta > 0 ? BIT(3) : 0)
+	     | (gb->sq2.envelope.volume_max << 4);
+}
 
-	case 0x8000 ... 0x97FF:
-		if (is_vram_accessible(gb))
-			lcd_update_tile(gb, addr % 0x2000, val);
-		break;
-	case 0x9800 ... 0x9FFF:
-		if (is_vram_accessible(gb))
-			lcd_update_tilemap(gb, addr % 0x0800, val);
-		break;
+static uint8_t io_read_nr23(struct gameboy *gb, uint16_t addr)
+{
+	return BITS(0, 7);
+}
 
-	case 0xA000 ... 0xBFFF:
-		if (!gb->sram_enabled)
-			break;
+static uint8_t io_read_nr24(struct gameboy *gb, uint16_t addr)
+{
+	return BITS(0, 2) // Write-only frequency
+	     | BITS(3, 5) // Undefined
+	     | (gb->sq2.length.is_terminal ? BIT(6) : 0)
+	     | BIT(7);
+}
 
-		if (gb->rtc_status)
-			rtc_write(gb, val);
-		else
-			gb->sramx[addr % 0x2000 % gb->sram_size] = val;
-		break;
+static uint8_t io_read_nr30(struct gameboy *gb, uint16_t addr)
+{
+	return BITS(0, 6)
+	     | (gb->wave.super.dac ? BIT(7) : 0);
+}
 
-	case 0xC000 ... 0xCFFF:
-		gb->wram[0][addr % 0x1000] = val;
-		break;
-	case 0xD000 ... 0xDFFF:
-		gb->wramx[addr % 0x1000] = val;
-		break;
+static uint8_t io_read_nr31(struct gameboy *gb, uint16_t addr)
+{
+	return BITS(0, 7); // Pretty sure this is write-only?
+}
 
-	case 0xE000 ... 0xFDFF:
-		GBLOG("Bad write to ECHO RAM: %02X => %04X", val, addr);
-		gb->cpu_status = GAMEBOY_CPU_CRASHED;
-		break;
+static uint8_t io_read_nr32(struct gameboy *gb, uint16_t addr)
+{
+	switch (gb->wave.volume_shift) {
+	case 0: return BITS(0, 4) | (1 << 5) | BIT(7);
+	case 1: return BITS(0, 4) | (2 << 5) | BIT(7);
+	case 2: return BITS(0, 4) | (3 << 5) | BIT(7);
+	case 4: return BITS(0, 4) | (0 << 5) | BIT(7);
+	}
+	GBLOG("Invalid wave volume shift: %d", gb->wave.volume_shift);
+	return 0xFF;
+}
 
-	case 0xFE00 ... 0xFE9F:
-		if (is_oam_accessible(gb))
-			lcd_update_sprite(gb, addr % 0x0100, val);
-		break;
+static uint8_t io_read_nr33(struct gameboy *gb, uint16_t addr)
+{
+	return BITS(0, 7);
+}
 
-	case 0xFF80 ... 0xFFFE:
-		gb->hram[addr % 0x0080] = val;
-		break;
+static uint8_t io_read_nr34(struct gameboy *gb, uint16_t addr)
+{
+	return BITS(0, 2) // Write-only frequency
+	     | BITS(3, 5) // Undefined
+	     | (gb->wave.length.is_terminal ? BIT(6) : 0)
+	     | BIT(7);
+}
 
-	case GAMEBOY_ADDR_IE:
-		gb->irq_enabled = val;
-		break;
+static uint8_t io_read_wave_ram(struct gameboy *gb, uint16_t addr)
+{
+	uint8_t offset = (addr % 0x10) * 2;
+	return (gb->wave.samples[offset] << 4) | gb->wave.samples[offset + 1];
+}
 
-	case GAMEBOY_ADDR_IF:
-		gb->irq_flagged = val & 0x1F;
-		break;
+static uint8_t io_read_nr41(struct gameboy *gb, uint16_t addr)
+{
+	return BITS(0, 5) // TODO: W or R/W?
+	     | BITS(6, 7);
+}
 
-	case GAMEBOY_ADDR_P1:
-		// The arrow and button lines correspond to bits 4 and 5
-		// respectively.  An _unset_ bit selects the line.
-		// TODO: How should this behave if both bits are set or
-		//       neither bit is set?
-		if (val & BIT(5))
-			gb->joypad_status = GAMEBOY_JOYPAD_ARROWS;
-		else
-			gb->joypad_status = GAMEBOY_JOYPAD_BUTTONS;
-		break;
+static uint8_t io_read_nr42(struct gameboy *gb, uint16_t addr)
+{
+	return gb->noise.envelope.clocks_max
+	     | (gb->noise.envelope.delta > 0 ? BIT(3) : 0)
+	     | (gb->noise.envelope.volume_max << 4);
+}
 
-	case GAMEBOY_ADDR_SB:
-		if (gb->is_serial_pending)
-			GBLOG("Mid-transfer write to SB!");
-		gb->sb = val;
-		break;
+static uint8_t io_read_nr43(struct gameboy *gb, uint16_t addr)
+{
+	return gb->noise.divisor
+	     | (gb->noise.lfsr_mask == 0x4040 ? BIT(3) : 0)
+	     | (gb->noise.shift << 4);
+}
 
-	case GAMEBOY_ADDR_SC:
-		if (gb->is_serial_pending)
-			GBLOG("Mid-transfer write to SC!");
+static uint8_t io_read_nr44(struct gameboy *gb, uint16_t addr)
+{
+	return BITS(0, 2) // Write-only frequency
+	     | BITS(3, 5) // Undefined
+	     | (gb->noise.length.is_terminal ? BIT(6) : 0)
+	     | BIT(7);
+}
 
-		gb->is_serial_internal = !!(val & BIT(0));
+static uint8_t io_read_nr50(struct gameboy *gb, uint16_t addr)
+{
+	return gb->so1_volume
+	     | (gb->so1_vin ? BIT(3) : 0)
+	     | (gb->so2_volume << 4)
+	     | (gb->so2_vin ? BIT(7) : 0);
+}
 
-		if (!gb->is_serial_pending && gb->is_serial_internal && (val & BIT(7))) {
-			if (gb->on_serial_start.callback)
-				gb_callback(gb, &gb->on_serial_start);
-			else
-				// Disconnected serial cables still "send" this
-				gameboy_start_serial(gb, 0xFF);
-		}
-		break;
+static uint8_t io_read_nr51(struct gameboy *gb, uint16_t addr)
+{
+	return (gb->sq1.super.output_left ? BIT(0) : 0)
+	     | (gb->sq2.super.output_left ? BIT(1) : 0)
+	     | (gb->wave.super.output_left ? BIT(2) : 0)
+	     | (gb->noise.super.output_left ? BIT(3) : 0)
+	     | (gb->sq1.super.output_right ? BIT(4) : 0)
+	     | (gb->sq2.super.output_right ? BIT(5) : 0)
+	     | (gb->wave.super.output_right ? BIT(6) : 0)
+	     | (gb->noise.super.output_right ? BIT(7) : 0);
+}
 
-	case GAMEBOY_ADDR_DIV:
-		gb->div_offset = gb->cycles;
+static uint8_t io_read_nr52(struct gameboy *gb, uint16_t addr)
+{
+	return (gb->sq1.super.enabled ? BIT(0) : 0)
+	     | (gb->sq2.super.enabled ? BIT(1) : 0)
+	     | (gb->wave.super.enabled ? BIT(2) : 0)
+	     | (gb->noise.super.enabled ? BIT(3) : 0)
+	     | BITS(4, 6)
+	     | (gb->apu_enabled ? BIT(7) : 0);
+}
 
-		gb->next_apu_frame_in = gb->cycles + 8192;
-		gb->next_timer_in = gb->cycles + gb->timer_frequency_cycles;
-		break;
+static uint8_t io_read_key1(struct gameboy *gb, uint16_t addr)
+{
+	return (gb->double_speed_switch ? BIT(0) : 0)
+	     | BITS(1, 6)
+	     | (gb->double_speed ? BIT(7) : 0);
+}
 
-	case GAMEBOY_ADDR_TIMA:
-		gb->timer_counter = val;
-		break;
+static uint8_t io_read_vbk(struct gameboy *gb, uint16_t addr)
+{
+	return 0xFE | gb->vram_bank;
+}
 
-	case GAMEBOY_ADDR_TMA:
-		gb->timer_modulo = val;
-		break;
+static uint8_t io_read_hdma5(struct gameboy *gb, uint16_t addr)
+{
+	if (!gb->hdma_enabled)
+		return 0xFF;
 
-	case GAMEBOY_ADDR_TAC:
-		gb->timer_enabled = !!(val & BIT(2));
-		timer_set_frequency(gb, val & 0x03);
-		break;
+	return ((gb->hdma_blocks_remaining - 1) & BITS(0, 6))
+	     | (gb->gdma ? 0 : BIT(7));
+}
 
-	case GAMEBOY_ADDR_NR10:
-		gb->sq1.sweep.shift = val & BITS(0, 2);
-		gb->sq1.sweep.delta = (val & BIT(3)) ? -1 : 1;
-		gb->sq1.sweep.sweeps_max = (val & BITS(4, 6)) >> 4;
-		break;
+static uint8_t io_read_bgpi(struct gameboy *gb, uint16_t addr)
+{
+	return (gb->bgp_index & BITS(0, 5))
+	     | BIT(6)
+	     | (gb->bgp_increment ? BIT(7) : 0);
+}
 
-	case GAMEBOY_ADDR_NR11:
-		gb->sq1.duty = (val & BITS(6, 7)) >> 6;
-		gb->sq1.length.clocks_remaining = gb->sq1.length.clocks_max - (val & BITS(0, 5));
-		break;
+static uint8_t io_read_bgpd(struct gameboy *gb, uint16_t addr)
+{
+	return gb->bgp[gb->bgp_index / 8].raw[gb->bgp_index % 8];
+}
 
-	case GAMEBOY_ADDR_NR12:
-		gb->sq1.envelope.clocks_max = val & BITS(0, 2);
-		gb->sq1.envelope.delta = (val & BIT(3)) ? 1 : -1;
-		gb->sq1.envelope.volume_max = (val & BITS(4, 7)) >> 4;
+static uint8_t io_read_obpi(struct gameboy *gb, uint16_t addr)
+{
+	return (gb->obp_index & BITS(0, 5))
+	     | BIT(6)
+	     | (gb->obp_increment ? BIT(7) : 0);
+}
 
-		gb->sq1.super.dac = !!(val & BITS(3, 7));
-		if (!gb->sq1.super.dac)
-			gb->sq1.super.enabled = false;
-		break;
+static uint8_t io_read_obpd(struct gameboy *gb, uint16_t addr)
+{
+	return gb->obp[gb->obp_index / 8].raw[gb->obp_index % 8];
+}
 
-	case GAMEBOY_ADDR_NR13:
-		gb->sq1.super.frequency &= BITS(8, 10);
-		gb->sq1.super.frequency |= val;
+static uint8_t io_read_svbk(struct gameboy *gb, uint16_t addr)
+{
+	return gb->wram_bank | BITS(3, 7);
+}
 
-		gb->sq1.super.period = 4 * (2048 - gb->sq1.super.frequency);
-		break;
+static void io_write_hram(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->hram[addr % 0x0080] = val;
+	block_notify_write(gb, addr);
+}
 
-	case GAMEBOY_ADDR_NR14:
-		gb->sq1.super.frequency &= 0xFF;
-		gb->sq1.super.frequency |= ((val & BITS(0, 2)) << 8);
+static void io_write_ie(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->irq_enabled = val;
+}
 
-		gb->sq1.super.period = 4 * (2048 - gb->sq1.super.frequency);
+static void io_write_if(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->irq_flagged = val & 0x1F;
+}
 
-		gb->sq1.length.is_terminal = !!(val & BIT(6));
-		if (val & BIT(7))
-			apu_trigger_square(gb, &gb->sq1);
-		break;
+static void io_write_p1(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	// The arrow and button lines correspond to bits 4 and 5
+	// respectively.  An _unset_ bit selects the line.
+	// TODO: How should this behave if both bits are set or
+	//       neither bit is set?
+	if (val & BIT(5))
+		gb->joypad_status = GAMEBOY_JOYPAD_ARROWS;
+	else
+		gb->joypad_status = GAMEBOY_JOYPAD_BUTTONS;
+}
 
-	case GAMEBOY_ADDR_NR21:
-		gb->sq2.duty = (val & BITS(6, 7)) >> 6;
-		gb->sq2.length.clocks_remaining = gb->sq2.length.clocks_max - (val & BITS(0, 5));
-		break;
+static void io_write_sb(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	if (gb->is_serial_pending)
+		GBLOG("Mid-transfer write to SB!");
+	gb->sb = val;
+}
 
-	case GAMEBOY_ADDR_NR22:
-		gb->sq2.envelope.clocks_max = val & BITS(0, 2);
-		gb->sq2.envelope.delta = (val & BIT(3)) ? 1 : -1;
-		gb->sq2.envelope.volume_max = (val & BITS(4, 7)) >> 4;
+static void io_write_sc(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	if (gb->is_serial_pending)
+		GBLOG("Mid-transfer write to SC!");
 
-		gb->sq2.super.dac = !!(val & BITS(3, 7));
-		if (!gb->sq2.super.dac)
-			gb->sq2.super.enabled = false;
-		break;
+	gb->is_serial_internal = !!(val & BIT(0));
 
-	case GAMEBOY_ADDR_NR23:
-		gb->sq2.super.frequency &= BITS(8, 10);
-		gb->sq2.super.frequency |= val;
+	if (!gb->is_serial_pending && gb->is_serial_internal && (val & BIT(7))) {
+		if (gb->on_serial_start.callback)
+			gb_callback(gb, &gb->on_serial_start);
+		else
+			// Disconnected serial cables still "send" this
+			gameboy_start_serial(gb, 0xFF);
+	}
+}
 
-		gb->sq2.super.period = 4 * (2048 - gb->sq2.super.frequency);
-		break;
+static void io_write_div(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->div_offset = gb->cycles;
 
-	case GAMEBOY_ADDR_NR24:
-		gb->sq2.super.frequency &= 0xFF;
-		gb->sq2.super.frequency |= ((val & BITS(0, 2)) << 8);
+	gb->next_apu_frame_in = gb->cycles + 8192;
+	gb->next_timer_in = gb->cycles + gb->timer_frequency_cycles;
 
-		gb->sq2.super.period = 4 * (2048 - gb->sq2.super.frequency);
+	sched_update(gb, GAMEBOY_EVENT_APU);
+	sched_update(gb, GAMEBOY_EVENT_TIMER);
+}
 
-		gb->sq2.length.is_terminal = !!(val & BIT(6));
-		if (val & BIT(7))
-			apu_trigger_square(gb, &gb->sq2);
-		break;
+static void io_write_tima(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->timer_counter = val;
+}
 
-	case GAMEBOY_ADDR_NR30:
-		gb->wave.super.dac = !!(val & BIT(7));
-		if (!gb->wave.super.dac)
-			gb->wave.super.enabled = false;
-		break;
+static void io_write_tma(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->timer_modulo = val;
+}
 
-	case GAMEBOY_ADDR_NR31:
-		gb->wave.length.clocks_remaining = gb->wave.length.clocks_max - val;
-		break;
+static void io_write_tac(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->timer_enabled = !!(val & BIT(2));
+	timer_set_frequency(gb, val & 0x03);
+	sched_update(gb, GAMEBOY_EVENT_TIMER);
+}
+
+static void io_write_nr10(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->sq1.sweep.shift = val & BITS(0, 2);
+	gb->sq1.sweep.delta = (val & BIT(3)) ? -1 : 1;
+	gb->sq1.sweep.sweeps_max = (val & BITS(4, 6)) >> 4;
+}
+
+static void io_write_nr11(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->sq1.duty = (val & BITS(6, 7)) >> 6;
+	gb->sq1.length.clocks_remaining = gb->sq1.length.clocks_max - (val & BITS(0, 5));
+}
+
+static void io_write_nr12(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->sq1.envelope.clocks_max = val & BITS(0, 2);
+	gb->sq1.envelope.delta = (val & BIT(3)) ? 1 : -1;
+	gb->sq1.envelope.volume_max = (val & BITS(4, 7)) >> 4;
+
+	gb->sq1.super.dac = !!(val & BITS(3, 7));
+	if (!gb->sq1.super.dac)
+		gb->sq1.super.enabled = false;
+}
+
+static void io_write_nr13(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->sq1.super.frequency &= BITS(8, 10);
+	gb->sq1.super.frequency |= val;
+
+	gb->sq1.super.period = 4 * (2048 - gb->sq1.super.frequency);
+}
+
+static void io_write_nr14(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->sq1.super.frequency &= 0xFF;
+	gb->sq1.super.frequency |= ((val & BITS(0, 2)) << 8);
+
+	gb->sq1.super.period = 4 * (2048 - gb->sq1.super.frequency);
+
+	gb->sq1.length.is_terminal = !!(val & BIT(6));
+	if (val & BIT(7))
+		apu_trigger_square(gb, &gb->sq1);
+}
+
+static void io_write_nr21(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->sq2.duty = (val & BITS(6, 7)) >> 6;
+	gb->sq2.length.clocks_remaining = gb->sq2.length.clocks_max - (val & BITS(0, 5));
+}
+
+static void io_write_nr22(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->sq2.envelope.clocks_max = val & BITS(0, 2);
+	gb->sq2.envelope.delta = (val & BIT(3)) ? 1 : -1;
+	gb->sq2.envelope.volume_max = (val & BITS(4, 7)) >> 4;
+
+	gb->sq2.super.dac = !!(val & BITS(3, 7));
+	if (!gb->sq2.super.dac)
+		gb->sq2.super.enabled = false;
+}
+
+static void io_write_nr23(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->sq2.super.frequency &= BITS(8, 10);
+	gb->sq2.super.frequency |= val;
+
+	gb->sq2.super.period = 4 * (2048 - gb->sq2.super.frequency);
+}
+
+static void io_write_nr24(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->sq2.super.frequency &= 0xFF;
+	gb->sq2.super.frequency |= ((val & BITS(0, 2)) << 8);
+
+	gb->sq2.super.period = 4 * (2048 - gb->sq2.super.frequency);
+
+	gb->sq2.length.is_terminal = !!(val & BIT(6));
+	if (val & BIT(7))
+		apu_trigger_square(gb, &gb->sq2);
+}
+
+static void io_write_nr30(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->wave.super.dac = !!(val & BIT(7));
+	if (!gb->wave.super.dac)
+		gb->wave.super.enabled = false;
+}
+
+static void io_write_nr31(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->wave.length.clocks_remaining = gb->wave.length.clocks_max - val;
+}
+
+static void io_write_nr32(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	switch ((val & BITS(5, 6)) >> 5) {
+	case 0: gb->wave.volume_shift = 4; break; // Effectively mute
+	case 1: gb->wave.volume_shift = 0; break;
+	case 2: gb->wave.volume_shift = 1; break;
+	case 3: gb->wave.volume_shift = 2; break;
+	}
+}
+
+static void io_write_nr33(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->wave.super.frequency &= BITS(8, 10);
+	gb->wave.super.frequency |= val;
+
+	gb->wave.super.period = 2 * (2048 - gb->wave.super.frequency);
+}
+
+static void io_write_nr34(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->wave.super.frequency &= 0xFF;
+	gb->wave.super.frequency |= ((val & BITS(0, 2)) << 8);
+
+	gb->wave.super.period = 2 * (2048 - gb->wave.super.frequency);
+
+	gb->wave.length.is_terminal = !!(val & BIT(6));
+	if (val & BIT(7))
+		apu_trigger_wave(gb, &gb->wave);
+}
+
+static void io_write_nr41(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->noise.length.clocks_remaining = gb->noise.length.clocks_max - (val & BITS(0, 5));
+}
+
+static void io_write_nr42(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->noise.envelope.clocks_max = val & BITS(0, 2);
+	gb->noise.envelope.delta = (val & BIT(3)) ? 1 : -1;
+	gb->noise.envelope.volume_max = (val & BITS(4, 7)) >> 4;
+
+	gb->noise.super.dac = !!(val & BITS(3, 7));
+	if (!gb->noise.super.dac)
+		gb->noise.super.enabled = false;
+}
+
+static void io_write_nr43(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->noise.divisor = (val & BITS(0, 2));
+	gb->noise.lfsr_mask = (val & BIT(3)) ? 0x4040 : 0x4000;
+	gb->noise.shift = (val & BITS(4, 7)) >> 4;
+
+	if (gb->noise.shift >= 14)
+		GBLOG("Invalid LFSR shift: %d", gb->noise.shift);
+
+	gb->noise.super.period = ((gb->noise.divisor * 16) ?: 8) << (gb->noise.shift);
+}
+
+static void io_write_nr44(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->noise.length.is_terminal = !!(val & BIT(6));
+	if (val & BIT(7))
+		apu_trigger_noise(gb, &gb->noise);
+}
+
+static void io_write_nr50(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->so1_volume = (val & BITS(0, 2));
+	gb->so2_volume = (val & BITS(4, 6)) >> 4;
+	gb->so1_vin = !!(val & BIT(3));
+	gb->so2_vin = !!(val & BIT(7));
+}
+
+static void io_write_nr51(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->sq1.super.output_left = !!(val & BIT(0));
+	gb->sq2.super.output_left = !!(val & BIT(1));
+	gb->wave.super.output_left = !!(val & BIT(2));
+	gb->noise.super.output_left = !!(val & BIT(3));
+
+	gb->sq1.super.output_right = !!(val & BIT(4));
+	gb->sq2.super.output_right = !!(val & BIT(5));
+	gb->wave.super.output_right = !!(val & BIT(6));
+	gb->noise.super.output_right = !!(val & BIT(7));
+}
+
+static void io_write_nr52(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	if (val & BIT(7))
+		apu_enable(gb);
+	else
+		apu_disable(gb);
+}
+
+static void io_write_wave_ram(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	uint8_t offset = (addr % 0x10) * 2;
+	gb->wave.samples[offset + 0] = val >> 4;
+	gb->wave.samples[offset + 1] = val & 0x0F;
+}
+
+static void io_write_lcdc(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->background_enabled = (val & BIT(0));
+	gb->sprites_enabled = (val & BIT(1));
+	lcd_update_sprite_mode(gb, val & BIT(2));
+	gb->background_tilemap = !!(val & BIT(3));
+	lcd_update_tilemap_mode(gb, !(val & BIT(4)));
+	gb->window_enabled = (val & BIT(5));
+	gb->window_tilemap = !!(val & BIT(6));
+	if (val & BIT(7))
+		lcd_enable(gb);
+	else
+		lcd_disable(gb);
+}
+
+static void io_write_stat(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	// TODO: Does this STAT if we're already in these modes?
+	gb->stat_on_hblank = (val & BIT(3));
+	gb->stat_on_vblank = (val & BIT(4));
+	gb->stat_on_oam_search = (val & BIT(5));
+	gb->stat_on_scanline = (val & BIT(6));
+}
+
+static void io_write_dma(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	// TODO: DMAs are much more complicated than this
+	gb->dma = val;
+	for (int from = (val << 8), to = 0xFE00, i = 0; i < 0xA0; ++i)
+		mmu_write(gb, (to | i), mmu_read(gb, (from | i)));
+}
+
+static void io_write_ly(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	// TODO: "Writing will reset the counter"
+	//       Just the counter, or does it restart the rendering?
+}
+
+static void io_write_lyc(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->scanline_compare = val;
+	lcd_update_scanline(gb, gb->scanline);
+}
+
+static void io_write_scy(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->sy = val;
+}
+
+static void io_write_scx(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->sx = val;
+}
+
+static void io_write_wy(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->wy = val;
+}
+
+static void io_write_wx(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->wx = val - 7;
+}
+
+static void io_write_bgp(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->bgp[0].raw[0] = val;
+	lcd_update_palette_dmg(gb, &gb->bgp[0], val);
+}
+
+static void io_write_obp0(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->obp[0].raw[0] = val;
+	lcd_update_palette_dmg(gb, &gb->obp[0], val);
+}
+
+static void io_write_obp1(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->obp[1].raw[0] = val;
+	lcd_update_palette_dmg(gb, &gb->obp[1], val);
+}
+
+static void io_write_boot_switch(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	if (val != 0x01 && val != 0x11) {
+		GBLOG("Bad write to boot ROM switch: %02X", val);
+		gb->cpu_status = GAMEBOY_CPU_CRASHED;
+	} else if (!gb->boot_enabled) {
+		GBLOG("Boot ROM already disabled");
+		gb->cpu_status = GAMEBOY_CPU_CRASHED;
+	} else {
+		gameboy_pack_flags(gb);
+		GBLOG("Out of boot ROM!\n"
+		      "\tPC: %04X\n"
+		      "\tSP: %04X\n"
+		      "\tAF: %04X (%c%c%c%c)\n"
+		      "\tBC: %04X\n"
+		      "\tDE: %04X\n"
+		      "\tHL: %04X",
+		      gb->pc,
+		      gb->sp,
+		      gb->af,
+		      (gb->carry     ? 'C' : '.'),
+		      (gb->halfcarry ? 'H' : '.'),
+		      (gb->subtract  ? 'N' : '.'),
+		      (gb->zero      ? 'Z' : '.'),
+		      gb->bc,
+		      gb->de,
+		      gb->hl);
+		gb->boot_enabled = false;
+		mmu_remap(gb);
+	}
+}
+
+static void io_write_key1(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->double_speed_switch = !!(val & BIT(0));
+}
+
+static void io_write_vbk(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	if (gb->hdma_enabled) {
+		GBLOG("Can't update VRAM Bank while in HDMA");
+		return;
+	}
+	gb->vram_bank = val & BIT(0);
+}
+
+static void io_write_hdma1(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->hdma_src &= 0x00FF;
+	gb->hdma_src |= (val << 8);
+}
+
+static void io_write_hdma2(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->hdma_src &= 0xFF00;
+	gb->hdma_src |= (val & 0xF0);
+}
+
+static void io_write_hdma3(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->hdma_dst &= 0x00FF;
+	gb->hdma_dst |= ((val & BITS(0, 4)) << 8) | BIT(15);
+}
+
+static void io_write_hdma4(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->hdma_dst &= 0xFF00;
+	gb->hdma_dst |= (val & 0xF0);
+}
 
-	case GAMEBOY_ADDR_NR32:
-		switch ((val & BITS(5, 6)) >> 5) {
-		case 0: gb->wave.volume_shift = 4; break; // Effectively mute
-		case 1: gb->wave.volume_shift = 0; break;
-		case 2: gb->wave.volume_shift = 1; break;
-		case 3: gb->wave.volume_shift = 2; break;
+static void io_write_hdma5(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->hdma_blocks_queued = 0;
+	gb->hdma_blocks_remaining = (val & BITS(0, 6)) + 1;
+	if (val & BIT(7)) {
+		if (gb->hdma_enabled)
+			GBLOG("Attempted to interrupt HDMA");
+
+		gb->gdma = false;
+		gb->hdma_enabled = true;
+		if (!gb->lcd_enabled || gb->lcd_status == GAMEBOY_LCD_HBLANK)
+			gb->hdma_blocks_queued = 1;
+
+		//GBLOG("Start %d block HDMA: %04X => %04X",
+		//      gb->hdma_blocks_remaining,
+		//      gb->hdma_src, gb->hdma_dst);
+	} else {
+		if (!gb->gdma && gb->hdma_enabled) {
+			gb->hdma_enabled = false;
+			return;
 		}
-		break;
 
-	case GAMEBOY_ADDR_NR33:
-		gb->wave.super.frequency &= BITS(8, 10);
-		gb->wave.super.frequency |= val;
+		gb->gdma = true;
+		gb->hdma_enabled = true;
+		gb->hdma_blocks_queued = gb->hdma_blocks_remaining;
+		//GBLOG("Start %d block GDMA: %04X => %04X",
+		//      gb->hdma_blocks_remaining,
+		//      gb->hdma_src, gb->hdma_dst);
+	}
+}
 
-		gb->wave.super.period = 2 * (2048 - gb->wave.super.frequency);
-		break;
+static void io_write_bgpi(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->bgp_index = val & BITS(0, 5);
+	gb->bgp_increment = !!(val & BIT(7));
+}
 
-	case GAMEBOY_ADDR_NR34:
-		gb->wave.super.frequency &= 0xFF;
-		gb->wave.super.frequency |= ((val & BITS(0, 2)) << 8);
+static void io_write_bgpd(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->bgp[gb->bgp_index / 8].raw[gb->bgp_index % 8] = val;
+	lcd_update_palette_gbc(gb, &gb->bgp[gb->bgp_index / 8], gb->bgp_index % 8 / 2);
+	gb->bgp_index = (gb->bgp_index + gb->bgp_increment) & BITS(0, 5);
+}
 
-		gb->wave.super.period = 2 * (2048 - gb->wave.super.frequency);
+static void io_write_obpi(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->obp_index = val & BITS(0, 5);
+	gb->obp_increment = !!(val & BIT(7));
+}
 
-		gb->wave.length.is_terminal = !!(val & BIT(6));
-		if (val & BIT(7))
-			apu_trigger_wave(gb, &gb->wave);
-		break;
+static void io_write_obpd(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->obp[gb->obp_index / 8].raw[gb->obp_index % 8] = val;
+	lcd_update_palette_gbc(gb, &gb->obp[gb->obp_index / 8], gb->obp_index % 8 / 2);
+	gb->obp_index = (gb->obp_index + gb->obp_increment) & BITS(0, 5);
+}
 
-	case GAMEBOY_ADDR_NR41:
-		gb->noise.length.clocks_remaining = gb->noise.length.clocks_max - (val & BITS(0, 5));
-		break;
+static void io_write_svbk(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->wram_bank = (val & BITS(0, 2)) ?: 1;
+	gb->wramx = gb->wram[gb->wram_bank];
+	remap_wramx(gb);
+}
 
-	case GAMEBOY_ADDR_NR42:
-		gb->noise.envelope.clocks_max = val & BITS(0, 2);
-		gb->noise.envelope.delta = (val & BIT(3)) ? 1 : -1;
-		gb->noise.envelope.volume_max = (val & BITS(4, 7)) >> 4;
+static uint8_t io_read_unmapped(struct gameboy *gb, uint16_t addr)
+{
+	return 0xFF; // "Undefined" read
+}
 
-		gb->noise.super.dac = !!(val & BITS(3, 7));
-		if (!gb->noise.super.dac)
-			gb->noise.super.enabled = false;
-		break;
+static void io_write_unmapped(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+}
 
-	case GAMEBOY_ADDR_NR43:
-		gb->noise.divisor = (val & BITS(0, 2));
-		gb->noise.lfsr_mask = (val & BIT(3)) ? 0x4040 : 0x4000;
-		gb->noise.shift = (val & BITS(4, 7)) >> 4;
+struct io_handler {
+	uint16_t addr;
+	uint8_t (*read)(struct gameboy *gb, uint16_t addr);
+	void (*write)(struct gameboy *gb, uint16_t addr, uint8_t val);
+};
+
+// Registers with no read (or write) handler here read as FF (or ignore
+// writes); that includes HDMA1-4, which TCAGBD says always read FF
+static const struct io_handler io_handlers_dmg[] = {
+	{ GAMEBOY_ADDR_P1,          io_read_p1,      io_write_p1 },
+	{ GAMEBOY_ADDR_SB,          io_read_sb,      io_write_sb },
+	{ GAMEBOY_ADDR_SC,          io_read_sc,      io_write_sc },
+	{ GAMEBOY_ADDR_DIV,         io_read_div,     io_write_div },
+	{ GAMEBOY_ADDR_TIMA,        io_read_tima,    io_write_tima },
+	{ GAMEBOY_ADDR_TMA,         io_read_tma,     io_write_tma },
+	{ GAMEBOY_ADDR_TAC,         io_read_tac,     io_write_tac },
+	{ GAMEBOY_ADDR_IF,          io_read_if,      io_write_if },
+	{ GAMEBOY_ADDR_NR10,        io_read_nr10,    io_write_nr10 },
+	{ GAMEBOY_ADDR_NR11,        io_read_nr11,    io_write_nr11 },
+	{ GAMEBOY_ADDR_NR12,        io_read_nr12,    io_write_nr12 },
+	{ GAMEBOY_ADDR_NR13,        io_read_nr13,    io_write_nr13 },
+	{ GAMEBOY_ADDR_NR14,        io_read_nr14,    io_write_nr14 },
+	{ GAMEBOY_ADDR_NR21,        io_read_nr21,    io_write_nr21 },
+	{ GAMEBOY_ADDR_NR22,        io_read_nr22,    io_write_nr22 },
+	{ GAMEBOY_ADDR_NR23,        io_read_nr23,    io_write_nr23 },
+	{ GAMEBOY_ADDR_NR24,        io_read_nr24,    io_write_nr24 },
+	{ GAMEBOY_ADDR_NR30,        io_read_nr30,    io_write_nr30 },
+	{ GAMEBOY_ADDR_NR31,        io_read_nr31,    io_write_nr31 },
+	{ GAMEBOY_ADDR_NR32,        io_read_nr32,    io_write_nr32 },
+	{ GAMEBOY_ADDR_NR33,        io_read_nr33,    io_write_nr33 },
+	{ GAMEBOY_ADDR_NR34,        io_read_nr34,    io_write_nr34 },
+	{ GAMEBOY_ADDR_NR41,        io_read_nr41,    io_write_nr41 },
+	{ GAMEBOY_ADDR_NR42,        io_read_nr42,    io_write_nr42 },
+	{ GAMEBOY_ADDR_NR43,        io_read_nr43,    io_write_nr43 },
+	{ GAMEBOY_ADDR_NR44,        io_read_nr44,    io_write_nr44 },
+	{ GAMEBOY_ADDR_NR50,        io_read_nr50,    io_write_nr50 },
+	{ GAMEBOY_ADDR_NR51,        io_read_nr51,    io_write_nr51 },
+	{ GAMEBOY_ADDR_NR52,        io_read_nr52,    io_write_nr52 },
+	{ GAMEBOY_ADDR_LCDC,        io_read_lcdc,    io_write_lcdc },
+	{ GAMEBOY_ADDR_STAT,        io_read_stat,    io_write_stat },
+	{ GAMEBOY_ADDR_SCY,         io_read_scy,     io_write_scy },
+	{ GAMEBOY_ADDR_SCX,         io_read_scx,     io_write_scx },
+	{ GAMEBOY_ADDR_LY,          io_read_ly,      io_write_ly },
+	{ GAMEBOY_ADDR_LYC,         io_read_lyc,     io_write_lyc },
+	{ GAMEBOY_ADDR_DMA,         NULL,            io_write_dma },
+	{ GAMEBOY_ADDR_BGP,         io_read_bgp,     io_write_bgp },
+	{ GAMEBOY_ADDR_OBP0,        io_read_obp0,    io_write_obp0 },
+	{ GAMEBOY_ADDR_OBP1,        io_read_obp1,    io_write_obp1 },
+	{ GAMEBOY_ADDR_WY,          io_read_wy,      io_write_wy },
+	{ GAMEBOY_ADDR_WX,          io_read_wx,      io_write_wx },
+	{ GAMEBOY_ADDR_KEY1,        NULL,            io_write_key1 },
+	{ GAMEBOY_ADDR_BOOT_SWITCH, NULL,            io_write_boot_switch },
+	{ GAMEBOY_ADDR_HDMA1,       NULL,            io_write_hdma1 },
+	{ GAMEBOY_ADDR_HDMA2,       NULL,            io_write_hdma2 },
+	{ GAMEBOY_ADDR_HDMA3,       NULL,            io_write_hdma3 },
+	{ GAMEBOY_ADDR_HDMA4,       NULL,            io_write_hdma4 },
+	{ GAMEBOY_ADDR_IE,          io_read_ie,      io_write_ie },
+};
+
+// Added on top of the above for GBC
+static const struct io_handler io_handlers_gbc[] = {
+	{ GAMEBOY_ADDR_KEY1,  io_read_key1,    NULL },
+	{ GAMEBOY_ADDR_VBK,   io_read_vbk,     io_write_vbk },
+	{ GAMEBOY_ADDR_HDMA5, io_read_hdma5,   io_write_hdma5 },
+	{ GAMEBOY_ADDR_BGPI,  io_read_bgpi,    io_write_bgpi },
+	{ GAMEBOY_ADDR_BGPD,  io_read_bgpd,    io_write_bgpd },
+	{ GAMEBOY_ADDR_OBPI,  io_read_obpi,    io_write_obpi },
+	{ GAMEBOY_ADDR_OBPD,  io_read_obpd,    io_write_obpd },
+	{ GAMEBOY_ADDR_SVBK,  io_read_svbk,    io_write_svbk },
+};
+
+// Stand-ins for the handlers of watched registers, which are kept aside
+static uint8_t io_read_watched(struct gameboy *gb, uint16_t addr)
+{
+	uint8_t val = gb->breakpoints->io_reads[addr & 0xFF](gb, addr);
+	breakpoint_read(gb, addr, val);
 
-		if (gb->noise.shift >= 14)
-			GBLOG("Invalid LFSR shift: %d", gb->noise.shift);
+	return val;
+}
 
-		gb->noise.super.period = ((gb->noise.divisor * 16) ?: 8) << (gb->noise.shift);
-		break;
+static void io_write_watched(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	gb->breakpoints->io_writes[addr & 0xFF](gb, addr, val);
+	breakpoint_write(gb, addr, val);
+}
 
-	case GAMEBOY_ADDR_NR44:
-		gb->noise.length.is_terminal = !!(val & BIT(6));
-		if (val & BIT(7))
-			apu_trigger_noise(gb, &gb->noise);
-		break;
+static void install_io_handlers(struct gameboy *gb, const struct io_handler *handlers, size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		const struct io_handler *handler = &handlers[i];
+		if (handler->read)
+			gb->io_reads[handler->addr & 0xFF] = handler->read;
+		if (handler->write)
+			gb->io_writes[handler->addr & 0xFF] = handler->write;
+	}
+}
 
-	case GAMEBOY_ADDR_NR50:
-		gb->so1_volume = (val & BITS(0, 2));
-		gb->so2_volume = (val & BITS(4, 6)) >> 4;
-		gb->so1_vin = !!(val & BIT(3));
-		gb->so2_vin = !!(val & BIT(7));
-		break;
+// Builds the I/O page handler tables for the system being emulated, so the
+// DMG/GBC split is decided once rather than per access, then maps memory
+void mmu_init(struct gameboy *gb)
+{
+	for (int reg = 0x00; reg <= 0xFF; ++reg) {
+		gb->io_reads[reg] = io_read_unmapped;
+		gb->io_writes[reg] = io_write_unmapped;
+	}
+	for (int reg = 0x30; reg <= 0x3F; ++reg) {
+		gb->io_reads[reg] = io_read_wave_ram;
+		gb->io_writes[reg] = io_write_wave_ram;
+	}
+	for (int reg = 0x80; reg <= 0xFE; ++reg) {
+		gb->io_reads[reg] = io_read_hram;
+		gb->io_writes[reg] = io_write_hram;
+	}
 
-	case GAMEBOY_ADDR_NR51:
-		gb->sq1.super.output_left = !!(val & BIT(0));
-		gb->sq2.super.output_left = !!(val & BIT(1));
-		gb->wave.super.output_left = !!(val & BIT(2));
-		gb->noise.super.output_left = !!(val & BIT(3));
+	install_io_handlers(gb, io_handlers_dmg, sizeof(io_handlers_dmg) / sizeof(io_handlers_dmg[0]));
+	if (gb->gbc)
+		install_io_handlers(gb, io_handlers_gbc, sizeof(io_handlers_gbc) / sizeof(io_handlers_gbc[0]));
+
+	struct gameboy_breakpoints *bp = gb->breakpoints;
+	for (int reg = 0x00; bp && reg <= 0xFF; ++reg) {
+		bp->io_reads[reg] = gb->io_reads[reg];
+		bp->io_writes[reg] = gb->io_writes[reg];
+		if (breakpoint_test(bp->read, 0xFF00 + reg))
+			gb->io_reads[reg] = io_read_watched;
+		if (breakpoint_test(bp->write, 0xFF00 + reg))
+			gb->io_writes[reg] = io_write_watched;
+	}
 
-		gb->sq1.super.output_right = !!(val & BIT(4));
-		gb->sq2.super.output_right = !!(val & BIT(5));
-		gb->wave.super.output_right = !!(val & BIT(6));
-		gb->noise.super.output_right = !!(val & BIT(7));
-		break;
+	mmu_remap(gb);
+}
 
-	case GAMEBOY_ADDR_NR52:
-		if (val & BIT(7))
-			apu_enable(gb);
-		else
-			apu_disable(gb);
-		break;
+// Plain memory is mapped page by page: ROM, WRAM, and cartridge RAM while
+// it's enabled and not showing the RTC.  Everything else (MBC registers,
+// VRAM and OAM with their access windows, echo RAM, the I/O page with HRAM
+// in it) is left NULL and handled by the switches below.
+void mmu_remap(struct gameboy *gb)
+{
+	memset(gb->read_pages, 0, sizeof(gb->read_pages));
+	memset(gb->write_pages, 0, sizeof(gb->write_pages));
 
-	case 0xFF30 ... 0xFF3F:
-	{
-		uint8_t offset = (addr % 0x10) * 2;
-		gb->wave.samples[offset + 0] = val >> 4;
-		gb->wave.samples[offset + 1] = val & 0x0F;
-		break;
+	for (int page = 0x00; gb->rom && page < 0x40; ++page)
+		gb->read_pages[page] = gb->rom[0] + page * 0x100;
+
+	if (gb->boot_enabled) {
+		gb->read_pages[0x00] = gb->boot;
+		for (int page = 0x02; gb->gbc && page < 0x09; ++page)
+			gb->read_pages[page] = gb->boot + page * 0x100;
 	}
 
-	case GAMEBOY_ADDR_LCDC:
-		gb->background_enabled = (val & BIT(0));
-		gb->sprites_enabled = (val & BIT(1));
-		lcd_update_sprite_mode(gb, val & BIT(2));
-		gb->background_tilemap = !!(val & BIT(3));
-		lcd_update_tilemap_mode(gb, !(val & BIT(4)));
-		gb->window_enabled = (val & BIT(5));
-		gb->window_tilemap = !!(val & BIT(6));
-		if (val & BIT(7))
-			lcd_enable(gb);
-		else
-			lcd_disable(gb);
-		break;
+	for (int page = 0xC0; page < 0xD0; ++page) {
+		uint8_t *mem = gb->wram[0] + (page - 0xC0) * 0x100;
+		gb->read_pages[page] = mem;
+		gb->write_pages[page] = mem;
+	}
 
-	case GAMEBOY_ADDR_STAT:
-		// TODO: Does this STAT if we're already in these modes?
-		gb->stat_on_hblank = (val & BIT(3));
-		gb->stat_on_vblank = (val & BIT(4));
-		gb->stat_on_oam_search = (val & BIT(5));
-		gb->stat_on_scanline = (val & BIT(6));
-		break;
+	unmap_watched(gb, 0x00, 0x40);
+	unmap_watched(gb, 0xC0, 0xD0);
 
-	case GAMEBOY_ADDR_DMA:
-		// TODO: DMAs are much more complicated than this
-		gb->dma = val;
-		for (int from = (val << 8), to = 0xFE00, i = 0; i < 0xA0; ++i)
-			mmu_write(gb, (to | i), mmu_read(gb, (from | i)));
-		break;
+	remap_romx(gb);
+	remap_sram(gb);
+	remap_wramx(gb);
+}
 
-	case GAMEBOY_ADDR_LY:
-		// TODO: "Writing will reset the counter"
-		//       Just the counter, or does it restart the rendering?
+static uint8_t read_slow(struct gameboy *gb, uint16_t addr)
+{
+	switch (addr) {
+	case 0x0000 ... 0x00FF:
+		if (gb->boot_enabled)
+			return gb->boot[addr];
+		if (gb->rom)
+			return gb->rom[0][addr];
 		break;
-
-	case GAMEBOY_ADDR_LYC:
-		gb->scanline_compare = val;
-		lcd_update_scanline(gb, gb->scanline);
+	case 0x0200 ... 0x08FF:
+		if (gb->boot_enabled && gb->gbc)
+			return gb->boot[addr];
+		if (gb->rom)
+			return gb->rom[0][addr];
 		break;
-
-	case GAMEBOY_ADDR_SCY:
-		gb->sy = val;
+	case 0x0100 ... 0x01FF:
+	case 0x0900 ... 0x3FFF:
+		if (gb->rom)
+			return gb->rom[0][addr];
 		break;
 
-	case GAMEBOY_ADDR_SCX:
-		gb->sx = val;
+	case 0x4000 ... 0x7FFF:
+		if (gb->rom)
+			return gb->romx[addr % 0x4000];
 		break;
 
-	case GAMEBOY_ADDR_WY:
-		gb->wy = val;
+	case 0x8000 ... 0x97FF:
+		if (is_vram_accessible(gb))
+			return lcd_read_tile(gb, addr % 0x2000);
 		break;
-
-	case GAMEBOY_ADDR_WX:
-		gb->wx = val - 7;
+	case 0x9800 ... 0x9FFF:
+		if (is_vram_accessible(gb))
+			return lcd_read_tilemap(gb, addr % 0x0800);
 		break;
 
-	case GAMEBOY_ADDR_BGP:
-		gb->bgp[0].raw[0] = val;
-		lcd_update_palette_dmg(&gb->bgp[0], val);
-		break;
+	case 0xA000 ... 0xBFFF:
+		if (!gb->sram_enabled)
+			break;
 
-	case GAMEBOY_ADDR_OBP0:
-		gb->obp[0].raw[0] = val;
-		lcd_update_palette_dmg(&gb->obp[0], val);
+		if (gb->rtc_status)
+			return rtc_read(gb);
+		else
+			return gb->sramx[addr % 0x2000 % gb->sram_size];
 		break;
 
-	case GAMEBOY_ADDR_OBP1:
-		gb->obp[1].raw[0] = val;
-		lcd_update_palette_dmg(&gb->obp[1], val);
-		break;
+	case 0xC000 ... 0xCFFF:
+		return gb->wram[0][addr % 0x1000];
+	case 0xD000 ... 0xDFFF:
+		return gb->wramx[addr % 0x1000];
 
-	case GAMEBOY_ADDR_BOOT_SWITCH:
-		if (val != 0x01 && val != 0x11) {
-			GBLOG("Bad write to boot ROM switch: %02X", val);
-			gb->cpu_status = GAMEBOY_CPU_CRASHED;
-		} else if (!gb->boot_enabled) {
-			GBLOG("Boot ROM already disabled");
-			gb->cpu_status = GAMEBOY_CPU_CRASHED;
-		} else {
-			GBLOG("Out of boot ROM!\n"
-			      "\tPC: %04X\n"
-			      "\tSP: %04X\n"
-			      "\tAF: %04X (%c%c%c%c)\n"
-			      "\tBC: %04X\n"
-			      "\tDE: %04X\n"
-			      "\tHL: %04X",
-			      gb->pc,
-			      gb->sp,
-			      gb->af,
-			      (gb->carry     ? 'C' : '.'),
-			      (gb->halfcarry ? 'H' : '.'),
-			      (gb->subtract  ? 'N' : '.'),
-			      (gb->zero      ? 'Z' : '.'),
-			      gb->bc,
-			      gb->de,
-			      gb->hl);
-			gb->boot_enabled = false;
-		}
+	case 0xE000 ... 0xFDFF:
+		GBLOG("Bad read from ECHO RAM: %04X", addr);
+		gb->cpu_status = GAMEBOY_CPU_CRASHED;
 		break;
 
-	case GAMEBOY_ADDR_KEY1:
-		gb->double_speed_switch = !!(val & BIT(0));
+	case 0xFE00 ... 0xFE9F:
+		if (is_oam_accessible(gb))
+			return lcd_read_sprite(gb, addr % 0x0100);
 		break;
 
-	case GAMEBOY_ADDR_VBK:
-		if (!gb->gbc)
+	case 0xFF00 ... 0xFFFF:
+		return gb->io_reads[addr & 0xFF](gb, addr);
+	}
+
+	return 0xFF; // "Undefined" read
+}
+
+static void write_slow(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	switch (addr) {
+	case 0x0000 ... 0x7FFF:
+		switch (gb->mbc) {
+		case GAMEBOY_MBC_NONE:
 			break;
-		if (gb->hdma_enabled) {
-			GBLOG("Can't update VRAM Bank while in HDMA");
+		case GAMEBOY_MBC_MBC1:
+			mbc1_write(gb, addr, val);
+			break;
+		case GAMEBOY_MBC_MBC3:
+			mbc3_write(gb, addr, val);
+			break;
+		case GAMEBOY_MBC_MBC2:
+		case GAMEBOY_MBC_MMM01:
+		case GAMEBOY_MBC_MBC5:
+		case GAMEBOY_MBC_MBC6:
+		case GAMEBOY_MBC_MBC7:
+		case GAMEBOY_MBC_HUC1:
+		case GAMEBOY_MBC_HUC3:
+		case GAMEBOY_MBC_TAMA5:
+		case GAMEBOY_MBC_CAMERA:
+			GBLOG("MBC $%d not yet implemented", gb->mbc);
+			gb->cpu_status = GAMEBOY_CPU_CRASHED;
 			break;
 		}
-		gb->vram_bank = val & BIT(0);
 		break;
 
-	case GAMEBOY_ADDR_HDMA1:
-		gb->hdma_src &= 0x00FF;
-		gb->hdma_src |= (val << 8);
-		break;
-	case GAMEBOY_ADDR_HDMA2:
-		gb->hdma_src &= 0xFF00;
-		gb->hdma_src |= (val & 0xF0);
-		break;
-	case GAMEBOY_ADDR_HDMA3:
-		gb->hdma_dst &= 0x00FF;
-		gb->hdma_dst |= ((val & BITS(0, 4)) << 8) | BIT(15);
+	case 0x8000 ... 0x97FF:
+		if (is_vram_accessible(gb))
+			lcd_update_tile(gb, addr % 0x2000, val);
 		break;
-	case GAMEBOY_ADDR_HDMA4:
-		gb->hdma_dst &= 0xFF00;
-		gb->hdma_dst |= (val & 0xF0);
+	case 0x9800 ... 0x9FFF:
+		if (is_vram_accessible(gb))
+			lcd_update_tilemap(gb, addr % 0x0800, val);
 		break;
-	case GAMEBOY_ADDR_HDMA5:
-		if (!gb->gbc)
-			break;
-
-		gb->hdma_blocks_queued = 0;
-		gb->hdma_blocks_remaining = (val & BITS(0, 6)) + 1;
-		if (val & BIT(7)) {
-			if (gb->hdma_enabled)
-				GBLOG("Attempted to interrupt HDMA");
 
-			gb->gdma = false;
-			gb->hdma_enabled = true;
-			if (!gb->lcd_enabled || gb->lcd_status == GAMEBOY_LCD_HBLANK)
-				gb->hdma_blocks_queued = 1;
+	case 0xA000 ... 0xBFFF:
+		if (!gb->sram_enabled)
+			break;
 
-			//GBLOG("Start %d block HDMA: %04X => %04X",
-			//      gb->hdma_blocks_remaining,
-			//      gb->hdma_src, gb->hdma_dst);
-		} else {
-			if (!gb->gdma && gb->hdma_enabled) {
-				gb->hdma_enabled = false;
-				break;
-			}
-
-			gb->gdma = true;
-			gb->hdma_enabled = true;
-			gb->hdma_blocks_queued = gb->hdma_blocks_remaining;
-			//GBLOG("Start %d block GDMA: %04X => %04X",
-			//      gb->hdma_blocks_remaining,
-			//      gb->hdma_src, gb->hdma_dst);
-		}
+		if (gb->rtc_status)
+			rtc_write(gb, val);
+		else
+			gb->sramx[addr % 0x2000 % gb->sram_size] = val;
 		break;
 
-	case GAMEBOY_ADDR_BGPI:
-		if (!gb->gbc)
-			break;
-		gb->bgp_index = val & BITS(0, 5);
-		gb->bgp_increment = !!(val & BIT(7));
+	case 0xC000 ... 0xCFFF:
+		gb->wram[0][addr % 0x1000] = val;
+		block_notify_write(gb, addr);
 		break;
-
-	case GAMEBOY_ADDR_BGPD:
-		if (!gb->gbc)
-			break;
-		gb->bgp[gb->bgp_index / 8].raw[gb->bgp_index % 8] = val;
-		lcd_update_palette_gbc(&gb->bgp[gb->bgp_index / 8], gb->bgp_index % 8 / 2);
-		gb->bgp_index = (gb->bgp_index + gb->bgp_increment) & BITS(0, 5);
+	case 0xD000 ... 0xDFFF:
+		gb->wramx[addr % 0x1000] = val;
+		block_notify_write(gb, addr);
 		break;
 
-	case GAMEBOY_ADDR_OBPI:
-		if (!gb->gbc)
-			break;
-		gb->obp_index = val & BITS(0, 5);
-		gb->obp_increment = !!(val & BIT(7));
+	case 0xE000 ... 0xFDFF:
+		GBLOG("Bad write to ECHO RAM: %02X => %04X", val, addr);
+		gb->cpu_status = GAMEBOY_CPU_CRASHED;
 		break;
 
-	case GAMEBOY_ADDR_OBPD:
-		if (!gb->gbc)
-			break;
-		gb->obp[gb->obp_index / 8].raw[gb->obp_index % 8] = val;
-		lcd_update_palette_gbc(&gb->obp[gb->obp_index / 8], gb->obp_index % 8 / 2);
-		gb->obp_index = (gb->obp_index + gb->obp_increment) & BITS(0, 5);
+	case 0xFE00 ... 0xFE9F:
+		if (is_oam_accessible(gb))
+			lcd_update_sprite(gb, addr % 0x0100, val);
 		break;
 
-	case GAMEBOY_ADDR_SVBK:
-		if (!gb->gbc)
-			break;
-		gb->wram_bank = (val & BITS(0, 2)) ?: 1;
-		gb->wramx = gb->wram[gb->wram_bank];
+	case 0xFF00 ... 0xFFFF:
+		gb->io_writes[addr & 0xFF](gb, addr, val);
 		break;
 	}
 }
+
+// Watched I/O registers are checked by their stand-in handlers instead
+uint8_t mmu_read_slow(struct gameboy *gb, uint16_t addr)
+{
+	uint8_t val = read_slow(gb, addr);
+	if (gb->breakpoints && addr < 0xFF00)
+		breakpoint_read(gb, addr, val);
+
+	return val;
+}
+
+void mmu_write_slow(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	write_slow(gb, addr, val);
+	if (gb->breakpoints && addr < 0xFF00)
+		breakpoint_write(gb, addr, val);
+}
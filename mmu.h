@@ -2,9 +2,39 @@
 #ifndef EGBE_MMU_H
 #define EGBE_MMU_H
 
+#include "block.h"
 #include "gameboy.h"
 
-uint8_t mmu_read(struct gameboy *gb, uint16_t addr);
-void mmu_write(struct gameboy *gb, uint16_t addr, uint8_t val);
+uint8_t mmu_read_slow(struct gameboy *gb, uint16_t addr);
+void mmu_write_slow(struct gameboy *gb, uint16_t addr, uint8_t val);
+void mmu_init(struct gameboy *gb);
+void mmu_remap(struct gameboy *gb);
+
+static inline uint8_t mmu_read(struct gameboy *gb, uint16_t addr)
+{
+	const uint8_t *page = gb->read_pages[addr >> 8];
+	if (page)
+		return page[addr & 0xFF];
+	if (addr >= 0xFF00)
+		return gb->io_reads[addr & 0xFF](gb, addr);
+
+	return mmu_read_slow(gb, addr);
+}
+
+static inline void mmu_write(struct gameboy *gb, uint16_t addr, uint8_t val)
+{
+	uint8_t *page = gb->write_pages[addr >> 8];
+	if (page) {
+		page[addr & 0xFF] = val;
+		block_notify_write(gb, addr);
+		return;
+	}
+	if (addr >= 0xFF00) {
+		gb->io_writes[addr & 0xFF](gb, addr, val);
+		return;
+	}
+
+	mmu_write_slow(gb, addr, val);
+}
 
 #endif
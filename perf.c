@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+#include "perf.h"
+#include "common.h"
+#include <stdint.h>
+#include <time.h>
+
+#ifdef EGBE_PERF
+
+static const char *const names[PERF_MAX] = {
+	[PERF_HOST]   = "host",
+	[PERF_CPU]    = "cpu",
+	[PERF_APU]    = "apu",
+	[PERF_LCD]    = "lcd",
+	[PERF_SERIAL] = "serial",
+	[PERF_TIMER]  = "timer",
+	[PERF_RENDER] = "render",
+	[PERF_DEBUG]  = "debug",
+	[PERF_VBLANK] = "vblank",
+	[PERF_AUDIO]  = "audio",
+};
+
+// Per thread, so each batch worker accounts for its own emulators
+static _Thread_local struct {
+	enum perf_section current;
+	uint64_t since;
+	uint64_t ns[PERF_MAX];
+	uint64_t frames;
+} perf;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Charges the time since the last switch to the current section
+static void perf_switch(enum perf_section section)
+{
+	uint64_t t = now_ns();
+
+	if (perf.since)
+		perf.ns[perf.current] += t - perf.since;
+	perf.since = t;
+	perf.current = section;
+}
+
+enum perf_section perf_enter(enum perf_section section)
+{
+	enum perf_section prev = perf.current;
+	perf_switch(section);
+
+	return prev;
+}
+
+void perf_leave(enum perf_section prev)
+{
+	perf_switch(prev);
+}
+
+void perf_frame(void)
+{
+	++perf.frames;
+}
+
+// Prints the time per section since the last report, both in total and
+// averaged over the frames emulated, then starts over
+void perf_report(void)
+{
+	perf_switch(perf.current);
+
+	uint64_t total = 0;
+	for (int i = 0; i < PERF_MAX; ++i)
+		total += perf.ns[i];
+
+	uint64_t frames = perf.frames ?: 1;
+	printf("Host time: %.3f ms over %lu frames\n",
+	       total / 1e6, (unsigned long)perf.frames);
+	printf("%-8s %12s %12s %6s\n", "Section", "Total ms", "us/frame", "%");
+	for (int i = 0; i < PERF_MAX; ++i) {
+		printf("%-8s %12.3f %12.2f %5.1f%%\n",
+		       names[i], perf.ns[i] / 1e6, perf.ns[i] / 1e3 / frames,
+		       total ? 100.0 * perf.ns[i] / total : 0.0);
+		perf.ns[i] = 0;
+	}
+	perf.frames = 0;
+}
+
+#endif
@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef EGBE_PERF_H
+#define EGBE_PERF_H
+
+#include "gameboy.h"
+
+// Host time spent per subsystem, compiled in with `make PERF=1`.  Sections
+// nest and time is exclusive: entering one pauses whichever section it was
+// entered from, so e.g. LCD time excludes the scanline renderer.
+enum perf_section {
+	PERF_HOST, // Anything outside of the sections below
+	PERF_CPU,
+
+	// Peripheral syncs, in the scheduler's event order
+	PERF_EVENTS,
+	PERF_APU = PERF_EVENTS + GAMEBOY_EVENT_APU,
+	PERF_LCD = PERF_EVENTS + GAMEBOY_EVENT_LCD,
+	PERF_SERIAL = PERF_EVENTS + GAMEBOY_EVENT_SERIAL,
+	PERF_TIMER = PERF_EVENTS + GAMEBOY_EVENT_TIMER,
+
+	PERF_RENDER = PERF_EVENTS + GAMEBOY_EVENT_MAX,
+	PERF_DEBUG,
+	PERF_VBLANK,
+	PERF_AUDIO,
+	PERF_MAX,
+};
+
+#ifdef EGBE_PERF
+
+enum perf_section perf_enter(enum perf_section section);
+void perf_leave(enum perf_section prev);
+void perf_frame(void);
+void perf_report(void);
+
+// At most one PERF_BEGIN per block
+#define PERF_BEGIN(section) enum perf_section perf_prev_ = perf_enter(section)
+#define PERF_END() perf_leave(perf_prev_)
+#define PERF_FRAME() perf_frame()
+#define PERF_REPORT() perf_report()
+
+#else
+
+#define PERF_BEGIN(section) do {} while (0)
+#define PERF_END() do {} while (0)
+#define PERF_FRAME() do {} while (0)
+#define PERF_REPORT() do {} while (0)
+
+#endif
+
+#endif
@@ -278,8 +278,7 @@ static void link_tick(struct egbe_gameboy *self)
 	case EGBE_LINK_HOST:
 		// TODO: Try using guest cycles instead of GB cycles?
 		self->till = self->gb->cycles + EGBE_EVENT_CYCLES;
-		while (self->gb->cycles < self->till)
-			gameboy_tick(self->gb);
+		egbe_gameboy_run(self);
 
 		link_update_self(self);
 		update_link_status(self);
@@ -303,8 +302,7 @@ static void link_tick(struct egbe_gameboy *self)
 		; // fallthrough
 	case EGBE_LINK_GUEST:
 		self->till = host->cycles + self->start;
-		while (self->gb->cycles < self->till)
-			gameboy_tick(self->gb);
+		egbe_gameboy_run(self);
 
 		self->xfer_pending = (host->serial >= 0);
 		if (self->xfer_pending)
@@ -321,8 +319,7 @@ static void link_tick(struct egbe_gameboy *self)
 		; // fallthrough
 	case EGBE_LINK_DISCONNECTED:
 		self->till = self->gb->cycles + EGBE_EVENT_CYCLES;
-		while (self->gb->cycles < self->till)
-			gameboy_tick(self->gb);
+		egbe_gameboy_run(self);
 	}
 }
 
@@ -306,8 +306,7 @@ static void tick_lws(struct egbe_gameboy *self)
 		; // fallthrough
 	case EGBE_LINK_HOST:
 		self->till = self->gb->cycles + EGBE_EVENT_CYCLES;
-		while (self->gb->cycles < self->till)
-			gameboy_tick(self->gb);
+		egbe_gameboy_run(self);
 
 		link_update_self(self);
 		self->link_status |= EGBE_LINK_WAITING;
@@ -319,8 +318,7 @@ static void tick_lws(struct egbe_gameboy *self)
 		; // fallthrough
 	case EGBE_LINK_GUEST:
 		self->till = host->cycles + self->start;
-		while (self->gb->cycles < self->till)
-			gameboy_tick(self->gb);
+		egbe_gameboy_run(self);
 
 		self->xfer_pending = (host->serial >= 0);
 		if (self->xfer_pending)
@@ -338,8 +336,7 @@ static void tick_lws(struct egbe_gameboy *self)
 		; // Fallthrough
 	case EGBE_LINK_DISCONNECTED:
 		self->till = self->gb->cycles + EGBE_EVENT_CYCLES;
-		while (self->gb->cycles < self->till)
-			gameboy_tick(self->gb);
+		egbe_gameboy_run(self);
 		break;
 	}
 }
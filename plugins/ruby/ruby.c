@@ -56,6 +56,89 @@ static VALUE cGB_initialize(VALUE self)
 	return self;
 }
 
+static VALUE cGB_profile_report(VALUE self, VALUE limit)
+{
+	struct gameboy *gb = rb_data_object_get(self);
+	gameboy_report_profile(gb, NUM2INT(limit));
+	return Qnil;
+}
+
+static VALUE cGB_profile_save(VALUE self, VALUE path)
+{
+	struct gameboy *gb = rb_data_object_get(self);
+	return gameboy_save_profile(gb, StringValueCStr(path)) ? Qfalse : Qtrue;
+}
+
+static VALUE cGB_profile_reset(VALUE self)
+{
+	struct gameboy *gb = rb_data_object_get(self);
+	gameboy_reset_profile(gb);
+	return Qnil;
+}
+
+static VALUE cGB_trace_save(VALUE self, VALUE path)
+{
+	struct gameboy *gb = rb_data_object_get(self);
+	return gameboy_save_trace(gb, StringValueCStr(path)) ? Qfalse : Qtrue;
+}
+
+static VALUE cGB_set_breakpoint(VALUE self, VALUE addr, unsigned int types)
+{
+	struct gameboy *gb = rb_data_object_get(self);
+	return gameboy_set_breakpoint(gb, NUM2UINT(addr), types) ? Qfalse : Qtrue;
+}
+
+static VALUE cGB_break_exec(VALUE self, VALUE addr)
+{
+	return cGB_set_breakpoint(self, addr, GAMEBOY_BREAK_EXEC);
+}
+
+static VALUE cGB_break_read(VALUE self, VALUE addr)
+{
+	return cGB_set_breakpoint(self, addr, GAMEBOY_BREAK_READ);
+}
+
+static VALUE cGB_break_write(VALUE self, VALUE addr)
+{
+	return cGB_set_breakpoint(self, addr, GAMEBOY_BREAK_WRITE);
+}
+
+static VALUE cGB_unbreak(VALUE self, VALUE addr)
+{
+	struct gameboy *gb = rb_data_object_get(self);
+	gameboy_clear_breakpoint(gb, NUM2UINT(addr),
+	                         GAMEBOY_BREAK_EXEC | GAMEBOY_BREAK_READ | GAMEBOY_BREAK_WRITE);
+	return Qnil;
+}
+
+static VALUE cGB_clear_breakpoints(VALUE self)
+{
+	struct gameboy *gb = rb_data_object_get(self);
+	gameboy_clear_breakpoints(gb);
+	return Qnil;
+}
+
+// { type: :exec/:read/:write, addr:, pc:, val:, outside_insn: } or nil
+static VALUE cGB_last_break(VALUE self)
+{
+	struct gameboy *gb = rb_data_object_get(self);
+	struct gameboy_breakpoint_hit hit;
+	if (!gameboy_last_breakpoint(gb, &hit))
+		return Qnil;
+
+	const char *type = hit.type == GAMEBOY_BREAK_EXEC ? "exec"
+	                 : hit.type == GAMEBOY_BREAK_READ ? "read"
+	                 : "write";
+
+	VALUE hash = rb_hash_new();
+	rb_hash_aset(hash, ID2SYM(rb_intern("type")), ID2SYM(rb_intern(type)));
+	rb_hash_aset(hash, ID2SYM(rb_intern("addr")), UINT2NUM(hit.addr));
+	rb_hash_aset(hash, ID2SYM(rb_intern("pc")), UINT2NUM(hit.pc));
+	rb_hash_aset(hash, ID2SYM(rb_intern("val")), UINT2NUM(hit.val));
+	rb_hash_aset(hash, ID2SYM(rb_intern("outside_insn")), hit.outside_insn ? Qtrue : Qfalse);
+	return hash;
+}
+
 static VALUE cAccessor_get(VALUE self)
 {
 	void *ptr = rb_data_object_get(self);
@@ -121,6 +204,16 @@ static void Init_egbe(void)
 
 	cGB = rb_define_class_under(mEGBE, "GB", rb_cObject);
 	rb_define_method(cGB, "initialize", cGB_initialize, 0);
+	rb_define_method(cGB, "profile_report", cGB_profile_report, 1);
+	rb_define_method(cGB, "profile_save", cGB_profile_save, 1);
+	rb_define_method(cGB, "profile_reset", cGB_profile_reset, 0);
+	rb_define_method(cGB, "trace_save", cGB_trace_save, 1);
+	rb_define_method(cGB, "break_exec", cGB_break_exec, 1);
+	rb_define_method(cGB, "break_read", cGB_break_read, 1);
+	rb_define_method(cGB, "break_write", cGB_break_write, 1);
+	rb_define_method(cGB, "unbreak", cGB_unbreak, 1);
+	rb_define_method(cGB, "clear_breakpoints", cGB_clear_breakpoints, 0);
+	rb_define_method(cGB, "last_break", cGB_last_break, 0);
 
 	ID register_accessor = rb_intern("register_accessor");
 	rb_eval_string(
@@ -229,7 +322,7 @@ static void Init_egbe(void)
 	GB_ATTR("OBPIndex", obp_index);
 	GB_ATTR("OBPIncrement", obp_increment);
 
-	GB_ATTR("SpritesUnsorted", sprites_unsorted);
+	GB_ATTR("SpritesDirty", sprites_dirty);
 
 	GB_ATTR("BackgroundTilemap", background_tilemap);
 	GB_ATTR("WindowTilemap", window_tilemap);
@@ -294,7 +387,8 @@ static void Init_egbe(void)
 	// int dbg_vram[192][128]);
 	// int dbg_vram_gbc[192][128]);
 	// struct gameboy_sprite sprites[40]);
-	// struct gameboy_sprite *sprites_sorted[40]);
+	// uint8_t line_sprites[144][10]);
+	// uint8_t line_sprite_counts[144]);
 	// struct gameboy_tile tiles[2][384]);
 	// struct gameboy_background_table tilemaps[2]);
 	// GB_ATTR("Boot", boot);
@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "profile.h"
+#include "common.h"
+#include <string.h>
+
+#define ROM_BANK_SIZE sizeof(((struct gameboy *)NULL)->rom[0])
+#define WRAM_BANK_SIZE sizeof(((struct gameboy *)NULL)->wram[0])
+
+struct hot_spot {
+	size_t slot;
+	uint64_t cycles;
+};
+
+static size_t slot_of(struct gameboy *gb, const struct gameboy_profile *prof, uint16_t pc)
+{
+	switch (pc) {
+	case 0x0000 ... 0x00FF:
+	case 0x0200 ... 0x08FF:
+		if (gb->boot_enabled && (pc < 0x0100 || gb->gbc))
+			return prof->other;
+		; // fallthrough
+	case 0x0100 ... 0x01FF:
+	case 0x0900 ... 0x3FFF:
+		return pc;
+
+	case 0x4000 ... 0x7FFF:
+		if (gb->rom_bank >= gb->rom_banks)
+			return prof->other;
+		return gb->rom_bank * ROM_BANK_SIZE + pc % ROM_BANK_SIZE;
+
+	case 0xC000 ... 0xCFFF:
+		return prof->wram_base + pc % WRAM_BANK_SIZE;
+
+	case 0xD000 ... 0xDFFF:
+		return prof->wram_base + gb->wram_bank * WRAM_BANK_SIZE + pc % WRAM_BANK_SIZE;
+
+	case 0xFF80 ... 0xFFFE:
+		return prof->hram_base + pc % 0x80;
+
+	default:
+		return prof->other;
+	}
+}
+
+// Region, bank and address of a slot, as e.g. "ROM 0A:4123"
+static void describe(const struct gameboy_profile *prof, size_t slot,
+                     const char **region, size_t *bank, uint16_t *addr)
+{
+	if (slot < prof->wram_base) {
+		*region = "ROM";
+		*bank = slot / ROM_BANK_SIZE;
+		*addr = (*bank ? 0x4000 : 0x0000) + slot % ROM_BANK_SIZE;
+	} else if (slot < prof->hram_base) {
+		slot -= prof->wram_base;
+		*region = "WRAM";
+		*bank = slot / WRAM_BANK_SIZE;
+		*addr = (*bank ? 0xD000 : 0xC000) + slot % WRAM_BANK_SIZE;
+	} else if (slot < prof->other) {
+		*region = "HRAM";
+		*bank = 0;
+		*addr = 0xFF80 + (slot - prof->hram_base);
+	} else {
+		*region = "Other";
+		*bank = 0;
+		*addr = 0;
+	}
+}
+
+// Charges the cycles since the last instruction started to it (the clock
+// runs backwards across restarts and state loads)
+static void settle(struct gameboy *gb, struct gameboy_profile *prof)
+{
+	if (gb->cycles > prof->last_cycles)
+		prof->cycles[prof->last] += gb->cycles - prof->last_cycles;
+	prof->last_cycles = gb->cycles;
+}
+
+void profile_insn(struct gameboy *gb, uint16_t pc)
+{
+	struct gameboy_profile *prof = gb->profile;
+
+	settle(gb, prof);
+	prof->last = slot_of(gb, prof, pc);
+	++prof->insns[prof->last];
+}
+
+int gameboy_enable_profile(struct gameboy *gb)
+{
+	if (gb->profile)
+		return 0;
+
+	if (!gb->rom) {
+		GBLOG("Insert a cartridge before profiling");
+		return EINVAL;
+	}
+
+	struct gameboy_profile *prof = calloc(1, sizeof(*prof));
+	if (!prof) {
+		GBLOG("Failed to allocate profile: %m");
+		return ENOMEM;
+	}
+
+	prof->wram_base = gb->rom_banks * ROM_BANK_SIZE;
+	prof->hram_base = prof->wram_base + gb->wram_banks * WRAM_BANK_SIZE;
+	prof->other = prof->hram_base + 0x80;
+	prof->size = prof->other + 1;
+
+	prof->insns = calloc(prof->size, sizeof(*prof->insns));
+	prof->cycles = calloc(prof->size, sizeof(*prof->cycles));
+	if (!prof->insns || !prof->cycles) {
+		GBLOG("Failed to allocate profile counters: %m");
+		free(prof->insns);
+		free(prof->cycles);
+		free(prof);
+		return ENOMEM;
+	}
+
+	gb->profile = prof;
+	gameboy_reset_profile(gb);
+
+	return 0;
+}
+
+void gameboy_reset_profile(struct gameboy *gb)
+{
+	struct gameboy_profile *prof = gb->profile;
+	if (!prof)
+		return;
+
+	memset(prof->insns, 0, prof->size * sizeof(*prof->insns));
+	memset(prof->cycles, 0, prof->size * sizeof(*prof->cycles));
+	prof->last = prof->other;
+	prof->last_cycles = gb->cycles;
+}
+
+static int compare_hot_spots(const void *p1, const void *p2)
+{
+	const struct hot_spot *lhs = p1;
+	const struct hot_spot *rhs = p2;
+
+	if (lhs->cycles != rhs->cycles)
+		return lhs->cycles < rhs->cycles ? 1 : -1;
+
+	return lhs->slot < rhs->slot ? -1 : lhs->slot > rhs->slot;
+}
+
+void gameboy_report_profile(struct gameboy *gb, int limit)
+{
+	struct gameboy_profile *prof = gb->profile;
+	if (!prof) {
+		GBLOG("Profiling is not enabled");
+		return;
+	}
+
+	settle(gb, prof);
+
+	uint64_t insns = 0;
+	uint64_t cycles = 0;
+	size_t count = 0;
+	for (size_t slot = 0; slot < prof->size; ++slot) {
+		insns += prof->insns[slot];
+		cycles += prof->cycles[slot];
+		count += !!prof->cycles[slot];
+	}
+
+	struct hot_spot *spots = malloc((count ?: 1) * sizeof(*spots));
+	if (!spots) {
+		GBLOG("Failed to allocate profile report: %m");
+		return;
+	}
+
+	count = 0;
+	for (size_t slot = 0; slot < prof->size; ++slot)
+		if (prof->cycles[slot])
+			spots[count++] = (struct hot_spot){ slot, prof->cycles[slot] };
+	qsort(spots, count, sizeof(*spots), compare_hot_spots);
+
+	printf("Profile: %lu instructions, %lu cycles at %lu addresses\n",
+	       (unsigned long)insns, (unsigned long)cycles, (unsigned long)count);
+	printf("%12s %6s %12s  %s\n", "Cycles", "%", "Insns", "Address");
+	for (size_t i = 0; i < count && (limit <= 0 || i < (size_t)limit); ++i) {
+		const char *region;
+		size_t bank;
+		uint16_t addr;
+		describe(prof, spots[i].slot, &region, &bank, &addr);
+
+		printf("%12lu %5.1f%% %12lu  %-5s %02lX:%04X\n",
+		       (unsigned long)spots[i].cycles,
+		       100.0 * spots[i].cycles / cycles,
+		       (unsigned long)prof->insns[spots[i].slot],
+		       region, (unsigned long)bank, addr);
+	}
+
+	free(spots);
+}
+
+// One tab-separated line per address that ran: region, bank, address,
+// instructions and cycles
+static int fwrite_profile(struct gameboy *gb, FILE *out)
+{
+	struct gameboy_profile *prof = gb->profile;
+
+	fprintf(out, "# region\tbank\taddr\tinsns\tcycles\n");
+	for (size_t slot = 0; slot < prof->size; ++slot) {
+		if (!prof->insns[slot] && !prof->cycles[slot])
+			continue;
+
+		const char *region;
+		size_t bank;
+		uint16_t addr;
+		describe(prof, slot, &region, &bank, &addr);
+
+		fprintf(out, "%s\t%02lX\t%04X\t%lu\t%lu\n",
+		        region, (unsigned long)bank, addr,
+		        (unsigned long)prof->insns[slot],
+		        (unsigned long)prof->cycles[slot]);
+	}
+
+	if (ferror(out)) {
+		GBLOG("Failed to write profile file: %m");
+		return EIO;
+	}
+
+	return 0;
+}
+
+int gameboy_save_profile(struct gameboy *gb, char *path)
+{
+	if (!gb->profile) {
+		GBLOG("Profiling is not enabled");
+		return EINVAL;
+	}
+
+	FILE *out = fopen(path, "w");
+	if (!out) {
+		GBLOG("Failed to open profile file for writing: %m");
+		return errno;
+	}
+
+	settle(gb, gb->profile);
+	int rc = fwrite_profile(gb, out);
+	fclose(out);
+
+	return rc;
+}
+
+void profile_free(struct gameboy *gb)
+{
+	if (!gb->profile)
+		return;
+
+	free(gb->profile->insns);
+	free(gb->profile->cycles);
+	free(gb->profile);
+	gb->profile = NULL;
+}
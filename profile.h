@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef EGBE_PROFILE_H
+#define EGBE_PROFILE_H
+
+#include "gameboy.h"
+
+// Instructions started and cycles spent at each guest code address, with
+// every ROM and WRAM bank counted separately.  Slots are laid out as all of
+// ROM, then all of WRAM, then HRAM, then a single slot for anything else
+// (boot ROM, VRAM, cartridge RAM, OAM).
+struct gameboy_profile {
+	uint64_t *insns;
+	uint64_t *cycles;
+	size_t size;
+
+	size_t wram_base;
+	size_t hram_base;
+	size_t other;
+
+	// Cycles are charged to the previous instruction when the next starts
+	size_t last;
+	long last_cycles;
+};
+
+void profile_insn(struct gameboy *gb, uint16_t pc);
+void profile_free(struct gameboy *gb);
+
+#endif
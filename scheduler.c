@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "apu.h"
+#include "lcd.h"
+#include "perf.h"
+#include "scheduler.h"
+#include "serial.h"
+#include "timer.h"
+#include "common.h"
+#include <limits.h>
+
+// Each peripheral reports the cycle at which its sync function next has
+// work to do (LONG_MAX while idle), so the CPU only has to compare against
+// the earliest of them instead of polling every peripheral on every step.
+static const struct {
+	void (*sync)(struct gameboy *gb);
+	long (*next_event)(struct gameboy *gb);
+} events[GAMEBOY_EVENT_MAX] = {
+	[GAMEBOY_EVENT_APU]    = { apu_sync,    apu_next_event    },
+	[GAMEBOY_EVENT_LCD]    = { lcd_sync,    lcd_next_event    },
+	[GAMEBOY_EVENT_SERIAL] = { serial_sync, serial_next_event },
+	[GAMEBOY_EVENT_TIMER]  = { timer_sync,  timer_next_event  },
+};
+
+static void update_next_event(struct gameboy *gb)
+{
+	long next = LONG_MAX;
+
+	for (int i = 0; i < GAMEBOY_EVENT_MAX; ++i)
+		if (gb->event_deadlines[i] < next)
+			next = gb->event_deadlines[i];
+
+	gb->next_event_in = next;
+}
+
+void sched_sync(struct gameboy *gb)
+{
+	for (int i = 0; i < GAMEBOY_EVENT_MAX; ++i) {
+		if (gb->cycles < gb->event_deadlines[i])
+			continue;
+
+		PERF_BEGIN(PERF_EVENTS + i);
+		events[i].sync(gb);
+		PERF_END();
+		gb->event_deadlines[i] = events[i].next_event(gb);
+	}
+
+	update_next_event(gb);
+}
+
+// Must be called whenever a peripheral's deadline changes outside of its
+// own sync function (register writes, enabling/disabling, etc.)
+void sched_update(struct gameboy *gb, enum gameboy_event event)
+{
+	gb->event_deadlines[event] = events[event].next_event(gb);
+
+	update_next_event(gb);
+}
+
+void gameboy_reschedule(struct gameboy *gb)
+{
+	for (int i = 0; i < GAMEBOY_EVENT_MAX; ++i)
+		gb->event_deadlines[i] = events[i].next_event(gb);
+
+	update_next_event(gb);
+}
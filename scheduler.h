@@ -0,0 +1,10 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef EGBE_SCHEDULER_H
+#define EGBE_SCHEDULER_H
+
+#include "gameboy.h"
+
+void sched_sync(struct gameboy *gb);
+void sched_update(struct gameboy *gb, enum gameboy_event event);
+
+#endif
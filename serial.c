@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #include "cpu.h"
+#include "scheduler.h"
 #include "serial.h"
+#include <limits.h>
 
 void serial_sync(struct gameboy *gb)
 {
@@ -13,9 +15,16 @@ void serial_sync(struct gameboy *gb)
 	irq_flag(gb, GAMEBOY_IRQ_SERIAL);
 }
 
+long serial_next_event(struct gameboy *gb)
+{
+	return gb->is_serial_pending ? gb->next_serial_in : LONG_MAX;
+}
+
 void gameboy_start_serial(struct gameboy *gb, uint8_t xfer)
 {
 	gb->is_serial_pending = true;
 	gb->next_serial_in = gb->cycles + (512 * 8); // 8 shifts at 8192Hz
 	gb->next_sb = xfer;
+
+	sched_update(gb, GAMEBOY_EVENT_SERIAL);
 }
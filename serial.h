@@ -5,5 +5,6 @@
 #include "common.h"
 
 void serial_sync(struct gameboy *gb);
+long serial_next_event(struct gameboy *gb);
 
 #endif
@@ -2,6 +2,7 @@
 #include "cpu.h"
 #include "timer.h"
 #include "common.h"
+#include <limits.h>
 
 void timer_set_frequency(struct gameboy *gb, uint8_t val)
 {
@@ -34,3 +35,8 @@ void timer_sync(struct gameboy *gb)
 		irq_flag(gb, GAMEBOY_IRQ_TIMER);
 	}
 }
+
+long timer_next_event(struct gameboy *gb)
+{
+	return gb->timer_enabled ? gb->next_timer_in : LONG_MAX;
+}
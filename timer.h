@@ -6,5 +6,6 @@
 
 void timer_set_frequency(struct gameboy *gb, uint8_t val);
 void timer_sync(struct gameboy *gb);
+long timer_next_event(struct gameboy *gb);
 
 #endif
@@ -0,0 +1,243 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+#include "trace.h"
+#include "common.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// A single-producer, single-consumer ring: the emulator thread appends at
+// head and, when streaming, a writer thread drains to the file from tail.
+// Without a file the oldest entries are simply overwritten.
+struct gameboy_trace {
+	struct gameboy_trace_entry *ring;
+	size_t mask;
+	_Atomic uint64_t head;
+	_Atomic uint64_t tail;
+
+	int fd;
+	pthread_t writer;
+	atomic_bool stop;
+	atomic_bool failed;
+};
+
+// Called once the opcode has been fetched, with PC and the cycle count from
+// before the fetch
+void trace_insn(struct gameboy *gb, uint16_t pc, long cycles, uint8_t opcode)
+{
+	struct gameboy_trace *trace = gb->trace;
+	uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+
+	// A full ring stalls emulation rather than losing entries, unless the
+	// writer has given up
+	if (trace->fd >= 0)
+		while (head - atomic_load_explicit(&trace->tail, memory_order_acquire) > trace->mask &&
+		       !atomic_load_explicit(&trace->failed, memory_order_relaxed))
+			sched_yield();
+
+	gameboy_pack_flags(gb);
+
+	trace->ring[head & trace->mask] = (struct gameboy_trace_entry){
+		.cycles = cycles,
+		.pc = pc,
+		.sp = gb->sp,
+		.af = gb->af,
+		.bc = gb->bc,
+		.de = gb->de,
+		.hl = gb->hl,
+		.rom_bank = gb->rom_bank,
+		.wram_bank = gb->wram_bank,
+		.opcode = opcode,
+	};
+
+	atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return errno;
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int write_header(int fd)
+{
+	struct gameboy_trace_header header = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.entry_size = sizeof(struct gameboy_trace_entry),
+	};
+
+	return write_all(fd, &header, sizeof(header));
+}
+
+// Drains whatever the emulator has appended, in contiguous runs up to the
+// end of the ring, until asked to stop and nothing is left
+static void *writer_main(void *arg)
+{
+	struct gameboy_trace *trace = arg;
+	const struct timespec nap = { .tv_nsec = 1000000 };
+
+	for (;;) {
+		uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+		uint64_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+
+		if (head == tail) {
+			if (atomic_load(&trace->stop))
+				break;
+			nanosleep(&nap, NULL);
+			continue;
+		}
+
+		size_t start = tail & trace->mask;
+		size_t count = head - tail;
+		if (count > trace->mask + 1 - start)
+			count = trace->mask + 1 - start;
+
+		errno = write_all(trace->fd, &trace->ring[start], count * sizeof(*trace->ring));
+		if (errno) {
+			GBLOG("Failed to write trace file: %m");
+			atomic_store(&trace->failed, true);
+			break;
+		}
+
+		atomic_store_explicit(&trace->tail, tail + count, memory_order_release);
+	}
+
+	return NULL;
+}
+
+int gameboy_enable_trace(struct gameboy *gb, size_t entries, char *path)
+{
+	if (gb->trace)
+		return 0;
+
+	size_t size = 1;
+	while (size < (entries ?: TRACE_DEFAULT_ENTRIES))
+		size <<= 1;
+
+	struct gameboy_trace *trace = calloc(1, sizeof(*trace));
+	if (!trace) {
+		GBLOG("Failed to allocate trace: %m");
+		return ENOMEM;
+	}
+
+	trace->ring = malloc(size * sizeof(*trace->ring));
+	if (!trace->ring) {
+		GBLOG("Failed to allocate trace ring: %m");
+		free(trace);
+		return ENOMEM;
+	}
+	trace->mask = size - 1;
+	trace->fd = -1;
+
+	if (!path) {
+		gb->trace = trace;
+		return 0;
+	}
+
+	int rc;
+	trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (trace->fd < 0) {
+		rc = errno;
+		GBLOG("Failed to open trace file for writing: %m");
+		goto err;
+	}
+
+	rc = write_header(trace->fd);
+	if (rc) {
+		errno = rc;
+		GBLOG("Failed to write trace file: %m");
+		goto err;
+	}
+
+	rc = pthread_create(&trace->writer, NULL, writer_main, trace);
+	if (rc) {
+		errno = rc;
+		GBLOG("Failed to start trace writer: %m");
+		goto err;
+	}
+
+	gb->trace = trace;
+	return 0;
+
+err:
+	if (trace->fd >= 0)
+		close(trace->fd);
+	free(trace->ring);
+	free(trace);
+	return rc;
+}
+
+// Only the most recent entries survive in the ring, so this is meant for
+// dumping what led up to a crash or breakpoint
+int gameboy_save_trace(struct gameboy *gb, char *path)
+{
+	struct gameboy_trace *trace = gb->trace;
+	if (!trace) {
+		GBLOG("Tracing is not enabled");
+		return EINVAL;
+	}
+
+	if (trace->fd >= 0) {
+		GBLOG("Trace is already streaming to a file");
+		return EINVAL;
+	}
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		GBLOG("Failed to open trace file for writing: %m");
+		return errno;
+	}
+
+	uint64_t head = atomic_load(&trace->head);
+	uint64_t count = head > trace->mask ? trace->mask + 1 : head;
+	size_t start = (head - count) & trace->mask;
+	size_t first = count < trace->mask + 1 - start ? count : trace->mask + 1 - start;
+
+	int rc = write_header(fd);
+	if (!rc)
+		rc = write_all(fd, &trace->ring[start], first * sizeof(*trace->ring));
+	if (!rc)
+		rc = write_all(fd, trace->ring, (count - first) * sizeof(*trace->ring));
+	if (rc) {
+		errno = rc;
+		GBLOG("Failed to write trace file: %m");
+	}
+
+	close(fd);
+
+	return rc;
+}
+
+void trace_free(struct gameboy *gb)
+{
+	struct gameboy_trace *trace = gb->trace;
+	if (!trace)
+		return;
+
+	if (trace->fd >= 0) {
+		atomic_store(&trace->stop, true);
+		pthread_join(trace->writer, NULL);
+		close(trace->fd);
+	}
+
+	free(trace->ring);
+	free(trace);
+	gb->trace = NULL;
+}
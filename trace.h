@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#ifndef EGBE_TRACE_H
+#define EGBE_TRACE_H
+
+#include "gameboy.h"
+
+#define TRACE_MAGIC "EGBETRC"
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_ENTRIES (1UL << 20)
+
+// Trace files are this header followed by a flat array of entries, oldest
+// first, so they can be mapped and indexed directly
+struct gameboy_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+};
+
+// CPU state as an instruction starts, before its opcode is fetched
+struct gameboy_trace_entry {
+	uint64_t cycles;
+	uint16_t pc;
+	uint16_t sp;
+	uint16_t af;
+	uint16_t bc;
+	uint16_t de;
+	uint16_t hl;
+	uint16_t rom_bank;
+	uint8_t wram_bank;
+	uint8_t opcode;
+};
+
+void trace_insn(struct gameboy *gb, uint16_t pc, long cycles, uint8_t opcode);
+void trace_free(struct gameboy *gb);
+
+#endif
@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#define _GNU_SOURCE
+#include "trace.h"
+#include "common.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bank of the region PC is executing from, as in the profiler's reports
+static unsigned int pc_bank(const struct gameboy_trace_entry *e)
+{
+	switch (e->pc) {
+	case 0x4000 ... 0x7FFF:
+		return e->rom_bank;
+	case 0xD000 ... 0xDFFF:
+		return e->wram_bank;
+	default:
+		return 0;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s $trace [$last]\n", argv[0]);
+		return 1;
+	}
+
+	int fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		GBLOG("Failed to open trace file: %m");
+		return 1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st)) {
+		GBLOG("Failed to stat trace file: %m");
+		return 1;
+	}
+
+	const struct gameboy_trace_header *header = NULL;
+	if ((size_t)st.st_size >= sizeof(*header))
+		header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (!header || header == MAP_FAILED) {
+		GBLOG("Failed to map trace file");
+		return 1;
+	}
+
+	if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != TRACE_VERSION ||
+	    header->entry_size != sizeof(struct gameboy_trace_entry)) {
+		GBLOG("Not a version %d trace file", TRACE_VERSION);
+		return 1;
+	}
+
+	const struct gameboy_trace_entry *entries = (const void *)(header + 1);
+	size_t count = (st.st_size - sizeof(*header)) / sizeof(*entries);
+	size_t first = 0;
+	if (argc == 3) {
+		size_t last = strtoul(argv[2], NULL, 0);
+		if (last < count)
+			first = count - last;
+	}
+
+	for (size_t i = first; i < count; ++i) {
+		const struct gameboy_trace_entry *e = &entries[i];
+		printf("%12lu %02X:%04X %02X  AF=%04X BC=%04X DE=%04X HL=%04X SP=%04X\n",
+		       (unsigned long)e->cycles, pc_bank(e), e->pc, e->opcode,
+		       e->af, e->bc, e->de, e->hl, e->sp);
+	}
+
+	munmap((void *)header, st.st_size);
+	close(fd);
+
+	return 0;
+}